@@ -0,0 +1,462 @@
+// Benchmarks of the vm, run them with `meson test --benchmark` or the yoyo_vm_bench executable.
+// Every workload is run a few times to warm up then timed over a number of repetitions,
+// the median time per operation is compared against a baseline saved by an earlier run.
+#include <algorithm>
+#include <chrono>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "yoyo_vm/vm.h"
+#include "yoyo_vm/instructions.h"
+#include "yoyo_vm/assembler.h"
+#include "yoyo_vm/emitter.h"
+
+using Yvm::OpCode;
+
+namespace
+{
+    // n -> 0, i -> 1, x -> 2, updated in place through top_consume and switch
+    constexpr std::string_view arith_loop = R"(
+    const64_u8 0
+    const64_u8 1
+LOOP:
+    s_addr 0
+    s_addr 1
+    icmp_lt 64
+    jump_if_f END
+    ; x = (x * 31 + i) ^ (x >> 3)
+    const64_u8 3
+    s_addr 2
+    shr 64
+    s_addr 1
+    const64_u8 31
+    s_addr 2
+    mul64
+    add64
+    bitxor 64
+    top_consume
+    switch
+    add_imm 64 1
+    switch
+    jump LOOP
+END:
+    s_addr 2
+    ret
+)";
+
+    // n -> 0, x -> 1, y -> 2, z -> 3, i -> 4, the locals live in memory
+    constexpr std::string_view load_store = R"(
+    alloc_const 8
+    alloc_const 8
+    alloc_const 8
+    alloc_const 8
+    const64_u8 0
+    s_addr 1
+    store u64
+    const64_u8 1
+    s_addr 2
+    store u64
+    const64_u8 0
+    s_addr 4
+    store u64
+LOOP:
+    s_addr 0
+    s_addr 4
+    load u64
+    icmp_lt 64
+    jump_if_f END
+    ; z = x + y, x = y, y = z
+    s_addr 1
+    load u64
+    s_addr 2
+    load u64
+    add64
+    s_addr 3
+    store u64
+    s_addr 2
+    load u64
+    s_addr 1
+    store u64
+    s_addr 3
+    load u64
+    s_addr 2
+    store u64
+    ; i++
+    s_addr 4
+    load u64
+    add_imm 64 1
+    s_addr 4
+    store u64
+    jump LOOP
+END:
+    s_addr 2
+    load u64
+    ret
+)";
+
+    // n -> 0, a 256 entry array -> 1, i -> 2: a[i & 255] += i
+    constexpr std::string_view array_update = R"(
+    const32 2048
+    alloca
+    const64_u8 0
+LOOP:
+    s_addr 0
+    s_addr 2
+    icmp_lt 64
+    jump_if_f END
+    const64_u8 8
+    const64_u8 255
+    s_addr 2
+    bitand 64
+    mul64
+    s_addr 1
+    ptroff
+    dup
+    load u64
+    s_addr 2
+    add64
+    switch
+    store u64
+    s_addr 2
+    add_imm 64 1
+    top_consume
+    jump LOOP
+END:
+    s_addr 1
+    load u64
+    ret
+)";
+
+    // n -> 0, i -> 1, x -> 2: x = x * 0.999 + 1 / (i + 1)
+    constexpr std::string_view float_loop = R"(
+    const64_u8 0
+    const_f64 0
+LOOP:
+    s_addr 0
+    s_addr 1
+    icmp_lt 64
+    jump_if_f END
+    const_f64 1
+    s_addr 1
+    uitofp 64 64
+    fadd64
+    const_f64 1
+    fdiv64
+    const_f64 0.999
+    s_addr 2
+    fmul64
+    fadd64
+    top_consume
+    switch
+    add_imm 64 1
+    switch
+    jump LOOP
+END:
+    s_addr 2
+    ret
+)";
+
+    // n -> 0, i -> 1, i = add_one(i) through the vm's native call handler
+    constexpr std::string_view native_loop = R"(
+    const64_u8 0
+LOOP:
+    s_addr 0
+    s_addr 1
+    icmp_lt 64
+    jump_if_f END
+    s_addr 1
+    const_ptr 0
+    const_ptr {}
+    native_call 1
+    top_consume
+    jump LOOP
+END:
+    s_addr 1
+    ret
+)";
+
+    uint64_t add_one(uint64_t value)
+    {
+        return value + 1;
+    }
+    Yvm::VM::Type call_native(void* function, Yvm::VM::Type* begin, size_t, void*)
+    {
+        return Yvm::VM::Type{ .u64 = reinterpret_cast<uint64_t(*)(uint64_t)>(function)(begin[0].u64) };
+    }
+
+    /// Instructions of @p listing from label @p from up to label @p to, empty labels stand for its start and end
+    uint64_t count_instructions(std::string_view listing, std::string_view from = {}, std::string_view to = {})
+    {
+        uint64_t count = 0;
+        bool inside = from.empty();
+        std::istringstream lines{ std::string(listing) };
+        for (std::string line; std::getline(lines, line);) {
+            line = line.substr(0, line.find(';'));
+            auto first = line.find_first_not_of(" \t");
+            if (first == std::string::npos) continue;
+            line = line.substr(first, line.find_last_not_of(" \t") + 1 - first);
+            if (line.back() == ':') {
+                auto label = std::string_view(line).substr(0, line.size() - 1);
+                if (label == from) inside = true;
+                if (label == to) break;
+                continue;
+            }
+            if (inside) count++;
+        }
+        return count;
+    }
+    /// every loop starts with the same condition, it runs once more than the body
+    constexpr uint64_t loop_condition = 4;
+    /// instructions in a function emitted by @c emit_fib_rec
+    constexpr uint64_t fib_rec_size = 18;
+
+    /// fib(n) = n < 2 ? n : fib(n - 2) + fib(n - 1), mostly measures call overhead
+    void emit_fib_rec(Yvm::Module* mod, const std::string& name)
+    {
+        Yvm::Emitter em(false);
+        em.write_const<uint32_t>(2);
+        em.write_2b_inst(OpCode::StackAddr, 0);
+        em.write_2b_inst(OpCode::ICmpLt, 32);
+        auto recurse = em.unq_label_name("recurse");
+        em.create_jump(OpCode::JumpIfFalse, recurse);
+        em.write_2b_inst(OpCode::StackAddr, 0);
+        em.write_1b_inst(OpCode::Ret);
+
+        em.create_label(recurse);
+        em.write_const<uint32_t>(2);
+        em.write_2b_inst(OpCode::StackAddr, 0);
+        em.write_1b_inst(OpCode::Sub32);
+        em.write_fn_addr(name);
+        em.write_2b_inst(OpCode::Call, 1);
+        em.write_const<uint32_t>(1);
+        em.write_2b_inst(OpCode::StackAddr, 0);
+        em.write_1b_inst(OpCode::Sub32);
+        em.write_fn_addr(name);
+        em.write_2b_inst(OpCode::Call, 1);
+        em.write_1b_inst(OpCode::Add32);
+        em.write_1b_inst(OpCode::Ret);
+        em.close_function(mod, name);
+    }
+    /// calls fib_rec(n) makes, and the instructions they run: 6 in a leaf, 16 otherwise
+    std::pair<uint64_t, uint64_t> fib_rec_cost(uint32_t n)
+    {
+        uint64_t calls[2] = { 1, 1 }, insts[2] = { 6, 6 };
+        for (uint32_t i = 2; i <= n; i++) {
+            uint64_t c = 1 + calls[0] + calls[1], k = 16 + insts[0] + insts[1];
+            calls[0] = calls[1]; insts[0] = insts[1];
+            calls[1] = c; insts[1] = k;
+        }
+        return n < 2 ? std::pair{ calls[0], insts[0] } : std::pair{ calls[1], insts[1] };
+    }
+
+    struct Options
+    {
+        int warmup = 2;
+        int repetitions = 7;
+        /// multiplies the size of every workload
+        double scale = 1;
+        bool jit = false;
+        std::string filter;
+        std::string baseline;
+        std::string save;
+        /// how much slower than the baseline a workload may get, relative
+        double threshold = 0.1;
+    };
+
+    struct Workload
+    {
+        std::string name;
+        /// what one operation is, for the report
+        std::string unit;
+        /// operations a run does and the bytecode instructions they run (or assemble, or link)
+        uint64_t ops;
+        uint64_t instructions;
+        std::function<void()> run;
+        /// called before every run, outside of the timing
+        std::function<void()> prepare = [] {};
+    };
+    struct Result
+    {
+        double median_ns;
+        double min_ns;
+        /// median absolute deviation, relative to the median
+        double spread;
+    };
+
+    Result measure(const Workload& workload, const Options& options)
+    {
+        for (int i = 0; i < options.warmup; i++) {
+            workload.prepare();
+            workload.run();
+        }
+        std::vector<double> per_op;
+        for (int i = 0; i < options.repetitions; i++) {
+            workload.prepare();
+            auto start = std::chrono::steady_clock::now();
+            workload.run();
+            auto end = std::chrono::steady_clock::now();
+            per_op.push_back(std::chrono::duration<double, std::nano>(end - start).count() / static_cast<double>(workload.ops));
+        }
+        auto median = [](std::vector<double> values) {
+            std::ranges::sort(values);
+            auto mid = values.size() / 2;
+            return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+            };
+        Result result{ median(per_op), std::ranges::min(per_op), 0 };
+        std::vector<double> deviations;
+        for (auto value : per_op) deviations.push_back(std::abs(value - result.median_ns));
+        result.spread = median(deviations) / result.median_ns;
+        return result;
+    }
+
+    std::map<std::string, double> load_baseline(const std::string& path)
+    {
+        std::map<std::string, double> baseline;
+        std::ifstream file(path);
+        std::string name;
+        double ns;
+        while (file >> name >> ns) baseline[name] = ns;
+        return baseline;
+    }
+
+    bool parse_options(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++) {
+            std::string_view arg = argv[i];
+            auto value = [&]() -> std::string_view { return i + 1 < argc ? argv[++i] : ""; };
+            auto number = [&](auto& out) {
+                auto text = value();
+                return std::from_chars(text.data(), text.data() + text.size(), out).ec == std::errc{};
+                };
+            bool valid = true;
+            if (arg == "--warmup") valid = number(options.warmup);
+            else if (arg == "--repetitions") valid = number(options.repetitions) && options.repetitions > 0;
+            else if (arg == "--scale") valid = number(options.scale) && options.scale > 0;
+            else if (arg == "--threshold") valid = number(options.threshold);
+            else if (arg == "--jit") options.jit = true;
+            else if (arg == "--filter") options.filter = value();
+            else if (arg == "--baseline") options.baseline = value();
+            else if (arg == "--save") options.save = value();
+            else valid = false;
+            if (!valid) {
+                std::cerr << "usage: " << argv[0] << " [--warmup N] [--repetitions N] [--scale X] [--jit] [--filter TEXT]\n"
+                    "       [--baseline FILE] [--threshold FRACTION] [--save FILE]\n";
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_options(argc, argv, options)) return 2;
+    auto size = [&](double n) { return static_cast<uint64_t>(std::max(1.0, n * options.scale)); };
+
+    Yvm::Module mod;
+    Yvm::Assembler asma;
+    std::string native_listing = std::format(native_loop, reinterpret_cast<uint64_t>(&add_one));
+    std::pair<const char*, std::string_view> listings[] = {
+        { "arith_loop", arith_loop }, { "load_store", load_store }, { "array_update", array_update },
+        { "float_loop", float_loop }, { "native_call", native_listing },
+    };
+    for (auto [name, listing] : listings) {
+        mod.code[name] = asma.assemble(listing);
+        if (asma.error) {
+            std::cerr << name << ":" << asma.error->line << ":" << asma.error->column << ": " << asma.error->message << "\n";
+            return 2;
+        }
+    }
+    emit_fib_rec(&mod, "fib_rec");
+
+    Yvm::VM vm;
+    // compiled code is measured with --jit, everything else stays interpreted
+    vm.jit_threshold = options.jit ? 1 : 0;
+    vm.do_native_call = call_native;
+    for (auto& [name, error] : vm.add_module(&mod)) {
+        std::cerr << name << " failed verification at " << error.offset << ": " << error.message << "\n";
+        return 2;
+    }
+    for (auto& sym : vm.link()) std::cerr << "unresolved symbol: " << sym << "\n";
+    auto runner = vm.new_runner();
+
+    std::vector<Workload> workloads;
+    // compiled runs are kept apart from interpreted ones in the baseline
+    std::string mode = options.jit ? ".jit" : "";
+    auto add_loop = [&](const char* name, std::string_view listing, uint64_t n) {
+        auto per_iteration = count_instructions(listing, "LOOP", "END");
+        auto outside = count_instructions(listing) - per_iteration + loop_condition;
+        workloads.push_back({ name + mode, "iteration", n, n * per_iteration + outside, [&runner, &mod, name, n] {
+            Yvm::VM::Type arg{ .u64 = n };
+            runner.run_code(mod.code[name].data(), &arg, 1);
+            } });
+        };
+    add_loop("arith_loop", arith_loop, size(2'000'000));
+    add_loop("load_store", load_store, size(1'000'000));
+    add_loop("array_update", array_update, size(1'000'000));
+    add_loop("float_loop", float_loop, size(2'000'000));
+    add_loop("native_call", native_listing, size(1'000'000));
+
+    auto fib_n = static_cast<uint32_t>(std::clamp(std::round(25 + std::log2(options.scale) / std::log2(1.618)), 2.0, 40.0));
+    auto [fib_calls, fib_insts] = fib_rec_cost(fib_n);
+    workloads.push_back({ "fib_rec" + mode, "call", fib_calls, fib_insts, [&runner, &mod, fib_n] {
+        Yvm::VM::Type arg{ .u32 = fib_n };
+        runner.run_code(mod.code["fib_rec"].data(), &arg, 1);
+        } });
+
+    // the tools: every run assembles or links its own copies
+    auto functions = size(2000);
+    workloads.push_back({ "assemble", "function", functions, functions * count_instructions(load_store), [functions] {
+        Yvm::Assembler assembler;
+        for (uint64_t i = 0; i < functions; i++) assembler.assemble(load_store);
+        } });
+    // emitted again before every run, a copy would keep the externals of the original's code
+    Yvm::Module linked;
+    workloads.push_back({ "link", "function", functions, functions * fib_rec_size, [&linked] {
+        Yvm::VM linker;
+        linker.add_module(&linked);
+        linker.link();
+        }, [&linked, functions] {
+        linked = {};
+        for (uint64_t i = 0; i < functions; i++) emit_fib_rec(&linked, std::format("fib_{}", i));
+        } });
+
+    auto baseline = options.baseline.empty() ? std::map<std::string, double>{} : load_baseline(options.baseline);
+    // saving updates the workloads that ran and keeps the others
+    auto saved = options.save.empty() ? std::map<std::string, double>{} : load_baseline(options.save);
+    bool regressed = false;
+    std::cout << std::format("{:<28} {:>12} {:>12} {:>8} {:>14}  {}\n", "workload", "ns/op", "min ns/op", "spread", "insts/s", "vs baseline");
+    for (auto& workload : workloads) {
+        if (!options.filter.empty() && workload.name.find(options.filter) == std::string::npos) continue;
+        auto result = measure(workload, options);
+        auto ips = workload.instructions ? std::format("{:.3g}", workload.instructions / (result.median_ns * workload.ops) * 1e9) : "-";
+        std::string compared;
+        if (auto it = baseline.find(workload.name); it != baseline.end()) {
+            auto change = result.median_ns / it->second - 1;
+            compared = std::format("{:+.1f}%", change * 100);
+            if (change > options.threshold) {
+                compared += " REGRESSED";
+                regressed = true;
+            }
+        }
+        std::cout << std::format("{:<28} {:>12.2f} {:>12.2f} {:>7.1f}% {:>14}  {}\n", workload.name + " (" + workload.unit + ")",
+            result.median_ns, result.min_ns, result.spread * 100, ips, compared);
+        saved[workload.name] = result.median_ns;
+    }
+    if (!options.save.empty()) {
+        std::ofstream save(options.save);
+        for (auto& [name, ns] : saved) save << name << ' ' << ns << '\n';
+    }
+    return regressed ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "common.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "stack_region.h"
+
+namespace Yvm
+{
+    /// Heap of a single runner: blocks are bumped off a reserved region and recycled through one free list
+    /// per power of two size class, so its owner allocates and frees without locking.
+    /// Blocks freed from another thread (see @link deallocate_shared) are handed back to the owner, which takes them
+    /// at its next allocation. Memory goes back to the region only all at once, with @link reset.
+    /// Every live arena is registered by its address range so a block can be traced back to its arena
+    class YVM_API Arena
+    {
+        StackRegion region;
+        /// bytes bumped off the region so far
+        size_t top = 0;
+        /// first free block of each size class, a free block holds the next one in its first word
+        std::array<void*, 64> free_lists{};
+        /// blocks freed by other threads, linked the same way
+        std::atomic<void*> remote_frees{ nullptr };
+        /// Move the blocks other threads freed to the free lists
+        void take_remote_frees();
+    public:
+        /// every block is preceded by a header holding its size class, which keeps blocks aligned to it too
+        static constexpr size_t header_size = 16;
+        /// the smallest block, as a power of two
+        static constexpr size_t min_class = 4;
+        /// Reserve (but don't commit) @p max_size bytes for the blocks and their headers
+        explicit Arena(size_t max_size);
+        ~Arena();
+        /// registered by address, so it stays where it was made
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        /// Allocate @p size bytes aligned to @c header_size
+        /// @return null if the region is exhausted
+        void* allocate(size_t size);
+        /// Give back a block of @link allocate, null is ignored. Only from the thread using the arena
+        void deallocate(void* ptr);
+        /// Give back @p ptr to the live arena whose region holds it, from any thread
+        /// @return false if no live arena holds it
+        static bool deallocate_shared(void* ptr);
+        /// whether @p ptr is in a block handed out since the last @link reset
+        bool owns(const void* ptr) const { return ptr >= region.data() && ptr < region.data() + top; }
+        /// whether @p ptr is anywhere in the reserved region, blocks dropped by @link reset included
+        bool reserves(const void* ptr) const { return ptr >= region.data() && ptr < region.data() + region.capacity(); }
+        /// Drop every block at once, the committed memory is kept for the next ones
+        void reset();
+        /// bytes taken from the region, freed blocks included
+        size_t used() const { return top; }
+    };
+}
@@ -3,15 +3,53 @@
 #include <vector>
 #include <string_view>
 #include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
 #include <unordered_map>
+#include <utility>
 
 namespace Yvm
 {
+    class Module;
+    /// Where and why assembling failed, lines and columns start at 1
+    struct YVM_API AssemblerError
+    {
+        size_t line;
+        size_t column;
+        std::string message;
+    };
+    /// Assembles a text listing, one instruction per line: a mnemonic followed by its space separated operands.
+    /// Every opcode has a mnemonic (see @c opcode_table), lines may start with a @c label:
+    /// and anything after a @c ; is a comment.
+    /// @c br, @c br_if_f and @c br_if_t (or @c jump, @c jump_if_f, @c jump_if_t) pick their offset size,
+    /// branches to labels ahead of them take 32 bits
     class YVM_API Assembler
     {
+        struct PendingBranch
+        {
+            /// offset of the branch instruction, the offset is relative to it
+            size_t inst_off;
+            /// size of the offset in bytes
+            uint8_t size;
+            std::string_view label;
+            size_t line;
+            size_t column;
+        };
         std::unordered_map<std::string_view, uint64_t> jump_addrs;
-        std::unordered_map<size_t, std::string_view> unresolved_jumps;
+        /// byte offset of a forward branch's operand -> the branch
+        std::unordered_map<size_t, PendingBranch> unresolved_jumps;
     public:
+        /// Why the last @link assemble failed, empty if it succeeded
+        std::optional<AssemblerError> error;
+        /// Assemble the function in @p code in a single pass, branches to labels ahead are patched at the end
+        /// @return the code or an empty vector if @p code is invalid, see @c error
         std::vector<uint64_t> assemble(std::string_view code);
+        /// Assemble every (name, source) pair of @p functions on up to @p threads threads (0 uses every core)
+        /// and add them to @p module in the order given, so the result doesn't depend on the thread count.
+        /// Each function gets its own assembler
+        /// @return the name and error of the functions that failed to assemble, those aren't added
+        static std::vector<std::pair<std::string, AssemblerError>> assemble_all(
+            std::span<const std::pair<std::string, std::string_view>> functions, Module& module, unsigned threads = 0);
     };
 }
@@ -0,0 +1,137 @@
+#pragma once
+#include "common.h"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "instructions.h"
+
+// Families of type specialized operations, the order inside a family is relied upon by the decoder
+#define YVM_INT_OPS(X, NAME) X(NAME##8) X(NAME##16) X(NAME##32) X(NAME##64)
+#define YVM_FP_OPS(X, NAME) X(NAME##32) X(NAME##64)
+#define YVM_TYPED_OPS(X, NAME) \
+    X(NAME##I8) X(NAME##I16) X(NAME##I32) X(NAME##I64) \
+    X(NAME##U8) X(NAME##U16) X(NAME##U32) X(NAME##U64) \
+    X(NAME##F32) X(NAME##F64) X(NAME##Ptr)
+#define YVM_INT_TO_INT_OPS(X, NAME) \
+    X(NAME##8To8) X(NAME##8To16) X(NAME##8To32) X(NAME##8To64) \
+    X(NAME##16To8) X(NAME##16To16) X(NAME##16To32) X(NAME##16To64) \
+    X(NAME##32To8) X(NAME##32To16) X(NAME##32To32) X(NAME##32To64) \
+    X(NAME##64To8) X(NAME##64To16) X(NAME##64To32) X(NAME##64To64)
+#define YVM_FP_TO_INT_OPS(X, NAME) \
+    X(NAME##32To8) X(NAME##32To16) X(NAME##32To32) X(NAME##32To64) \
+    X(NAME##64To8) X(NAME##64To16) X(NAME##64To32) X(NAME##64To64)
+#define YVM_INT_TO_FP_OPS(X, NAME) \
+    X(NAME##8To32) X(NAME##8To64) X(NAME##16To32) X(NAME##16To64) \
+    X(NAME##32To32) X(NAME##32To64) X(NAME##64To32) X(NAME##64To64)
+
+/// Every operation of the pre-decoded instruction stream
+/// Operations that took a type or size byte in the bytecode are split into one operation per type
+#define YVM_DECODED_OPS(X) \
+    X(Nop) \
+    YVM_INT_OPS(X, Add) YVM_INT_OPS(X, Sub) YVM_INT_OPS(X, Mul) \
+    YVM_INT_OPS(X, IDiv) YVM_INT_OPS(X, UDiv) YVM_INT_OPS(X, IRem) YVM_INT_OPS(X, URem) \
+    YVM_FP_OPS(X, FAdd) YVM_FP_OPS(X, FSub) YVM_FP_OPS(X, FMul) YVM_FP_OPS(X, FDiv) \
+    X(Or) X(And) X(Not) \
+    X(Alloca) X(MemCpy) X(Malloc) X(Free) X(PtrOff) \
+    X(FNeg32) X(FNeg64) \
+    X(ExternalIntrinsic) \
+    X(Jump) X(JumpIfFalse) X(JumpDirect) X(JumpIfFalseDirect) \
+    X(Ret) X(RetVoid) \
+    X(Const) \
+    X(RegObj) X(Panic) X(CheckReg) X(PopReg) X(Pop) X(Checkpoint) X(Dup) X(Switch) X(TopConsume) \
+    YVM_INT_OPS(X, CmpEq) YVM_INT_OPS(X, CmpNe) \
+    YVM_INT_OPS(X, UCmpGt) YVM_INT_OPS(X, UCmpGe) YVM_INT_OPS(X, UCmpLt) YVM_INT_OPS(X, UCmpLe) \
+    YVM_INT_OPS(X, ICmpGt) YVM_INT_OPS(X, ICmpGe) YVM_INT_OPS(X, ICmpLt) YVM_INT_OPS(X, ICmpLe) \
+    YVM_FP_OPS(X, FCmpEq) YVM_FP_OPS(X, FCmpNe) YVM_FP_OPS(X, FCmpGt) \
+    YVM_FP_OPS(X, FCmpGe) YVM_FP_OPS(X, FCmpLt) YVM_FP_OPS(X, FCmpLe) \
+    YVM_INT_OPS(X, Shl) YVM_INT_OPS(X, Shr) YVM_INT_OPS(X, BitAnd) YVM_INT_OPS(X, BitOr) YVM_INT_OPS(X, BitXor) \
+    X(StackAddr) X(RevStackAddr) X(StackCheckpoint) X(PtrOffConst) X(AllocaConst) \
+    X(Call) X(CallDirect) X(NativeCall) X(NativeCallDirect) \
+    YVM_TYPED_OPS(X, Load) YVM_TYPED_OPS(X, Store) \
+    YVM_INT_TO_INT_OPS(X, UConv) YVM_INT_TO_INT_OPS(X, SConv) \
+    X(FpConv32To32) X(FpConv32To64) X(FpConv64To32) X(FpConv64To64) \
+    YVM_FP_TO_INT_OPS(X, FpToSi) YVM_FP_TO_INT_OPS(X, FpToUi) \
+    YVM_INT_TO_FP_OPS(X, UiToFp) YVM_INT_TO_FP_OPS(X, SiToFp) \
+    YVM_TYPED_OPS(X, LoadLocal) YVM_TYPED_OPS(X, StoreLocal) YVM_INT_OPS(X, AddImm) \
+    X(BrIfFalse) X(BrIfTrue) \
+    YVM_INT_OPS(X, JumpIfNotCmpEq) YVM_INT_OPS(X, JumpIfNotCmpNe) \
+    YVM_INT_OPS(X, JumpIfNotUCmpGt) YVM_INT_OPS(X, JumpIfNotUCmpGe) YVM_INT_OPS(X, JumpIfNotUCmpLt) YVM_INT_OPS(X, JumpIfNotUCmpLe) \
+    YVM_INT_OPS(X, JumpIfNotICmpGt) YVM_INT_OPS(X, JumpIfNotICmpGe) YVM_INT_OPS(X, JumpIfNotICmpLt) YVM_INT_OPS(X, JumpIfNotICmpLe) \
+    YVM_FP_OPS(X, JumpIfNotFCmpEq) YVM_FP_OPS(X, JumpIfNotFCmpNe) YVM_FP_OPS(X, JumpIfNotFCmpGt) \
+    YVM_FP_OPS(X, JumpIfNotFCmpGe) YVM_FP_OPS(X, JumpIfNotFCmpLt) YVM_FP_OPS(X, JumpIfNotFCmpLe) \
+    X(Invalid)
+
+namespace Yvm
+{
+#define YVM_DECODED_ENUM(OP) OP,
+    enum class DecodedOp : uint16_t { YVM_DECODED_OPS(YVM_DECODED_ENUM) };
+#undef YVM_DECODED_ENUM
+    constexpr size_t decoded_op_count = static_cast<size_t>(DecodedOp::Invalid) + 1;
+
+    /// What a code generator knows about a function beyond its code,
+    /// attached through @c Module::function_info
+    struct FunctionInfo
+    {
+        /// number of checkpoint slots the function uses
+        uint32_t checkpoint_count = 0;
+    };
+
+    /// A single fixed width instruction of the pre-decoded stream
+    struct DecodedInst
+    {
+        DecodedOp op;
+        /// The byte operand of the instruction (stack index, argument count, checkpoint...)
+        uint8_t arg = 0;
+        /// Index of the target instruction for direct jumps and branches,
+        /// the slot in @c DecodedFunction::call_cache for @c Call
+        uint32_t target = 0;
+        /// The constant pushed by @c Const (or added by @c AddImm), already extended to 64 bits.
+        /// For @c CallDirect it's the callee's @c FunctionSlot, for @c NativeCallDirect the bound function's trampoline
+        uint64_t imm = 0;
+    };
+    static_assert(sizeof(DecodedInst) == 16);
+
+    /// A function translated out of its packed bytecode form.
+    /// Constants are unpacked (no alignment math at runtime) and every
+    /// type or size operand is folded into the operation itself
+    struct YVM_API DecodedFunction
+    {
+        /// always terminated by an @c Invalid instruction, so running off the end panics
+        std::vector<DecodedInst> code;
+        /// byte offset in the original bytecode of each instruction in @c code
+        std::vector<uint32_t> offsets;
+        /// the bytecode this was decoded from
+        const uint64_t* source = nullptr;
+        /// upper bound of the slots the function pushes above its arguments,
+        /// the instruction count until @c verify sets the exact depth
+        uint32_t max_stack = 0;
+        /// arguments the function reaches below its own values, set by @c verify.
+        /// Calls with fewer panic
+        uint32_t min_args = 0;
+        /// number of checkpoint slots a call needs
+        uint32_t checkpoint_count = 0;
+        /// calls so far, counted until the function gets compiled by the jit
+        mutable uint32_t call_count = 0;
+        /// machine code entry published by the jit, only accessed atomically
+        mutable void* jit_entry = nullptr;
+        /// what the runner remembers of the callee last seen by each @c Call, only accessed atomically
+        mutable std::vector<const void*> call_cache;
+        /// Index of the instruction at byte offset @p offset,
+        /// or the index of the terminating @c Invalid if no instruction starts there
+        uint32_t index_of(uint64_t offset) const;
+    };
+
+    /// The name of @p op as it's spelled in @c YVM_DECODED_OPS
+    YVM_API std::string_view operation_name(DecodedOp op);
+    /// Whether @p op jumps to @c DecodedInst::target, whose byte offset is kept in @c DecodedInst::imm
+    YVM_API bool is_direct_jump(DecodedOp op);
+
+    /// Translate a function's bytecode into its pre-decoded form
+    /// Malformed instructions become @c DecodedOp::Invalid which panics when executed
+    /// @param info if given, checkpoint ids outside of its @c checkpoint_count are malformed,
+    /// otherwise the slot count is taken from the highest id in the code
+    YVM_API DecodedFunction decode(std::span<const uint64_t> code, const FunctionInfo* info = nullptr);
+}
@@ -2,11 +2,17 @@
 #include <span>
 #include <string>
 #include "vm.h"
+#include "profiler.h"
 namespace Yvm 
 {
     class YVM_API Disassembler
     {
     public:
+        /// share of a function's cycles from which @link annotate marks a line as hot
+        static constexpr double hot_share = 5.0;
         static std::string disassemble(std::span<const uint64_t>, const VM* vm);
+        /// Disassemble a function with what @p profile recorded of it in front of each line:
+        /// the times the instruction ran and its share of the function's cycles, hot lines are marked with @c >>
+        static std::string annotate(std::span<const uint64_t> code, const VM& vm, const Profile& profile);
     };
 }
\ No newline at end of file
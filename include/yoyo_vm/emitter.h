@@ -1,7 +1,11 @@
 #pragma once
 #include "common.h"
+#include <functional>
+#include <limits>
 #include <set>
+#include <span>
 #include <unordered_map>
+#include <utility>
 #include <string>
 #include <vector>
 
@@ -10,12 +14,6 @@
 #include "vm.h"
 namespace Yvm
 {
-    enum class Type : uint8_t
-    {
-        i8 = 0, i16 = 1, i32 = 2, i64 = 3,
-        u8 = 4, u16 = 5, u32 = 6, u64 = 7,
-        f32 = 8, f64 = 9, ptr = 10,
-    };
     struct YVM_API ConstString {
         const char* data;
         size_t size;
@@ -28,15 +26,29 @@ namespace Yvm
         Writer alloca_writer;
         std::unordered_map<std::string, uint64_t> jump_addrs;
         std::vector<std::pair<size_t, std::string>> function_addrs;
-        std::unordered_map<size_t, std::string> unresolved_jumps;
+        /// byte offset of a forward branch's offset -> (offset of the branch, label)
+        std::unordered_map<size_t, std::pair<size_t, std::string>> unresolved_jumps;
         std::set<std::string> label_reservations;
         size_t last_alloc = 0;
         size_t last_checkpoint = 0;
         std::string unique_name_from(const std::string& name) const;
+        /// Re-encode the finished function giving every branch the smallest offset that reaches its label
+        /// and fusing superinstructions, its function addresses are relocated
+        void finish_code();
         bool unify_alloca;
     public:
         Emitter(bool unify_alloca = true);
+        /// Writes the code of one function, @link emit_all closes it
+        using EmitFunction = std::function<void(Emitter& emitter)>;
+        /// Emit every (name, function) pair of @p functions on up to @p threads threads (0 uses every core).
+        /// Each function gets a fresh emitter and its own module, they are merged into @p module
+        /// in the order given, so the result doesn't depend on the thread count.
+        /// @link create_const_string may be used from the emitting functions
+        static void emit_all(std::span<const std::pair<std::string, EmitFunction>> functions, Module& module,
+            unsigned threads = 0, bool unify_alloca = true);
         OpCode last_inst;
+        /// Whether @link close_function fuses the function's code into superinstructions
+        bool superinstructions = true;
         /// Emit a single byte instruction (eg add32)
         void write_1b_inst(OpCode code);
         /// Emit a 2 byte instruction (eg stackaddr)
@@ -55,11 +67,14 @@ namespace Yvm
         /// you can use this label to jump even before calling @link create_label.
         /// If you do, you must call @link resolve_jumps to substitute the correct address
         std::string unq_label_name(const std::string& name);
-        /// Create a constant jump to a specified label
-        /// Jump is also a 1 byte instruction if you want to use dynamic offsets
+        /// Create a relative branch to a specified label
+        /// @p code is @c Jump, @c JumpIfFalse or one of the @c Br families, the size of the offset is picked by @link close_function.
+        /// Jump is also a 1 byte instruction if you want to use dynamic offsets, those don't pass verification though
         void create_jump(OpCode code, const std::string& label_name);
         /// write the address of a function as a constant
         void write_fn_addr(const std::string& fn_name);
+        /// Call the native function bound as @p fn_name (see @c VM::bind) with the top @p arg_size values
+        void write_native_call(const std::string& fn_name, uint8_t arg_size);
         /// write a pointer to a string constant
         void write_const_string(const ConstString& str);
         size_t last_alloc_addr();
@@ -93,7 +108,8 @@ namespace Yvm
         /// The reference is invalidated once the @c write_fn_addr is called again
         std::string& get_last_inserted_function();
         /// Insert a stack checkpoint
-        /// and return the index of the inserted checkpoint
+        /// and return the index of the inserted checkpoint.
+        /// The number of checkpoints is recorded in the module's @c function_info by @link close_function
         size_t checkpoint();
     };
 
@@ -127,15 +143,15 @@ namespace Yvm
         else if constexpr (std::is_same_v<int64_t, T>)
         {
             if (value <= std::numeric_limits<int8_t>::max() && value >= std::numeric_limits<int8_t>::min()) {
-                write_1b_inst(OpCode::Constant64FromU8);
+                write_1b_inst(OpCode::Constant64FromI8);
                 writer.write_n<int8_t>(value);
             }
             else if (value <= std::numeric_limits<int16_t>::max() && value >= std::numeric_limits<int16_t>::min()) {
-                write_1b_inst(OpCode::Constant64FromU16);
+                write_1b_inst(OpCode::Constant64FromI16);
                 writer.write_n<int16_t>(value);
             }
             else if (value <= std::numeric_limits<int32_t>::max() && value >= std::numeric_limits<int32_t>::min()) {
-                write_1b_inst(OpCode::Constant64FromU32);
+                write_1b_inst(OpCode::Constant64FromI32);
                 writer.write_n<int32_t>(value);
             }
             else {
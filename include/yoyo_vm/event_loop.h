@@ -0,0 +1,69 @@
+#pragma once
+#include "common.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "vm.h"
+
+namespace Yvm
+{
+    /// Runs many calls of linked functions on the thread calling @link run, taking turns of a budget each.
+    /// A call whose native function defers (see @c VMRunner::defer_native_call) parks without holding the thread,
+    /// it's resumed once its @c Completion completes, from any thread.
+    /// While every call waits the loop sleeps in @c epoll, together with any descriptor given to @link watch
+    /// (a local service's socket or timer for example). Elsewhere than Linux it sleeps on a condition variable
+    /// and can't watch descriptors
+    class YVM_API EventLoop
+    {
+        struct Task
+        {
+            uint64_t* code;
+            std::vector<VM::Type> args;
+            std::promise<std::optional<VM::Type>> result;
+            std::optional<VMRunner> runner;
+        };
+        /// what other threads hand to the loop, kept alive by the completion callbacks that may outlive it
+        struct Inbox;
+        VM& vm;
+        RunnerConfig config;
+        Budget turn;
+        std::shared_ptr<Inbox> inbox;
+        std::deque<std::unique_ptr<Task>> ready;
+        std::unordered_map<Task*, std::unique_ptr<Task>> waiting;
+        std::vector<VMRunner> free_runners;
+        std::unordered_map<int, std::function<void(uint32_t)>> watched;
+        int epoll_fd = -1;
+        /// Move new calls and completed ones to @c ready, sleeping until there's one if @p block
+        void poll(bool block);
+        /// Run one turn of the call in front of @c ready
+        void step();
+    public:
+        /// @param turn the budget a call runs for before the next one's turn, one of each is enough
+        /// @param config the configuration of every call's runner
+        explicit EventLoop(VM& vm, const Budget& turn = { .instructions = 1 << 14 }, const RunnerConfig& config = {});
+        /// Calls left unfinished are dropped, their results are empty
+        ~EventLoop();
+        EventLoop(const EventLoop&) = delete;
+        EventLoop& operator=(const EventLoop&) = delete;
+
+        /// Queue a call of the function at @p code with @p args, from any thread
+        /// @return its result, empty if it panicked
+        std::future<std::optional<VM::Type>> submit(uint64_t* code, std::vector<VM::Type> args);
+        /// Run the queued calls until none is left, calls submitted before that included
+        void run();
+        /// Call @p callback with the ready events whenever @p fd is ready for @p events (@c EPOLLIN ...)
+        /// while the loop runs, from the loop's thread
+        /// @return false if it can't be watched
+        bool watch(int fd, uint32_t events, std::function<void(uint32_t)> callback);
+        void unwatch(int fd);
+        /// calls that haven't finished, parked ones included. Call it from the loop's thread
+        size_t pending() const;
+    };
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "common.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "vm.h"
+
+namespace Yvm
+{
+    /// Runs calls of linked functions on a fixed set of worker threads, each with a runner of its own.
+    /// Calls are queued on the workers in turn, a worker that runs out of calls steals the newest
+    /// of another worker's queue. A call made from a worker (from a native function for example) is queued
+    /// on that worker too, if that worker waits on it before another one steals it the call runs right there
+    class YVM_API Executor
+    {
+        struct Task
+        {
+            uint64_t* code;
+            std::vector<VM::Type> args;
+            std::promise<std::optional<VM::Type>> result;
+            /// for a call submitted from a worker, set by whoever runs it first: a worker or the thread waiting on it
+            std::shared_ptr<std::atomic<bool>> claimed;
+        };
+        /// a worker's queue, padded so workers don't share a cache line
+        struct alignas(64) Worker
+        {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+        VM& vm;
+        RunnerConfig config;
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::vector<std::thread> threads;
+        /// the worker the next call from outside the workers is queued on
+        std::atomic<size_t> next_worker{ 0 };
+        /// calls in the queues, changed with the queue's mutex held
+        std::atomic<size_t> queued{ 0 };
+        std::atomic<size_t> sleeping{ 0 };
+        std::mutex sleep_mutex;
+        std::condition_variable wake;
+        bool stopping = false;
+        void work(size_t self);
+        /// take the next call of worker @p self, or steal one
+        std::optional<Task> take(size_t self);
+    public:
+        /// Start @p threads workers (0 starts one per core) running the linked functions of @p vm
+        /// @param config the configuration of every worker's runner
+        explicit Executor(VM& vm, unsigned threads = 0, const RunnerConfig& config = {});
+        /// Run every queued call, then stop the workers
+        ~Executor();
+        Executor(const Executor&) = delete;
+        Executor& operator=(const Executor&) = delete;
+
+        /// Queue a call of the function at @p code with @p args
+        /// @return its result, empty if it panicked. A worker whose runner panicked continues with a new runner.
+        /// Submitted from a worker the result is deferred: waiting on it runs the call on a runner of its own
+        /// unless a worker already took it, so a worker never waits on a call only it could run
+        std::future<std::optional<VM::Type>> submit(uint64_t* code, std::vector<VM::Type> args);
+        size_t thread_count() const { return threads.size(); }
+    };
+}
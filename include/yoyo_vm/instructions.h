@@ -123,7 +123,29 @@ namespace Yvm{
         UConv, SConv,
         FpConv,
         FpToSi, FpToUi, UiToFp, SiToFp,
-        
+        //------Superinstructions, the Emitter fuses common sequences into them------
+        // stack index then type: s_addr n; load/store type
+        LoadLocal, StoreLocal,
+        // width then a signed 8 bit immediate: const n; add
+        AddImm,
+        // comparison opcode, width, then a 4 byte aligned signed offset from the start of the instruction:
+        // cmp width; br_if_f label
+        CmpJumpIfFalse,
+        //------Relative branches------------------------
+        // followed by an aligned signed offset from the start of the instruction, the suffix is its size.
+        // The Emitter picks the smallest size that reaches the label
+        Br8, Br16, Br32,
+        /// pop the stack top, branch if it's zero
+        BrIfFalse8, BrIfFalse16, BrIfFalse32,
+        /// pop the stack top, branch if it's non zero
+        BrIfTrue8, BrIfTrue16, BrIfTrue32,
+    };
+    /// Type operand of load and store, also describes native signatures (see @c NativeProto)
+    enum class Type : uint8_t
+    {
+        i8 = 0, i16 = 1, i32 = 2, i64 = 3,
+        u8 = 4, u16 = 5, u32 = 6, u64 = 7,
+        f32 = 8, f64 = 9, ptr = 10,
     };
 }
 
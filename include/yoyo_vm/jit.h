@@ -0,0 +1,96 @@
+#pragma once
+#include "common.h"
+#include <csetjmp>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "decoder.h"
+#include "instructions.h"
+
+// The baseline JIT emits SysV x86-64 code, elsewhere functions always stay interpreted
+#ifndef YVM_JIT
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(_WIN32)
+#define YVM_JIT 1
+#else
+#define YVM_JIT 0
+#endif
+#endif
+
+namespace Yvm
+{
+    class VM;
+    class VMRunner;
+    /// Per runner state shared with compiled code, compiled code addresses the fields by offset
+    struct JitState
+    {
+        VMRunner* runner;
+        /// end of the committed part of the operand stack
+        uint8_t* stack_limit;
+        /// number of compiled frames currently on the host stack
+        size_t depth;
+        size_t max_depth;
+        /// nested runs of the interpreter started by compiled code
+        size_t reentries;
+        /// where a panic inside compiled code unwinds to
+        std::jmp_buf* panic_env;
+        size_t* alloca_top;
+    };
+    /// Signature of a native function, made by @c VM::native_proto and pushed as the @c proto of its native calls
+    struct NativeProto
+    {
+        /// Calls @p function with the stack slots at @p args as its arguments and returns its result as a stack slot.
+        /// First, so compiled code calls it without an offset
+        uint64_t(*thunk)(void* function, const void* args);
+        std::vector<Type> args;
+        /// empty for a function returning void
+        std::optional<Type> result;
+    };
+    /// Signature of a compiled function.
+    /// @p base is where the arguments start and @p top is one past the last argument
+    using JitEntry = uint64_t(*)(void* base, void* top, JitState* state);
+
+    /// Template JIT translating pre-decoded functions to x86-64.
+    /// Each operand stack slot is mapped to a fixed offset from the frame,
+    /// as the stack depth at every instruction is known ahead of time.
+    /// Functions using instructions it can't translate (@c ExternalIntrinsic,
+    /// dynamic jumps, checkpoints, object registration...) keep running in the interpreter
+    class YVM_API JitCompiler
+    {
+        struct Mapping
+        {
+            void* address;
+            size_t size;
+        };
+        std::mutex mutex;
+        std::vector<Mapping> mappings;
+        /// functions being compiled further up, calls to them stay indirect
+        std::vector<const DecodedFunction*> in_progress;
+        /// every distinct signature a thunk was made for
+        std::list<NativeProto> protos;
+        friend class VMRunner;
+        bool compile_locked(const VM& vm, const DecodedFunction& fn);
+        static uint64_t call_helper(JitState* state, void* code, void* args, uint64_t arg_size);
+        static void* alloca_helper(JitState* state, uint64_t size);
+        static void* malloc_helper(JitState* state, uint64_t size);
+        static void free_helper(JitState* state, void* ptr);
+        static void grow_stack_helper(JitState* state, uint8_t* needed);
+        [[noreturn]] static void panic_helper(JitState* state);
+    public:
+        JitCompiler() = default;
+        JitCompiler(const JitCompiler&) = delete;
+        JitCompiler& operator=(const JitCompiler&) = delete;
+        ~JitCompiler();
+        /// Compile @p fn and publish its entry in @c DecodedFunction::jit_entry.
+        /// Does nothing if it's already compiled
+        /// @return false if @p fn can't be compiled
+        bool compile(const VM& vm, const DecodedFunction& fn);
+        /// The signature taking @p args and returning @p result, with its thunk made the first time it's asked for
+        /// @return null if it can't be made, there are only thunks where there's a jit
+        const NativeProto* native_proto(std::span<const Type> args, std::optional<Type> result);
+    };
+}
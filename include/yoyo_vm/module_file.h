@@ -0,0 +1,27 @@
+#pragma once
+#include "common.h"
+#include <string>
+#include "vm.h"
+
+namespace Yvm
+{
+    /// Versioned on-disk form of a @link Module.
+    /// The file holds a symbol table of the functions, the relocations of their external references
+    /// and of the strings they use, a string pool and the code itself, page aligned so it can be mapped
+    class YVM_API ModuleFile
+    {
+    public:
+        /// Write @p module to @p path.
+        /// Constants pointing to strings registered in @p vm are saved (up to their first null) with the module,
+        /// other pointers in the code are written as is
+        /// @return false if the file couldn't be written
+        static bool save(const Module& module, const VM& vm, const std::string& path);
+        /// Map the module at @p path and add its functions to @p module.
+        /// The code runs in place from the mapping, which @p module keeps in @c Module::storage,
+        /// only the pages with relocations get copied (on write).
+        /// The string pool is registered in @p vm and the external references are left in
+        /// @c Module::unresolved_externals for @link VM::link
+        /// @return false if the file can't be mapped or isn't a valid module, @p module is left untouched then
+        static bool load(const std::string& path, Module& module, VM& vm);
+    };
+}
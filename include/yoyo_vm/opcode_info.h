@@ -0,0 +1,218 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "instructions.h"
+
+namespace Yvm
+{
+    /// How an operand is encoded after the opcode byte.
+    /// Operands wider than a byte are aligned to their size from the start of the function, like @c Writer::write_n does
+    enum class OperandKind : uint8_t
+    {
+        None,
+        U8, I8, U16, I16, U32, I32, U64, I64, F32, F64,
+        /// integer or float width in bits, one byte
+        Width,
+        /// load/store type (0 -> i8 ... 10 -> ptr), one byte
+        Type,
+        /// a comparison opcode, one byte
+        Cmp,
+        /// signed offset of the branch target from the start of the instruction
+        Rel8, Rel16, Rel32,
+    };
+    /// What an instruction does besides taking and leaving values on the operand stack
+    enum OpEffect : uint16_t
+    {
+        NoEffect = 0,
+        /// may continue at a target other than the next instruction
+        Branches = 1 << 0,
+        /// never continues with the next instruction
+        NoFallthrough = 1 << 1,
+        /// the target is popped from the stack instead of being an operand
+        DynamicTarget = 1 << 2,
+        /// runs another function
+        Calls = 1 << 3,
+        /// also pops the number of values given by its first operand
+        PopsArgs = 1 << 4,
+        ReadsMemory = 1 << 5,
+        WritesMemory = 1 << 6,
+        /// reaches outside the vm (allocator, native code, the intrinsic handler)
+        External = 1 << 7,
+        /// takes or leaves any number of values, nothing is known about its stack effect
+        UnknownStack = 1 << 8,
+        /// reads a slot of the stack picked by its first operand
+        ReadsSlot = 1 << 9,
+        /// writes a slot of the stack picked by its first operand
+        WritesSlot = 1 << 10,
+        /// uses the checkpoint given by its first operand
+        UsesCheckpoint = 1 << 11,
+        /// grows the runner's alloca region
+        Allocates = 1 << 12,
+        /// works with the registered objects of the runner
+        Objects = 1 << 13,
+    };
+    /// Everything the vm's tools need to know about an opcode
+    struct OpInfo
+    {
+        /// the assembler and disassembler spelling
+        std::string_view mnemonic;
+        std::array<OperandKind, 3> operands{};
+        /// values taken from the operand stack and left on it,
+        /// @c PopsArgs adds to @c pops and @c UnknownStack makes both meaningless
+        uint8_t pops = 0;
+        uint8_t pushes = 0;
+        uint16_t effects = NoEffect;
+
+        constexpr size_t operand_count() const
+        {
+            size_t count = 0;
+            while (count < operands.size() && operands[count] != OperandKind::None) count++;
+            return count;
+        }
+        constexpr bool has(OpEffect effect) const { return (effects & effect) != 0; }
+    };
+
+    constexpr size_t opcode_count = static_cast<size_t>(OpCode::BrIfTrue32) + 1;
+
+    namespace detail
+    {
+        struct OpEntry
+        {
+            OpCode op;
+            OpInfo info;
+        };
+        using enum OpCode;
+        using enum OperandKind;
+        constexpr OpInfo binary(std::string_view name) { return { name, {}, 2, 1 }; }
+        constexpr OpInfo width_binary(std::string_view name) { return { name, { Width }, 2, 1 }; }
+        constexpr OpInfo unary(std::string_view name, std::array<OperandKind, 3> operands = {}) { return { name, operands, 1, 1 }; }
+        constexpr OpInfo constant(std::string_view name, OperandKind kind) { return { name, { kind }, 0, 1 }; }
+        constexpr OpInfo branch(std::string_view name, OperandKind rel, uint8_t pops)
+        {
+            return { name, { rel }, pops, 0, static_cast<uint16_t>(Branches | (pops ? 0 : NoFallthrough)) };
+        }
+        constexpr OpEntry entries[] = {
+            { Nop, { "nop" } },
+            { Add8, binary("add8") }, { Add16, binary("add16") }, { Add32, binary("add32") }, { Add64, binary("add64") },
+            { Sub8, binary("sub8") }, { Sub16, binary("sub16") }, { Sub32, binary("sub32") }, { Sub64, binary("sub64") },
+            { Mul8, binary("mul8") }, { Mul16, binary("mul16") }, { Mul32, binary("mul32") }, { Mul64, binary("mul64") },
+            { IDiv8, binary("idiv8") }, { IDiv16, binary("idiv16") }, { IDiv32, binary("idiv32") }, { IDiv64, binary("idiv64") },
+            { UDiv8, binary("udiv8") }, { UDiv16, binary("udiv16") }, { UDiv32, binary("udiv32") }, { UDiv64, binary("udiv64") },
+            { IRem8, binary("irem8") }, { IRem16, binary("irem16") }, { IRem32, binary("irem32") }, { IRem64, binary("irem64") },
+            { URem8, binary("urem8") }, { URem16, binary("urem16") }, { URem32, binary("urem32") }, { URem64, binary("urem64") },
+            { FAdd32, binary("fadd32") }, { FAdd64, binary("fadd64") }, { FSub32, binary("fsub32") }, { FSub64, binary("fsub64") },
+            { FMul32, binary("fmul32") }, { FMul64, binary("fmul64") }, { FDiv32, binary("fdiv32") }, { FDiv64, binary("fdiv64") },
+            { Or, binary("or") }, { And, binary("and") }, { Not, unary("not") },
+            { Alloca, { "alloca", {}, 1, 1, Allocates } },
+            { MemCpy, { "memcpy", {}, 3, 0, ReadsMemory | WritesMemory } },
+            { Malloc, { "malloc", {}, 1, 1, External } },
+            { Free, { "free", {}, 1, 0, External } },
+            { PtrOff, binary("ptroff") },
+            { FNeg32, unary("fneg32") }, { FNeg64, unary("fneg64") },
+            { ExternalIntrinsic, { "extern", { U8 }, 0, 0, External | UnknownStack } },
+            { Jump, { "jump_dyn", {}, 1, 0, Branches | NoFallthrough | DynamicTarget } },
+            { JumpIfFalse, { "jump_if_f_dyn", {}, 2, 0, Branches | DynamicTarget } },
+            { Ret, { "ret", {}, 1, 0, NoFallthrough | Objects } },
+            { RetVoid, { "ret_void", {}, 0, 0, NoFallthrough | Objects } },
+            { Constant8, constant("const8", U8) }, { Constant16, constant("const16", U16) },
+            { Constant32, constant("const32", U32) }, { Constant64, constant("const64", U64) },
+            { Constant64FromU8, constant("const64_u8", U8) }, { Constant64FromU16, constant("const64_u16", U16) },
+            { Constant64FromU32, constant("const64_u32", U32) }, { Constant64FromI8, constant("const64_i8", I8) },
+            { Constant64FromI16, constant("const64_i16", I16) }, { Constant64FromI32, constant("const64_i32", I32) },
+            { ConstantF32, constant("const_f32", F32) }, { ConstantF64, constant("const_f64", F64) },
+            { ConstantPtr, constant("const_ptr", U64) },
+            { RegObj, { "reg_obj", {}, 2, 1, Objects } },
+            { Panic, { "panic", {}, 0, 0, NoFallthrough | Objects } },
+            { CheckReg, { "check_reg", {}, 1, 2, Objects } },
+            { PopReg, { "pop_reg", {}, 1, 2, Objects } },
+            { Pop, { "pop", {}, 1, 0 } },
+            { Checkpoint, { "checkpoint", { U8 }, 0, 0, UsesCheckpoint } },
+            { Dup, { "dup", {}, 1, 2 } },
+            { Switch, { "switch", {}, 2, 2 } },
+            { TopConsume, { "top_consume", {}, 2, 1 } },
+            { CmpEq, width_binary("cmp_eq") }, { CmpNe, width_binary("cmp_ne") },
+            { UCmpGt, width_binary("ucmp_gt") }, { UCmpGe, width_binary("ucmp_ge") },
+            { UCmpLt, width_binary("ucmp_lt") }, { UCmpLe, width_binary("ucmp_le") },
+            { ICmpGt, width_binary("icmp_gt") }, { ICmpGe, width_binary("icmp_ge") },
+            { ICmpLt, width_binary("icmp_lt") }, { ICmpLe, width_binary("icmp_le") },
+            { FCmpEq, width_binary("fcmp_eq") }, { FCmpNe, width_binary("fcmp_ne") }, { FCmpGt, width_binary("fcmp_gt") },
+            { FCmpGe, width_binary("fcmp_ge") }, { FCmpLt, width_binary("fcmp_lt") }, { FCmpLe, width_binary("fcmp_le") },
+            { Shl, width_binary("shl") }, { Shr, width_binary("shr") },
+            { BitAnd, width_binary("bitand") }, { BitOr, width_binary("bitor") }, { BitXor, width_binary("bitxor") },
+            { StackAddr, { "s_addr", { U8 }, 0, 1, ReadsSlot } },
+            { RevStackAddr, { "rev_s_addr", { U8 }, 0, 1, ReadsSlot } },
+            { StackCheckpoint, { "s_checkpoint", { U8 }, 0, 1, UsesCheckpoint } },
+            { PtrOffConst, unary("ptroff_const", { U8 }) },
+            { AllocaConst, { "alloc_const", { U8 }, 0, 1, Allocates } },
+            { Call, { "call", { U8 }, 1, 1, Calls | PopsArgs } },
+            { NativeCall, { "native_call", { U8 }, 2, 1, Calls | PopsArgs | External } },
+            { Load, { "load", { Type }, 1, 1, ReadsMemory } },
+            { Store, { "store", { Type }, 2, 0, WritesMemory } },
+            { UConv, unary("uconv", { Width, Width }) }, { SConv, unary("sconv", { Width, Width }) },
+            { FpConv, unary("fpconv", { Width, Width }) },
+            { FpToSi, unary("fptosi", { Width, Width }) }, { FpToUi, unary("fptoui", { Width, Width }) },
+            { UiToFp, unary("uitofp", { Width, Width }) }, { SiToFp, unary("sitofp", { Width, Width }) },
+            { LoadLocal, { "load_local", { U8, Type }, 0, 1, ReadsSlot | ReadsMemory } },
+            { StoreLocal, { "store_local", { U8, Type }, 1, 0, ReadsSlot | WritesMemory } },
+            { AddImm, unary("add_imm", { Width, I8 }) },
+            { CmpJumpIfFalse, { "cmp_jump_if_f", { Cmp, Width, Rel32 }, 2, 0, Branches } },
+            { Br8, branch("br8", Rel8, 0) }, { Br16, branch("br16", Rel16, 0) }, { Br32, branch("br32", Rel32, 0) },
+            { BrIfFalse8, branch("br_if_f8", Rel8, 1) }, { BrIfFalse16, branch("br_if_f16", Rel16, 1) },
+            { BrIfFalse32, branch("br_if_f32", Rel32, 1) },
+            { BrIfTrue8, branch("br_if_t8", Rel8, 1) }, { BrIfTrue16, branch("br_if_t16", Rel16, 1) },
+            { BrIfTrue32, branch("br_if_t32", Rel32, 1) },
+        };
+        consteval std::array<OpInfo, opcode_count> build_table()
+        {
+            std::array<OpInfo, opcode_count> table{};
+            std::array<bool, opcode_count> seen{};
+            for (auto& entry : entries) {
+                auto index = static_cast<size_t>(entry.op);
+                // a duplicate entry doesn't compile
+                if (seen[index]) throw "opcode described twice";
+                seen[index] = true;
+                table[index] = entry.info;
+            }
+            for (auto described : seen) if (!described) throw "opcode without a description";
+            return table;
+        }
+    }
+    /// The description of every opcode, indexed by its value
+    inline constexpr std::array<OpInfo, opcode_count> opcode_table = detail::build_table();
+
+    /// The description of @p op, or null if @p op is not a valid opcode
+    constexpr const OpInfo* opcode_info(OpCode op)
+    {
+        auto index = static_cast<size_t>(op);
+        return index < opcode_count ? &opcode_table[index] : nullptr;
+    }
+    /// Bytes taken by an operand of @p kind, its alignment is the same
+    constexpr size_t operand_size(OperandKind kind)
+    {
+        using enum OperandKind;
+        switch (kind)
+        {
+        case None: return 0;
+        case U16: case I16: case Rel16: return 2;
+        case U32: case I32: case F32: case Rel32: return 4;
+        case U64: case I64: case F64: return 8;
+        default: return 1;
+        }
+    }
+    /// Byte offset of the end of the instruction starting at @p offset (from the start of the function)
+    constexpr size_t instruction_end(const OpInfo& info, size_t offset)
+    {
+        offset++;
+        for (auto kind : info.operands) {
+            auto size = operand_size(kind);
+            if (size == 0) break;
+            offset += (size - offset % size) % size + size;
+        }
+        return offset;
+    }
+    static_assert(instruction_end(opcode_table[static_cast<size_t>(OpCode::Constant64)], 0) == 16);
+    static_assert(instruction_end(opcode_table[static_cast<size_t>(OpCode::CmpJumpIfFalse)], 0) == 8);
+}
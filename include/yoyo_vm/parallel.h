@@ -0,0 +1,13 @@
+#pragma once
+#include "common.h"
+#include <cstddef>
+#include <functional>
+
+namespace Yvm
+{
+    /// Call @p body for every index below @p count on up to @p threads threads (0 uses every core).
+    /// Each thread starts with an even share of the indices and steals half of what another thread
+    /// has left once it runs out, so uneven jobs still keep every thread busy.
+    /// The calling thread takes part, the first exception thrown by @p body is rethrown once all threads stopped
+    YVM_API void parallel_for(size_t count, unsigned threads, const std::function<void(size_t)>& body);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "common.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "decoder.h"
+
+// Opt-in instrumentation of the interpreter (the meson option profiler),
+// without it run_code is built exactly as if the profiler didn't exist
+#ifndef YVM_PROFILE
+#define YVM_PROFILE 0
+#endif
+
+namespace Yvm
+{
+    class VM;
+    /// What a runner's interpreter executed and how long it took, only recorded when the vm is built with @c YVM_PROFILE.
+    /// Time is in cycles of the time stamp counter (nanoseconds on targets without one) and an instruction
+    /// lasts until the next one starts, so time spent in native and compiled code counts towards the call.
+    /// Compiled functions aren't seen at all, a @c VM::jit_threshold of 0 keeps everything interpreted
+    class YVM_API Profile
+    {
+    public:
+        struct Counter
+        {
+            uint64_t count = 0;
+            uint64_t cycles = 0;
+        };
+        struct FunctionProfile
+        {
+            /// the version of the function that ran, it lives as long as the vm
+            const DecodedFunction* fn = nullptr;
+            /// one per instruction of @c fn->code
+            std::vector<Counter> instructions;
+            Counter total;
+        };
+        /// indexed by @c DecodedOp
+        std::vector<Counter> operations;
+        /// how often an operation ran right after another, at @c first * decoded_op_count + @c second
+        std::vector<uint64_t> pairs;
+        /// by the bytecode of the function
+        std::unordered_map<const uint64_t*, FunctionProfile> functions;
+
+        /// Add the counts of @p other, like the profile of another runner
+        void merge(const Profile& other);
+        void clear();
+        /// Every operation, operation pair and function that ran, hottest first.
+        /// Functions are named with @link VM::name_of and list each instruction with its byte offset
+        std::string to_json(const VM& vm) const;
+    };
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "common.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace Yvm
+{
+    class VM;
+    /// Statistical profiler of the functions runners are in. A timer signal (@c SIGPROF, counting the process's cpu time)
+    /// interrupts whichever thread is running and the handler copies the call stack of the runner on that thread,
+    /// so only the time spent inside @c VMRunner::run_code is seen.
+    /// Interpreted calls are followed through every nested @c run_code, time spent in compiled code is
+    /// put in a @c [compiled] frame under the function that entered it.
+    /// One sampler runs at a time, there's no @c SIGPROF on Windows so it never starts there
+    class YVM_API Sampler
+    {
+        /// every sample as its frame count followed by its functions innermost first, the rest is zero
+        std::unique_ptr<const void*[]> buffer;
+        size_t capacity;
+        std::atomic<size_t> used{ 0 };
+        std::atomic<uint64_t> dropped_samples{ 0 };
+        std::atomic<uint64_t> sample_count{ 0 };
+        static void on_signal(int);
+        /// copy the call stack of the runner on this thread, only async signal safe work
+        void record();
+    public:
+        /// deepest stack a sample keeps, the outermost calls of deeper ones are cut off
+        static constexpr size_t max_depth = 128;
+        /// @param buffer_words room for the samples, a sample takes one word per function plus one
+        explicit Sampler(size_t buffer_words = 1 << 20);
+        ~Sampler();
+        Sampler(const Sampler&) = delete;
+        Sampler& operator=(const Sampler&) = delete;
+
+        /// Take @p hz samples per second of cpu time until @link stop
+        /// @return false if another sampler is running or the platform can't sample
+        bool start(unsigned hz = 1000);
+        /// Stop sampling, once this returns no sample is being taken
+        void stop();
+        /// Forget the samples taken so far, call it while the sampler is stopped
+        void clear();
+        /// samples taken of a runner, dropped ones included
+        uint64_t samples() const { return sample_count.load(std::memory_order_relaxed); }
+        /// samples that didn't fit in the buffer
+        uint64_t dropped() const { return dropped_samples.load(std::memory_order_relaxed); }
+        /// The samples in the folded format of flamegraph.pl: one line per distinct stack, its functions
+        /// from the outermost down separated by @c ; followed by the number of samples.
+        /// Functions are named with @link VM::name_of of @p vm, which has to be the vm of every sampled runner.
+        /// Call it while the sampler is stopped
+        std::string folded(const VM& vm) const;
+    };
+}
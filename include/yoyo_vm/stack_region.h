@@ -0,0 +1,34 @@
+#pragma once
+#include "common.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace Yvm
+{
+    /// A block of reserved address space that is committed as it's used.
+    /// An inaccessible guard page follows the reserved block, so running past
+    /// the end faults instead of corrupting whatever is mapped after it
+    class YVM_API StackRegion
+    {
+        uint8_t* base = nullptr;
+        size_t committed = 0;
+        size_t reserved = 0;
+        bool grow(size_t size);
+    public:
+        /// Reserve (but don't commit) @p max_size bytes, rounded up to the page size
+        explicit StackRegion(size_t max_size);
+        ~StackRegion();
+        StackRegion(StackRegion&& other) noexcept;
+        StackRegion& operator=(StackRegion&& other) noexcept;
+        StackRegion(const StackRegion&) = delete;
+        StackRegion& operator=(const StackRegion&) = delete;
+
+        uint8_t* data() const { return base; }
+        size_t capacity() const { return reserved; }
+        /// bytes usable without another @c ensure
+        size_t committed_size() const { return committed; }
+        /// Make sure the first @p size bytes are usable
+        /// @return false if @p size is more than was reserved
+        bool ensure(size_t size) { return size <= committed || grow(size); }
+    };
+}
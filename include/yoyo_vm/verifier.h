@@ -0,0 +1,39 @@
+#pragma once
+#include "common.h"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "decoder.h"
+
+namespace Yvm
+{
+    /// Values an instruction takes from the operand stack and leaves on it
+    struct StackEffect
+    {
+        uint8_t pops = 0;
+        uint8_t pushes = 0;
+    };
+    /// Why a function failed verification
+    struct YVM_API VerifyError
+    {
+        /// byte offset of the offending instruction in the function's bytecode
+        uint32_t offset;
+        std::string message;
+    };
+
+    /// Check that @p fn can run without any checks in the interpreter, following every path through it:
+    /// - every reachable instruction is valid and execution never runs past the end
+    /// - branches land on the start of an instruction, jumps with a target taken from the stack aren't allowed
+    /// - the stack has the same depth on every path reaching an instruction
+    /// - no value is read wider than it was written (a 32 bit add of an 8 bit load, a 64 bit store of a 32 bit float)
+    /// - a checkpoint is set on every path before @c s_checkpoint reads it, and its slot is still on the stack
+    ///
+    /// Slots below the function's own values (its arguments) can't be checked without a call,
+    /// the number of them it reaches is kept in @c DecodedFunction::min_args, which calls check instead.
+    /// On success @c DecodedFunction::max_stack is set to the exact depth the function reaches
+    /// @param intrinsics the stack effect of every intrinsic the code may use, code using any other fails
+    /// @return why @p fn failed, empty if it's verified
+    YVM_API std::optional<VerifyError> verify(DecodedFunction& fn, const std::unordered_map<uint8_t, StackEffect>& intrinsics = {});
+}
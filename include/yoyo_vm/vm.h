@@ -2,11 +2,29 @@
 #include "common.h"
 #include <cstdint>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 #include <csetjmp>
 #include "instructions.h"
+#include "decoder.h"
+#include "verifier.h"
+#include "profiler.h"
+#include "stack_region.h"
+#include "arena.h"
+#include "jit.h"
 
 namespace Yvm
 {
@@ -35,19 +53,151 @@ namespace Yvm
     template<int n> using sin_t = typename sin<n>::type;
     template<int n> using fp_t = typename fp<n>::type;
     struct Stack;
+    /// Sizes of the memory a @link VMRunner reserves up front.
+    /// Only the parts that are actually used get committed
+    struct RunnerConfig
+    {
+        /// maximum number of slots on the operand stack
+        size_t stack_slots = 1 << 20;
+        /// maximum number of bytes held by alloca's at any one time
+        size_t alloca_bytes = 8 << 20;
+        /// maximum depth of nested calls
+        size_t max_frames = 1 << 16;
+        /// Maximum bytes of the runner's own heap backing @c Malloc and @c Free (see @c Arena),
+        /// 0 leaves them to the system allocator. Its blocks may be freed by any runner while it's alive,
+        /// but never by @c free: with a heap, @c Free panics on memory no live runner's heap handed out
+        size_t heap_bytes = 0;
+        /// Drop everything left on the runner's heap once the outermost call returns or panics,
+        /// pointers into it must not outlive the call then. Freeing one of them afterwards panics
+        /// until its memory is handed out again
+        bool reset_heap = false;
+    };
+    /// How long a call started with @c VMRunner::start runs before it's suspended, whichever runs out first
+    struct Budget
+    {
+        /// decoded instructions, a fused pair counts once
+        uint64_t instructions = UINT64_MAX;
+        /// looked at every @c VMRunner::deadline_interval instructions
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    };
+    enum class RunStatus : uint8_t
+    {
+        Finished,
+        /// the budget ran out, @c VMRunner::resume continues the call
+        Suspended,
+        Panicked,
+        /// a native call was deferred, @c VMRunner::resume continues the call once its @c Completion completes
+        Waiting,
+    };
+    /// The bytecode of a function, either owned or a view of memory kept alive elsewhere
+    /// (like a mapped module file, see @c Module::storage)
+    class YVM_API FunctionCode
+    {
+        std::vector<uint64_t> owned;
+        uint64_t* ptr = nullptr;
+        size_t count = 0;
+    public:
+        FunctionCode() = default;
+        FunctionCode(std::vector<uint64_t> code) : owned(std::move(code)), ptr(owned.data()), count(owned.size()) {}
+        FunctionCode(const FunctionCode& other);
+        FunctionCode(FunctionCode&& other) noexcept;
+        FunctionCode& operator=(FunctionCode other) noexcept;
+        /// Refer to @p code without copying it, @p code has to outlive every use of the function
+        static FunctionCode view(std::span<uint64_t> code);
+
+        uint64_t* data() { return ptr; }
+        const uint64_t* data() const { return ptr; }
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        uint64_t* begin() { return ptr; }
+        uint64_t* end() { return ptr + count; }
+        const uint64_t* begin() const { return ptr; }
+        const uint64_t* end() const { return ptr + count; }
+        uint64_t& operator[](size_t i) { return ptr[i]; }
+        const uint64_t& operator[](size_t i) const { return ptr[i]; }
+    };
     class YVM_API Module
     {
     public:
-        std::unordered_map<std::string, std::vector<uint64_t>> code;
+        std::unordered_map<std::string, FunctionCode> code;
         std::unordered_map<void**, std::string> unresolved_externals;
+        /// optional, functions without an entry are analyzed when they're decoded
+        std::unordered_map<std::string, FunctionInfo> function_info;
+        /// memory the functions in @c code may be views of, released with the module
+        std::vector<std::shared_ptr<void>> storage;
+    };
+    /// Indirection between a function and its callers,
+    /// replacing the function only has to swap @c current
+    struct FunctionSlot
+    {
+        std::atomic<const DecodedFunction*> current;
     };
     class YVM_API VM
     {
         std::vector<Module*> registered_modules;
+        /// name -> code of every registered function, the first module to define a name wins
+        std::unordered_map<std::string_view, uint64_t*> symbols;
+        /// code -> name of every registered function
+        std::unordered_map<const void*, std::string_view> symbol_names;
+        /// number of functions each module had when it was indexed
+        std::vector<size_t> indexed_sizes;
+        void index_module(Module* module);
         std::list<std::string> strings;
+        /// blocks of strings registered through @link add_strings
+        std::vector<std::span<const char>> string_pools;
+        /// strings are added by emitters running in parallel
+        mutable std::mutex strings_mutex;
+        /// pre-decoded form of every version of every linked function,
+        /// replaced versions stay alive for the runners that may still be in them
+        std::list<DecodedFunction> decoded_functions;
+        std::list<FunctionSlot> slots;
+        using SlotEntry = std::pair<const uint64_t* const, FunctionSlot*>;
+        /// slot of every linked function by its code, the code of a replaced version keeps its entry
+        std::unordered_map<const uint64_t*, FunctionSlot*> function_slots;
+        /// guards @c function_slots, runners only ever read it
+        mutable std::shared_mutex slots_mutex;
+        /// code replaced by @link reload, kept so the pointers to it stay unique
+        std::list<FunctionCode> retired_code;
+        struct PendingExternal
+        {
+            Module* module;
+            std::string name;
+        };
+        /// externals no registered module defined at the last link
+        std::unordered_map<void**, PendingExternal> pending_externals;
+        /// modules before this index are linked
+        size_t linked_modules = 0;
+        void resolve_external(Module* module, void** addr, const std::string& name);
+        /// A function bound with @link bind, @c entry is the trampoline generated for its signature
+        struct NativeBinding
+        {
+            void* entry;
+            size_t arity;
+        };
+        std::unordered_map<std::string, NativeBinding> natives;
+        /// parameter count of every trampoline, by its address
+        std::unordered_map<const void*, size_t> native_arities;
+        void bind_native(std::string name, void* entry, size_t arity);
+        /// the code of the function or the trampoline of the native function called @p name, null if there's none
+        void* find_external(std::string_view name) const;
+        /// resolve the pending externals that are defined now
+        /// @return the functions they're in, they have to be decoded again
+        std::vector<std::pair<Module*, const std::string*>> resolve_pending();
+        /// decode @p functions and publish them in their slots, creating the slots of new functions
+        void decode_functions(const std::vector<std::pair<Module*, const std::string*>>& functions);
+        /// turn calls through a constant address of a linked function into @c CallDirect,
+        /// and native calls through a constant trampoline into @c NativeCallDirect
+        void bind_calls(DecodedFunction& fn) const;
+        const SlotEntry* find_entry(const void* code) const;
+        std::vector<std::string> unresolved_symbols() const;
+        mutable JitCompiler jit;
         friend class VMRunner;
+        friend class Sampler;
     public:
         void* ex_data;
+        /// Number of calls after which a function is compiled to machine code, 0 keeps everything interpreted.
+        /// Functions the jit can't translate stay interpreted regardless
+        uint32_t jit_threshold = 1000;
         union Type
         {
             uint8_t u8; int8_t i8;
@@ -67,17 +217,114 @@ namespace Yvm
         /// it can be anything, it's called @c proto because the common use case is to store a description to the function's
         /// prototype
         VM::Type(*do_native_call)(void* function, VM::Type* begin, size_t arg_size, void* proto);
+        /// Call native functions through the thunk of their @c proto, which has to come from @link native_proto,
+        /// instead of @c do_native_call. Compiled code looks at it when it's compiled, so set it before running anything
+        bool native_thunks = false;
+        /// The signature taking @p args and returning @p result (nothing if it's empty), made once per distinct
+        /// signature with a machine code thunk passing the arguments by the SysV x86-64 convention.
+        /// Native calls with it as @c proto have to push exactly its arguments
+        /// @return null where there's no jit (see @c YVM_JIT), @c do_native_call has to be used there
+        const NativeProto* native_proto(std::span<const Yvm::Type> args, std::optional<Yvm::Type> result = std::nullopt);
         void(*intrinsic_handler)(Stack& stack, uint8_t instrinsic_number, void* ex_data);
+        /// Stack effect of every intrinsic @c intrinsic_handler implements,
+        /// code using an intrinsic without one fails verification
+        std::unordered_map<uint8_t, StackEffect> intrinsic_effects;
+        /// Functions the last @link link or @link reload refused because they failed verification, see @c verify.
+        /// Calls to them panic, or go to the previous version of a reloaded function
+        std::vector<std::pair<std::string, VerifyError>> rejected_functions;
         /// Construct a @link VMRunner instance
-        VMRunner new_runner();
-        /// Link all registered modules and resolve external symbols
+        VMRunner new_runner(const RunnerConfig& config = {});
+        /// Link the modules registered since the last call and resolve their external symbols
+        /// then translate their functions to the form the runners execute.
+        /// References earlier links couldn't resolve are retried, modules that got new functions
+        /// since they were linked have those linked too.
+        /// Functions that fail verification aren't linked, see @c rejected_functions.
         /// Returns a list of unresolved symbols if any
         std::vector<std::string> link();
-        void add_module(Module* module);
+        /// Replace functions of the linked @p module by the ones in @p update and link them.
+        /// The new code, externals and function info are moved into @p module, functions it
+        /// didn't have are added. This can run while runners execute: calls made after it returns
+        /// (through any pointer to the function, old or new) go to the new version,
+        /// calls already running finish in the old one, whose code stays alive with the vm.
+        /// Returns a list of unresolved symbols if any
+        std::vector<std::string> reload(Module* module, Module update);
+        /// The pre-decoded form of a linked function, or null if @p code is not one
+        const DecodedFunction* find_function(const void* code) const;
+        /// The code of the function called @p name in the registered modules, or null if there's none
+        uint64_t* find_symbol(std::string_view name) const;
+        /// Verify every function of @p module (see @c verify), then register it and index its functions.
+        /// Functions added to it afterwards are indexed again by @link link, which verifies them too
+        /// @return the name and error of the functions that failed, the module isn't registered if there's any
+        std::vector<std::pair<std::string, VerifyError>> add_module(Module* module);
         const char* add_string(std::string str);
+        /// Register a block of null terminated strings that lives as long as the vm,
+        /// like the string pool of a mapped module
+        void add_strings(std::span<const char> pool);
         bool is_registered_string(const char*) const;
         std::string name_of(void* ptr) const;
+        /// Make @p function callable by code as the external @p name, through a trampoline generated for its
+        /// signature that reads its parameters from the stack slots (the first one pushed first) and converts
+        /// its result. Parameters and results are integers, enums, bools, floats, doubles or pointers.
+        /// The name is resolved by @link link, functions of the registered modules take precedence. A native call
+        /// through the constant address of a bound function calls the trampoline directly, a call with
+        /// another argument count panics. Other native calls through it go to @c do_native_call
+        template<auto function> void bind(std::string name);
     };
+    namespace detail
+    {
+        template<typename T> T from_slot(VM::Type slot)
+        {
+            if constexpr (std::is_same_v<T, bool>) return slot.u8 != 0;
+            else if constexpr (std::is_same_v<T, float>) return slot.f32;
+            else if constexpr (std::is_same_v<T, double>) return slot.f64;
+            else if constexpr (std::is_pointer_v<T>) return static_cast<T>(slot.ptr);
+            else if constexpr (std::is_enum_v<T>) return static_cast<T>(from_slot<std::underlying_type_t<T>>(slot));
+            else if constexpr (std::is_integral_v<T> && sizeof(T) == 1) return static_cast<T>(slot.u8);
+            else if constexpr (std::is_integral_v<T> && sizeof(T) == 2) return static_cast<T>(slot.u16);
+            else if constexpr (std::is_integral_v<T> && sizeof(T) == 4) return static_cast<T>(slot.u32);
+            else if constexpr (std::is_integral_v<T> && sizeof(T) == 8) return static_cast<T>(slot.u64);
+            else static_assert(false, "Unsupported native parameter type");
+        }
+        template<typename T> VM::Type to_slot(T value)
+        {
+            VM::Type slot{ .u64 = 0 };
+            if constexpr (std::is_same_v<T, bool>) slot.u8 = value;
+            else if constexpr (std::is_same_v<T, float>) slot.f32 = value;
+            else if constexpr (std::is_same_v<T, double>) slot.f64 = value;
+            else if constexpr (std::is_pointer_v<T>) slot.ptr = const_cast<void*>(static_cast<const void*>(value));
+            else if constexpr (std::is_enum_v<T>) slot = to_slot(static_cast<std::underlying_type_t<T>>(value));
+            else if constexpr (std::is_integral_v<T> && sizeof(T) == 1) slot.u8 = static_cast<uint8_t>(value);
+            else if constexpr (std::is_integral_v<T> && sizeof(T) == 2) slot.u16 = static_cast<uint16_t>(value);
+            else if constexpr (std::is_integral_v<T> && sizeof(T) == 4) slot.u32 = static_cast<uint32_t>(value);
+            else if constexpr (std::is_integral_v<T> && sizeof(T) == 8) slot.u64 = static_cast<uint64_t>(value);
+            else static_assert(false, "Unsupported native result type");
+            return slot;
+        }
+        /// Calls @p function with its parameters read from the stack slots at @c args
+        template<auto function, typename Signature> struct NativeTrampoline;
+        template<auto function, typename R, typename... Args>
+        struct NativeTrampoline<function, R(*)(Args...)>
+        {
+            static constexpr size_t arity = sizeof...(Args);
+            static_assert(arity <= UINT8_MAX, "native_call takes at most 255 arguments");
+            template<size_t... i> static VM::Type unpack(VM::Type* args, std::index_sequence<i...>)
+            {
+                if constexpr (std::is_void_v<R>) {
+                    function(from_slot<Args>(args[i])...);
+                    return VM::Type{ .u64 = 0 };
+                }
+                else return to_slot<R>(function(from_slot<Args>(args[i])...));
+            }
+            static VM::Type call(VM::Type* args) { return unpack(args, std::index_sequence_for<Args...>{}); }
+        };
+        template<auto function, typename R, typename... Args>
+        struct NativeTrampoline<function, R(*)(Args...) noexcept> : NativeTrampoline<function, R(*)(Args...)> {};
+    }
+    template<auto function> void VM::bind(std::string name)
+    {
+        using Trampoline = detail::NativeTrampoline<function, decltype(function)>;
+        bind_native(std::move(name), reinterpret_cast<void*>(&Trampoline::call), Trampoline::arity);
+    }
     struct Stack
     {
 
@@ -136,22 +383,164 @@ namespace Yvm
             else static_assert(false, "Invalid push type");
         }
     };
+    /// The result of a deferred native call (see @c VMRunner::defer_native_call), completed once from any thread.
+    /// Copies share the same result
+    class YVM_API Completion
+    {
+        struct State
+        {
+            std::mutex mutex;
+            bool done = false;
+            VM::Type value{};
+            std::function<void()> callback;
+        };
+        std::shared_ptr<State> state = std::make_shared<State>();
+    public:
+        /// Give the native call its return value
+        /// @return false if it was already completed
+        bool complete(VM::Type value);
+        bool completed() const;
+        /// the value it was completed with, empty until then
+        std::optional<VM::Type> value() const;
+        /// Call @p callback once this completes, right away if it already has. It replaces an earlier callback
+        /// and may run on the thread completing it
+        void on_complete(std::function<void()> callback);
+    };
     /// This holds necessary state required to run code
-    /// you can have as many instances of this running at the same time (say on different threads)
+    /// you can have as many instances of this running at the same time (say on different threads),
+    /// @c Executor runs calls on a pool of threads with a runner each
     class YVM_API VMRunner
     {
         friend class VM;
-        explicit VMRunner(const VM& vm): vm(vm) {};
+        VMRunner(const VM& vm, const RunnerConfig& config);
         const VM& vm;
         std::unordered_map<void*, uint64_t*> registered_objects;
+        /// The caller's state saved by a @c Call, restored by its @c Ret
+        struct Frame
+        {
+            const DecodedFunction* fn;
+            /// the instruction to resume at
+            const DecodedInst* ip;
+            VM::Type* base;
+            size_t top;
+            size_t alloca_top;
+            size_t checkpoint_base;
+        };
+        StackRegion stack_region;
+        StackRegion alloca_region;
+        size_t alloca_top = 0;
+        /// backs @c Malloc and @c Free when @link RunnerConfig::heap_bytes isn't 0
+        std::unique_ptr<Arena> heap;
+        bool reset_heap;
+        std::vector<Frame> frames;
+        size_t max_frames;
+        /// A run_code call on this runner, for the @c Sampler walking the frames from a signal handler
+        struct EntryLink
+        {
+            const EntryLink* outer;
+            /// frames below this belong to the outer calls
+            size_t frame_count;
+            /// the function the outer call was in, null for the outermost
+            const DecodedFunction* caller;
+            /// compiled frames on the host stack when it started
+            size_t jit_depth;
+        };
+        const EntryLink* volatile innermost_entry = nullptr;
+        /// the function the innermost run_code is in
+        const DecodedFunction* volatile running = nullptr;
+        /// set while @c frames moves to a bigger buffer, samples skip the runner then
+        volatile bool frames_moving = false;
+        void push_frame(const Frame& frame)
+        {
+            if (frames.size() == frames.capacity()) grow_frames();
+            frames.push_back(frame);
+        }
+        void grow_frames();
+        /// the runner whose run_code is innermost on this thread
+        static VMRunner*& thread_runner();
+        friend class Sampler;
+        /// checkpoints of every active call, each call owns @c DecodedFunction::checkpoint_count of them
+        std::vector<uint32_t> checkpoint_slots;
+        size_t checkpoint_top = 0;
+        void reserve_checkpoints(size_t count);
+        JitState jit_state{};
+        friend class JitCompiler;
+        /// Count a call of @p fn, compiling it once it gets hot
+        /// @return the compiled entry of @p fn, or null if it's interpreted
+        JitEntry jit_entry(const DecodedFunction& fn);
+        /// Run compiled code with its arguments already in place at @p base
+        /// @return false if it panicked
+        bool run_jit(JitEntry entry, VM::Type* base, size_t arg_size, VM::Type& result);
+        /// Where the interpreter is in a call
+        struct Cursor
+        {
+            const DecodedFunction* fn;
+            const DecodedInst* ip;
+            Stack stack;
+            size_t checkpoint_base;
+            /// frames below this belong to callers outside of the call
+            size_t entry_depth;
+        };
+        /// the call @link start left when its budget ran out or it waits for a deferred native call
+        std::optional<Cursor> suspended_call;
+        /// the run_code whose native call may be deferred, only set during a native call of a budgeted interpreter
+        const EntryLink* deferrable_entry = nullptr;
+        /// what the parked call waits for, its value is pushed once it completes
+        std::optional<Completion> awaited;
+        /// Interpret from @p cursor until the call returns, with @p budgeted until @p budget runs out too
+        template<bool budgeted> VM::Type interpret(const Cursor& cursor, Budget budget);
+        /// drop everything a call started by @link start left on the runner
+        void end_call();
     public:
         bool in_panic = false;
+        /// what this runner's interpreter executed, only recorded when built with @c YVM_PROFILE
+        Profile profile;
         VMRunner(VMRunner&&) noexcept = default;
 
+        /// Run a function of a linked module
+        /// Panics if @p ip is not the start of a function known to the vm, if it's given fewer arguments than it reads
+        /// or if the operand stack would grow past @link RunnerConfig::stack_slots.
+        /// Linked functions are verified, so those are the only checks, the instructions themselves run unchecked.
+        /// Calls made by the code don't recurse on the host stack, so the call depth is only
+        /// limited by @link RunnerConfig::max_frames
         VM::Type run_code(uint64_t* ip, const VM::Type* arg_begin, size_t arg_size, size_t stack_off = 0);
-        // will default to system alloca
-        // can probably change it to use a custom stack
+        /// instructions between two looks at the clock of a @link Budget::deadline
+        static constexpr uint64_t deadline_interval = 1024;
+        /// what the last call started by @link start returned
+        VM::Type result{};
+        /// Run a function of a linked module like @link run_code, but suspend it once @p budget runs out.
+        /// The suspended call stays in the runner (its frames, stack and allocas) until @link resume continues it.
+        /// Calls it makes are interpreted, compiled code and native calls (with any run_code they make) can't be
+        /// suspended and always finish. A call still suspended is dropped, this can't be used from inside run_code.
+        /// The runner can be reused after a call panicked, start clears @c in_panic and the registered objects
+        /// @return @c Finished with the value in @c result, @c Suspended, @c Waiting or @c Panicked
+        RunStatus start(uint64_t* ip, const VM::Type* arg_begin, size_t arg_size, const Budget& budget = {});
+        /// Continue the suspended call with a new @p budget
+        /// @return like @link start, @c Finished right away if there's no call suspended,
+        /// @c Waiting right away while the deferred native call isn't completed
+        RunStatus resume(const Budget& budget = {});
+        /// whether there's a call to resume, waiting ones included
+        bool suspended() const { return suspended_call.has_value(); }
+        /// Defer the native call being made, for a native function that would otherwise block (on I/O for example).
+        /// Once the function returns (its return value is ignored) the call parks and @link start or @link resume
+        /// return @c Waiting, resume continues it with the value the returned handle is completed with.
+        /// Only native calls made by code running under start can be deferred, not those of compiled code or of
+        /// a run_code inside another native call
+        /// @return empty if the native call being made can't be deferred, the function has to return its value then
+        static std::optional<Completion> defer_native_call();
+        /// what the parked call waits for, null unless it's waiting
+        const Completion* awaiting() const { return awaited ? &*awaited : nullptr; }
+        /// Allocate from the runner's alloca region, the memory is released when the current call returns
+        /// @return null if the region is exhausted
         void* stackalloc(uint64_t size);
-        std::array<VM::Type, 256> stack_data{};
+        /// Allocate like @c Malloc, from the runner's heap if it has one
+        /// @return null if the heap is exhausted
+        void* heap_alloc(uint64_t size);
+        /// Free like @c Free: a block of the runner's heap goes back to it, one of another runner's heap to that one.
+        /// Anything else goes to the system allocator if the runner has no heap
+        /// @return false if @p ptr can't be freed, a block dropped by a reset or memory no heap handed out
+        /// while the runner has a heap
+        bool heap_free(void* ptr);
+        VM::Type* stack_data() const { return reinterpret_cast<VM::Type*>(stack_region.data()); }
     };
 }
@@ -1,57 +1,25 @@
 #include <iostream>
 #include <vector>
-#include <array>
-#include "src/yoyo_vm/vm.h"
-#include "src/yoyo_vm/instructions.h"
-#include "src/yoyo_vm/assembler.h"
 #include <chrono>
-#include <string.h>
-#include <src/yoyo_vm/emitter.h>
+#include "yoyo_vm/vm.h"
+#include "yoyo_vm/instructions.h"
+#include "yoyo_vm/assembler.h"
+#include "yoyo_vm/emitter.h"
 
-inline consteval uint8_t to_u8(OpCode c)
-{
-    return static_cast<uint8_t>(c);
-}
-
-uint8_t constexpr operator "" _u8(const unsigned long long v)
-{
-    return v;
-}
-void func(uint32_t val, uint32_t val2)
-{
-    std::cout << val << " and " << val2 << std::endl;
-}
+using Yvm::OpCode;
 
-Yvm::VM::Type Yvm::do_native_call(void* function, const VM::Type* begin, size_t arg_size, const void* proto)
-{
-    reinterpret_cast<void(*)(uint32_t, uint32_t)>(function)(begin[0].u32, begin[1].u32);
-    return Yvm::VM::Type{};
-}
-struct Module
-{
-    std::vector<uint64_t> code;
-    std::unordered_map<std::string, uint64_t*> functions;
-};
-int main() {
-    // n -> 0
-    // prev_prev -> 1
-    // prev -> 2
-    // curr -> 3
-    // i -> 4
-    Yvm::Emitter em;
-    em.write_const<uint32_t>(10);
-    em.write_const<uint32_t>(200);
-    em.write_const<void*>(nullptr);
-    em.write_const(reinterpret_cast<void*>(&func));
-    em.write_2b_inst(OpCode::NativeCall, 2);
-    em.write_1b_inst(OpCode::Ret);
-    auto c = R"(
+// n -> 0
+// prev_prev -> 1
+// prev -> 2
+// curr -> 3
+// i -> 4
+static auto fib_loop = R"(
     ; allocate prev_prev, prev, curr and i
     alloc_const 4
     alloc_const 4
     alloc_const 4
     alloc_const 4
-    ; set prev to 3
+    ; set prev to 0
     const32 0
     s_addr 2
     store i32
@@ -108,15 +76,57 @@ END:
     load i32
     ret
 )";
-    Yvm::Assembler asma;
-    auto asm_code = std::move(em).get_code();//asma.assemble(c);
 
-    Yvm::VM vm;
-    Yvm::VM::Type arg1{ .u32 = 7 };
+/// fib(n) = n < 2 ? n : fib(n - 2) + fib(n - 1), mostly measures call overhead
+static void emit_fib_rec(Yvm::Module* mod)
+{
+    Yvm::Emitter em(false);
+    em.write_const<uint32_t>(2);
+    em.write_2b_inst(OpCode::StackAddr, 0);
+    em.write_2b_inst(OpCode::ICmpLt, 32);
+    auto recurse = em.unq_label_name("recurse");
+    em.create_jump(OpCode::JumpIfFalse, recurse);
+    em.write_2b_inst(OpCode::StackAddr, 0);
+    em.write_1b_inst(OpCode::Ret);
+
+    em.create_label(recurse);
+    em.write_const<uint32_t>(2);
+    em.write_2b_inst(OpCode::StackAddr, 0);
+    em.write_1b_inst(OpCode::Sub32);
+    em.write_fn_addr("fib_rec");
+    em.write_2b_inst(OpCode::Call, 1);
+    em.write_const<uint32_t>(1);
+    em.write_2b_inst(OpCode::StackAddr, 0);
+    em.write_1b_inst(OpCode::Sub32);
+    em.write_fn_addr("fib_rec");
+    em.write_2b_inst(OpCode::Call, 1);
+    em.write_1b_inst(OpCode::Add32);
+    em.write_1b_inst(OpCode::Ret);
+    em.close_function(mod, "fib_rec");
+}
+
+static void time_run(Yvm::VMRunner& runner, uint64_t* code, uint32_t n, const char* name)
+{
+    Yvm::VM::Type arg{ .u32 = n };
     auto now = std::chrono::high_resolution_clock::now();
-    auto output = vm.run_code(asm_code.data(), &arg1, 1);
+    auto output = runner.run_code(code, &arg, 1);
     auto end = std::chrono::high_resolution_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(end - now);
-    std::cout << elapsed.count() << "s" << std::endl;
-    std::cout << *reinterpret_cast<uint32_t*>(&output) << std::endl;
+    std::cout << name << "(" << n << ") = " << output.u32 << " in " << elapsed.count() << "s" << std::endl;
+}
+
+int main() {
+    Yvm::Module mod;
+    Yvm::Assembler asma;
+    mod.code["fib_loop"] = asma.assemble(fib_loop);
+    emit_fib_rec(&mod);
+
+    Yvm::VM vm;
+    for (auto& [name, error] : vm.add_module(&mod))
+        std::cout << name << " failed verification at " << error.offset << ": " << error.message << std::endl;
+    for (auto& sym : vm.link()) std::cout << "unresolved symbol: " << sym << std::endl;
+
+    auto runner = vm.new_runner();
+    time_run(runner, mod.code["fib_loop"].data(), 10'000'000, "fib_loop");
+    time_run(runner, mod.code["fib_rec"].data(), 27, "fib_rec");
 }
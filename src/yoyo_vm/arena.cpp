@@ -0,0 +1,98 @@
+#include "yoyo_vm/arena.h"
+
+#include <algorithm>
+#include <bit>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+
+namespace Yvm
+{
+    namespace
+    {
+        /// every live arena by the start of its region
+        struct Registry
+        {
+            std::shared_mutex mutex;
+            std::map<const uint8_t*, Arena*> arenas;
+            /// frees skip the lock while there's no arena at all
+            std::atomic<size_t> count{ 0 };
+        };
+        Registry& registry()
+        {
+            // never destroyed, arenas of static runners may outlive it otherwise
+            static auto instance = new Registry;
+            return *instance;
+        }
+    }
+
+    Arena::Arena(size_t max_size) : region(max_size)
+    {
+        auto& known = registry();
+        std::unique_lock lock(known.mutex);
+        known.arenas.emplace(region.data(), this);
+        known.count.fetch_add(1, std::memory_order_relaxed);
+    }
+    Arena::~Arena()
+    {
+        auto& known = registry();
+        std::unique_lock lock(known.mutex);
+        known.arenas.erase(region.data());
+        known.count.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void* Arena::allocate(size_t size)
+    {
+        if (remote_frees.load(std::memory_order_relaxed)) take_remote_frees();
+        if (size > region.capacity()) return nullptr;
+        auto size_class = std::max<size_t>(min_class, std::bit_width(std::max<size_t>(size, 1) - 1));
+        if (auto block = free_lists[size_class]) {
+            free_lists[size_class] = *static_cast<void**>(block);
+            return block;
+        }
+        auto block_size = header_size + (size_t{ 1 } << size_class);
+        if (!region.ensure(top + block_size)) return nullptr;
+        auto header = region.data() + top;
+        top += block_size;
+        *reinterpret_cast<size_t*>(header) = size_class;
+        return header + header_size;
+    }
+    void Arena::deallocate(void* ptr)
+    {
+        if (!ptr) return;
+        auto size_class = *reinterpret_cast<size_t*>(static_cast<uint8_t*>(ptr) - header_size);
+        *static_cast<void**>(ptr) = free_lists[size_class];
+        free_lists[size_class] = ptr;
+    }
+    bool Arena::deallocate_shared(void* ptr)
+    {
+        auto& known = registry();
+        if (known.count.load(std::memory_order_relaxed) == 0) return false;
+        // held until the block is handed over, so the arena can't go away meanwhile
+        std::shared_lock lock(known.mutex);
+        auto it = known.arenas.upper_bound(static_cast<const uint8_t*>(ptr));
+        if (it == known.arenas.begin()) return false;
+        auto arena = std::prev(it)->second;
+        if (!arena->reserves(ptr)) return false;
+        auto head = arena->remote_frees.load(std::memory_order_relaxed);
+        do *static_cast<void**>(ptr) = head;
+        while (!arena->remote_frees.compare_exchange_weak(head, ptr, std::memory_order_release, std::memory_order_relaxed));
+        return true;
+    }
+    void Arena::take_remote_frees()
+    {
+        auto block = remote_frees.exchange(nullptr, std::memory_order_acquire);
+        while (block) {
+            auto next = *static_cast<void**>(block);
+            // a block from before a reset was dropped with the rest
+            if (owns(block)) deallocate(block);
+            block = next;
+        }
+    }
+    void Arena::reset()
+    {
+        top = 0;
+        free_lists.fill(nullptr);
+        remote_frees.store(nullptr, std::memory_order_relaxed);
+    }
+}
@@ -1,136 +1,275 @@
 #include "yoyo_vm/assembler.h"
 
+#include <algorithm>
+#include <array>
 #include <charconv>
-#include <iostream>
-#include <ranges>
-#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <limits>
 
 #include "yoyo_vm/instructions.h"
+#include "yoyo_vm/opcode_info.h"
+#include "yoyo_vm/parallel.h"
+#include "yoyo_vm/vm.h"
 #include "yoyo_vm/writer.h"
 namespace Yvm
 {
-
-    static inline void lstrip(std::string_view& arg)
-    {
-        arg.remove_prefix(std::min(arg.find_first_not_of(" \n\t\r"), arg.size()));
-    }
-    static inline void rstrip(std::string_view& arg)
-    {
-        arg.remove_suffix(arg.size() - std::min(arg.find_last_not_of(" ") + 1, arg.size()));
-    }
-    static inline void strip(std::string_view& arg)
-    {
-        lstrip(arg); rstrip(arg);
-    }
-    std::vector<uint64_t> Assembler::assemble(std::string_view code)
+    namespace
     {
+        struct Mnemonic
+        {
+            std::string_view name;
+            OpCode op;
+            /// a branch family picking the smallest offset that reaches the label, @c op is its 8 bit form
+            bool relaxed = false;
+        };
         using enum OpCode;
-        Writer writer;
-        std::unordered_map<std::string_view, OpCode> opcode{
-            {"alloc_const", AllocaConst},
-            {"const8", Constant8},
-            {"s_addr", StackAddr},
-            {"store", Store},
-            {"load", Load},
-            {"icmp_lt", ICmpLt},
-            {"icmp_gt", ICmpGt},
-            {"add32", Add32},
-            {"jump_if_f", JumpIfFalse},
-            {"jump", Jump},
-            {"ret", Ret}
+        using enum OperandKind;
+        constexpr Mnemonic aliases[] = {
+            { "br", Br8, true }, { "br_if_f", BrIfFalse8, true }, { "br_if_t", BrIfTrue8, true },
+            // older spellings
+            { "jump", Br8, true }, { "jump_if_f", BrIfFalse8, true }, { "jump_if_t", BrIfTrue8, true },
+            { "stackaddr", StackAddr }, { "alloca_const", AllocaConst },
         };
-        for (auto line_ptr : code | std::views::split('\n'))
+        /// the spelling of every opcode from its description, then the aliases
+        consteval auto build_mnemonics()
         {
-            std::string_view line{line_ptr.begin(), line_ptr.end()};
-            lstrip(line);
-            if (line.size() == 0 || line[0] == ';') continue;
-            std::string_view instruction{
-                line.data(),std::min(line.find_first_of(" \n\t\r"), line.size())
-            };
-            if (instruction == "alloc_const" ||
-                instruction == "s_addr" ||
-                instruction.starts_with("icmp") ||
-                instruction == "const8")
-            {
-                if (!opcode.contains(instruction)) return {};
-                writer.write_opcode(opcode[instruction]);
-                uint8_t val;
-                std::string_view num{line.data() + instruction.size(), line.data() + line.size()};
-                strip(num);
-                auto ec = std::from_chars(num.data(), num.data() + num.size(), val);
-                if (ec.ec == std::errc::invalid_argument) return {};
-                writer.write_byte(val);
+            std::array<Mnemonic, opcode_count + std::size(aliases)> result{};
+            for (size_t i = 0; i < opcode_count; i++) result[i] = { opcode_table[i].mnemonic, static_cast<OpCode>(i) };
+            for (size_t i = 0; i < std::size(aliases); i++) result[opcode_count + i] = aliases[i];
+            return result;
+        }
+        constexpr auto mnemonics = build_mnemonics();
+        constexpr std::string_view type_names[] = { "i8", "i16", "i32", "i64", "u8", "u16", "u32", "u64", "f32", "f64", "ptr" };
+
+        constexpr uint32_t hash(std::string_view text, uint32_t seed)
+        {
+            uint32_t h = seed ^ 2166136261u;
+            for (auto c : text) h = (h ^ static_cast<uint8_t>(c)) * 16777619u;
+            return h ^ (h >> 15);
+        }
+        constexpr size_t hash_bits = 12;
+        constexpr uint8_t no_mnemonic = 0xFF;
+        static_assert(std::size(mnemonics) < no_mnemonic);
+        /// A seed under which no two mnemonics share a slot, so a lookup is a hash and one compare
+        struct PerfectHash
+        {
+            uint32_t seed = 0;
+            std::array<uint8_t, size_t{ 1 } << hash_bits> slots{};
+        };
+        consteval PerfectHash build_hash()
+        {
+            PerfectHash result;
+            for (uint32_t seed = 1;; seed++) {
+                result.seed = seed;
+                result.slots.fill(no_mnemonic);
+                bool collided = false;
+                for (size_t i = 0; i < std::size(mnemonics) && !collided; i++) {
+                    auto& slot = result.slots[hash(mnemonics[i].name, seed) & (result.slots.size() - 1)];
+                    collided = slot != no_mnemonic;
+                    slot = static_cast<uint8_t>(i);
+                }
+                if (!collided) return result;
+            }
+        }
+        constexpr PerfectHash mnemonic_hash = build_hash();
+        const Mnemonic* find_mnemonic(std::string_view name)
+        {
+            auto index = mnemonic_hash.slots[hash(name, mnemonic_hash.seed) & (mnemonic_hash.slots.size() - 1)];
+            if (index == no_mnemonic || mnemonics[index].name != name) return nullptr;
+            return &mnemonics[index];
+        }
+
+        constexpr bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+        /// split off the next space separated token of @p rest
+        std::string_view next_token(std::string_view& rest)
+        {
+            size_t begin = 0;
+            while (begin < rest.size() && is_space(rest[begin])) begin++;
+            size_t end = begin;
+            while (end < rest.size() && !is_space(rest[end])) end++;
+            auto token = rest.substr(begin, end - begin);
+            rest.remove_prefix(end);
+            return token;
+        }
+        template<typename T>
+        bool parse_number(std::string_view text, T& out)
+        {
+            auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+            return ec == std::errc{} && end == text.data() + text.size();
+        }
+        /// write the offset of @p target relative to the instruction at @p inst_off
+        bool patch_rel(Writer& writer, size_t at, size_t inst_off, uint8_t size, uint64_t target)
+        {
+            auto rel = static_cast<int64_t>(target) - static_cast<int64_t>(inst_off);
+            auto bytes = reinterpret_cast<uint8_t*>(writer.data.data()) + at;
+            if (size == 1) {
+                if (rel < INT8_MIN || rel > INT8_MAX) return false;
+                auto value = static_cast<int8_t>(rel);
+                memcpy(bytes, &value, sizeof(value));
             }
-            else if (instruction == "const32")
-            {
-                writer.write_opcode(Constant32);
-                uint32_t val;
-                std::string_view num{line.data() + instruction.size(), line.data() + line.size()};
-                strip(num);
-                auto ec = std::from_chars(num.data(), num.data() + num.size(), val);
-                if (ec.ec == std::errc::invalid_argument) return {};
-                writer.write_n(val);
+            else if (size == 2) {
+                if (rel < INT16_MIN || rel > INT16_MAX) return false;
+                auto value = static_cast<int16_t>(rel);
+                memcpy(bytes, &value, sizeof(value));
             }
-            else if (instruction == "const64")
-            {
-                writer.write_opcode(Constant64);
-                uint64_t val;
-                std::string_view num{line.data() + instruction.size(), line.data() + line.size()};
-                strip(num);
-                auto ec = std::from_chars(num.data(), num.data() + num.size(), val);
-                if (ec.ec == std::errc::invalid_argument) return {};
-                writer.write_n(val);
+            else {
+                if (rel < INT32_MIN || rel > INT32_MAX) return false;
+                auto value = static_cast<int32_t>(rel);
+                memcpy(bytes, &value, sizeof(value));
             }
-            else if (instruction == "store" || instruction == "load")
-            {
-                writer.write_opcode(opcode[instruction]);
-                std::string_view type{line.data() + instruction.size(), line.data() + line.size()};
-                strip(type);
-                if (type == "i8") writer.write_byte(0);
-                else if (type == "i16") writer.write_byte(1);
-                else if (type == "i32") writer.write_byte(2);
-                else if (type == "i64") writer.write_byte(3);
-                else if (type == "u8") writer.write_byte(4);
-                else if (type == "u16") writer.write_byte(5);
-                else if (type == "u32") writer.write_byte(6);
-                else if (type == "u64") writer.write_byte(7);
-                else if (type == "f32") writer.write_byte(8);
-                else if (type == "f64") writer.write_byte(9);
-                else if (type == "ptr") writer.write_byte(10);
-                else return {};
+            return true;
+        }
+    }
+
+    std::vector<uint64_t> Assembler::assemble(std::string_view code)
+    {
+        Writer writer;
+        jump_addrs.clear();
+        unresolved_jumps.clear();
+        error.reset();
+        // a rough guess of one instruction per 10 characters saves regrowing the code
+        writer.data.reserve(code.size() / 10 / sizeof(uint64_t) * 3);
+        size_t line_no = 0;
+        size_t line_start = 0;
+        auto fail = [&](std::string_view at, std::string message) {
+            auto column = at.data() >= code.data() + line_start ? static_cast<size_t>(at.data() - code.data()) - line_start + 1 : 1;
+            error = AssemblerError{ line_no, column, std::move(message) };
+            return std::vector<uint64_t>{};
+            };
+        // the offset is left as 0 until the label is seen
+        auto write_branch_offset = [&](size_t inst_off, uint8_t size, std::string_view label) {
+            if (size == 1) writer.write_byte(0);
+            else if (size == 2) writer.write_n(int16_t{ 0 });
+            else writer.write_n(int32_t{ 0 });
+            auto at = writer.byte_off - size;
+            if (auto it = jump_addrs.find(label); it != jump_addrs.end())
+                return patch_rel(writer, at, inst_off, size, it->second);
+            unresolved_jumps[at] = PendingBranch{ inst_off, size, label, line_no, static_cast<size_t>(label.data() - code.data()) - line_start + 1 };
+            return true;
+            };
+
+        while (line_start < code.size()) {
+            auto line_end = code.find('\n', line_start);
+            if (line_end == std::string_view::npos) line_end = code.size();
+            auto rest = code.substr(line_start, line_end - line_start);
+            line_no++;
+            if (auto comment = rest.find(';'); comment != std::string_view::npos) rest = rest.substr(0, comment);
+
+            auto token = next_token(rest);
+            if (!token.empty() && token.back() == ':') {
+                auto label = token.substr(0, token.size() - 1);
+                if (label.empty()) return fail(token, "empty label");
+                if (!jump_addrs.try_emplace(label, writer.byte_off).second) return fail(token, "label defined twice");
+                token = next_token(rest);
             }
-            else if (instruction.ends_with(':'))
-            {
-                instruction.remove_suffix(1);
-                jump_addrs[instruction] = writer.byte_off;
+            if (token.empty()) {
+                line_start = line_end + 1;
+                continue;
             }
-            else if (instruction == "jump_if_f" || instruction == "jump")
-            {
-                writer.write_opcode(Constant64);
-                writer.write_n(uint64_t{0});
-                auto addr = writer.data.size() - 1;
-                std::string_view label{line.data() + instruction.size(), line.data() + line.size()};
-                strip(label);
-                if (jump_addrs.contains(label)) writer.data[addr] = jump_addrs[label];
-                else unresolved_jumps[addr] = label;
-                writer.write_opcode(opcode[instruction]);
+            auto mnemonic = find_mnemonic(token);
+            if (!mnemonic) return fail(token, "unknown instruction '" + std::string(token) + "'");
+            auto inst_off = writer.byte_off;
+            if (mnemonic->relaxed) {
+                // labels behind are already known so their branch gets the smallest offset,
+                // branches ahead take 32 bits
+                auto label = next_token(rest);
+                if (label.empty()) return fail(rest, "missing label");
+                auto first = static_cast<uint8_t>(mnemonic->op);
+                uint8_t size = 4;
+                if (auto it = jump_addrs.find(label); it != jump_addrs.end()) {
+                    auto rel = static_cast<int64_t>(it->second) - static_cast<int64_t>(inst_off);
+                    size = rel >= INT8_MIN && rel <= INT8_MAX ? 1 : rel >= INT16_MIN && rel <= INT16_MAX ? 2 : 4;
+                }
+                writer.write_opcode(static_cast<OpCode>(first + (size == 1 ? 0 : size == 2 ? 1 : 2)));
+                write_branch_offset(inst_off, size, label);
             }
-            else if (instruction.starts_with("add")
-                || instruction.starts_with("sub")
-                || instruction.starts_with("mul")
-                || instruction == "ret")
-            {
-                writer.write_opcode(opcode[instruction]);
+            else {
+                writer.write_opcode(mnemonic->op);
+                for (auto kind : opcode_table[static_cast<size_t>(mnemonic->op)].operands) {
+                    if (kind == None) break;
+                    auto operand = next_token(rest);
+                    if (operand.empty()) return fail(rest, "missing operand for '" + std::string(token) + "'");
+                    bool valid = true;
+                    switch (kind)
+                    {
+                    case U8: { uint8_t v = 0; valid = parse_number(operand, v); writer.write_byte(v); break; }
+                    case I8: { int8_t v = 0; valid = parse_number(operand, v); writer.write_byte(static_cast<uint8_t>(v)); break; }
+                    case U16: { uint16_t v = 0; valid = parse_number(operand, v); writer.write_n(v); break; }
+                    case I16: { int16_t v = 0; valid = parse_number(operand, v); writer.write_n(v); break; }
+                    case U32: { uint32_t v = 0; valid = parse_number(operand, v); writer.write_n(v); break; }
+                    case I32: { int32_t v = 0; valid = parse_number(operand, v); writer.write_n(v); break; }
+                    case U64: case I64:
+                        {
+                            // either sign is accepted, negative values are written in two's complement
+                            uint64_t v = 0;
+                            int64_t s = 0;
+                            if (operand[0] == '-') { valid = parse_number(operand, s); v = static_cast<uint64_t>(s); }
+                            else valid = parse_number(operand, v);
+                            writer.write_n(v);
+                            break;
+                        }
+                    case F32: { float v = 0; valid = parse_number(operand, v); writer.write_n(v); break; }
+                    case F64: { double v = 0; valid = parse_number(operand, v); writer.write_n(v); break; }
+                    case Width:
+                        {
+                            uint8_t v = 0;
+                            valid = parse_number(operand, v) && (v == 8 || v == 16 || v == 32 || v == 64);
+                            writer.write_byte(v);
+                            break;
+                        }
+                    case OperandKind::Type:
+                        {
+                            auto type = std::ranges::find(type_names, operand);
+                            valid = type != std::end(type_names);
+                            writer.write_byte(static_cast<uint8_t>(type - std::begin(type_names)));
+                            break;
+                        }
+                    case Cmp:
+                        {
+                            auto cmp = find_mnemonic(operand);
+                            valid = cmp && cmp->op >= CmpEq && cmp->op <= FCmpLe;
+                            if (valid) writer.write_opcode(cmp->op);
+                            break;
+                        }
+                    case Rel8: valid = write_branch_offset(inst_off, 1, operand); break;
+                    case Rel16: valid = write_branch_offset(inst_off, 2, operand); break;
+                    case Rel32: valid = write_branch_offset(inst_off, 4, operand); break;
+                    default: valid = false; break;
+                    }
+                    if (!valid) return fail(operand, "invalid operand '" + std::string(operand) + "' for '" + std::string(token) + "'");
+                }
             }
-            else
-                return {};
+            if (auto extra = next_token(rest); !extra.empty()) return fail(extra, "unexpected operand '" + std::string(extra) + "'");
+            line_start = line_end + 1;
         }
-        //resolve jumps
-        for (auto [code, label] : unresolved_jumps)
+        for (auto& [at, branch] : unresolved_jumps)
         {
-            writer.data[code] = jump_addrs[label];
+            auto target = jump_addrs.find(branch.label);
+            if (target == jump_addrs.end() || !patch_rel(writer, at, branch.inst_off, branch.size, target->second)) {
+                error = AssemblerError{ branch.line, branch.column, target == jump_addrs.end()
+                    ? "undefined label '" + std::string(branch.label) + "'"
+                    : "label '" + std::string(branch.label) + "' is out of range" };
+                return {};
+            }
         }
         return writer.data;
     }
-
-}
\ No newline at end of file
+    std::vector<std::pair<std::string, AssemblerError>> Assembler::assemble_all(
+        std::span<const std::pair<std::string, std::string_view>> functions, Module& module, unsigned threads)
+    {
+        std::vector<std::vector<uint64_t>> results(functions.size());
+        std::vector<std::optional<AssemblerError>> errors(functions.size());
+        parallel_for(functions.size(), threads, [&](size_t i) {
+            Assembler assembler;
+            results[i] = assembler.assemble(functions[i].second);
+            errors[i] = std::move(assembler.error);
+            });
+        std::vector<std::pair<std::string, AssemblerError>> failed;
+        for (size_t i = 0; i < functions.size(); i++) {
+            if (errors[i]) failed.emplace_back(functions[i].first, std::move(*errors[i]));
+            else module.code[functions[i].first] = std::move(results[i]);
+        }
+        return failed;
+    }
+}
@@ -0,0 +1,320 @@
+#include "yoyo_vm/decoder.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "yoyo_vm/opcode_info.h"
+
+namespace Yvm
+{
+    namespace
+    {
+        struct Reader
+        {
+            const uint8_t* base;
+            size_t size;
+            size_t off = 0;
+            bool failed = false;
+            uint8_t byte()
+            {
+                if (off >= size) { failed = true; return 0; }
+                return base[off++];
+            }
+            /// Read a constant, skipping the padding the @c Writer put in front of it
+            template<typename T>
+            T aligned()
+            {
+                constexpr auto n = sizeof(T);
+                off += (n - off % n) % n;
+                if (off + n > size) { failed = true; return T{}; }
+                T value;
+                memcpy(&value, base + off, n);
+                off += n;
+                return value;
+            }
+            /// Read an operand of @p kind, signed ones are sign extended and floats are kept as their bits
+            uint64_t operand(OperandKind kind)
+            {
+                using enum OperandKind;
+                switch (kind)
+                {
+                case I8: case Rel8: return static_cast<uint64_t>(static_cast<int64_t>(static_cast<int8_t>(byte())));
+                case U16: return aligned<uint16_t>();
+                case I16: case Rel16: return static_cast<uint64_t>(static_cast<int64_t>(aligned<int16_t>()));
+                case U32: case F32: return aligned<uint32_t>();
+                case I32: case Rel32: return static_cast<uint64_t>(static_cast<int64_t>(aligned<int32_t>()));
+                case U64: case I64: case F64: return aligned<uint64_t>();
+                case None: return 0;
+                default: return byte();
+                }
+            }
+        };
+        /// index of a width operand in a YVM_INT_OPS family, -1 if it's invalid
+        int int_width(uint8_t width)
+        {
+            switch (width)
+            {
+            case 8: return 0;
+            case 16: return 1;
+            case 32: return 2;
+            case 64: return 3;
+            default: return -1;
+            }
+        }
+        /// index of a width operand in a YVM_FP_OPS family, -1 if it's invalid
+        int fp_width(uint8_t width)
+        {
+            switch (width)
+            {
+            case 32: return 0;
+            case 64: return 1;
+            default: return -1;
+            }
+        }
+        DecodedOp family(DecodedOp first, int index)
+        {
+            if (index < 0) return DecodedOp::Invalid;
+            return static_cast<DecodedOp>(static_cast<uint16_t>(first) + index);
+        }
+    }
+    static_assert(static_cast<int>(DecodedOp::FDiv64) - static_cast<int>(DecodedOp::Add8) ==
+        static_cast<int>(OpCode::FDiv64) - static_cast<int>(OpCode::Add8), "arithmetic operations must line up");
+    static_assert(static_cast<int>(DecodedOp::JumpIfNotFCmpEq32) - static_cast<int>(DecodedOp::JumpIfNotCmpEq8) ==
+        (static_cast<int>(OpCode::FCmpEq) - static_cast<int>(OpCode::CmpEq)) * 4, "compare and jump families must follow the comparisons");
+
+    std::string_view operation_name(DecodedOp op)
+    {
+#define YVM_DECODED_NAME(OP) #OP,
+        static constexpr std::string_view names[] = { YVM_DECODED_OPS(YVM_DECODED_NAME) };
+#undef YVM_DECODED_NAME
+        auto index = static_cast<size_t>(op);
+        return index < std::size(names) ? names[index] : "?";
+    }
+    bool is_direct_jump(DecodedOp op)
+    {
+        return op == DecodedOp::JumpDirect || op == DecodedOp::JumpIfFalseDirect || op == DecodedOp::BrIfFalse || op == DecodedOp::BrIfTrue
+            || (op >= DecodedOp::JumpIfNotCmpEq8 && op <= DecodedOp::JumpIfNotFCmpLe64);
+    }
+
+    uint32_t DecodedFunction::index_of(uint64_t offset) const
+    {
+        auto it = std::ranges::lower_bound(offsets, offset);
+        if (it == offsets.end() || *it != offset) return static_cast<uint32_t>(code.size() - 1);
+        return static_cast<uint32_t>(it - offsets.begin());
+    }
+
+    DecodedFunction decode(std::span<const uint64_t> code, const FunctionInfo* info)
+    {
+        using enum OpCode;
+        DecodedFunction fn;
+        fn.source = code.data();
+        if (info) fn.checkpoint_count = info->checkpoint_count;
+        Reader reader{ reinterpret_cast<const uint8_t*>(code.data()), code.size() * sizeof(uint64_t) };
+        while (reader.off < reader.size)
+        {
+            auto offset = static_cast<uint32_t>(reader.off);
+            DecodedInst inst{ DecodedOp::Invalid };
+            auto op = static_cast<OpCode>(reader.byte());
+            // the operands are read as the opcode table describes them, the switch only picks the operation
+            std::array<uint64_t, 3> operands{};
+            if (auto op_info = opcode_info(op))
+            {
+                for (size_t i = 0; i < op_info->operand_count(); i++) operands[i] = reader.operand(op_info->operands[i]);
+            }
+            auto arg = static_cast<uint8_t>(operands[0]);
+            switch (op)
+            {
+            case Nop: inst.op = DecodedOp::Nop; break;
+            case Add8: case Add16: case Add32: case Add64:
+            case Sub8: case Sub16: case Sub32: case Sub64:
+            case Mul8: case Mul16: case Mul32: case Mul64:
+            case IDiv8: case IDiv16: case IDiv32: case IDiv64:
+            case UDiv8: case UDiv16: case UDiv32: case UDiv64:
+            case IRem8: case IRem16: case IRem32: case IRem64:
+            case URem8: case URem16: case URem32: case URem64:
+            case FAdd32: case FAdd64:
+            case FSub32: case FSub64:
+            case FMul32: case FMul64:
+            case FDiv32: case FDiv64:
+                // these are laid out identically in both enums
+                inst.op = family(DecodedOp::Add8, static_cast<uint8_t>(op) - static_cast<uint8_t>(Add8));
+                break;
+            case Or: inst.op = DecodedOp::Or; break;
+            case And: inst.op = DecodedOp::And; break;
+            case Not: inst.op = DecodedOp::Not; break;
+            case Alloca: inst.op = DecodedOp::Alloca; break;
+            case MemCpy: inst.op = DecodedOp::MemCpy; break;
+            case Malloc: inst.op = DecodedOp::Malloc; break;
+            case Free: inst.op = DecodedOp::Free; break;
+            case PtrOff: inst.op = DecodedOp::PtrOff; break;
+            case FNeg32: inst.op = DecodedOp::FNeg32; break;
+            case FNeg64: inst.op = DecodedOp::FNeg64; break;
+            case Jump: inst.op = DecodedOp::Jump; break;
+            case JumpIfFalse: inst.op = DecodedOp::JumpIfFalse; break;
+            case Ret: inst.op = DecodedOp::Ret; break;
+            case RetVoid: inst.op = DecodedOp::RetVoid; break;
+            case RegObj: inst.op = DecodedOp::RegObj; break;
+            case Panic: inst.op = DecodedOp::Panic; break;
+            case CheckReg: inst.op = DecodedOp::CheckReg; break;
+            case PopReg: inst.op = DecodedOp::PopReg; break;
+            case Pop: inst.op = DecodedOp::Pop; break;
+            case Dup: inst.op = DecodedOp::Dup; break;
+            case Switch: inst.op = DecodedOp::Switch; break;
+            case TopConsume: inst.op = DecodedOp::TopConsume; break;
+
+            case Constant8: case Constant16: case Constant32: case Constant64:
+            case Constant64FromU8: case Constant64FromU16: case Constant64FromU32:
+            case Constant64FromI8: case Constant64FromI16: case Constant64FromI32:
+            case ConstantF32: case ConstantF64: case ConstantPtr:
+                inst.op = DecodedOp::Const;
+                inst.imm = operands[0];
+                break;
+
+            case ExternalIntrinsic: inst.op = DecodedOp::ExternalIntrinsic; inst.arg = arg; break;
+            case Checkpoint: inst.op = DecodedOp::Checkpoint; inst.arg = arg; break;
+            case StackAddr: inst.op = DecodedOp::StackAddr; inst.arg = arg; break;
+            case RevStackAddr: inst.op = DecodedOp::RevStackAddr; inst.arg = arg; break;
+            case StackCheckpoint: inst.op = DecodedOp::StackCheckpoint; inst.arg = arg; break;
+            case PtrOffConst: inst.op = DecodedOp::PtrOffConst; inst.arg = arg; break;
+            case AllocaConst: inst.op = DecodedOp::AllocaConst; inst.arg = arg; break;
+            case Call:
+                inst.op = DecodedOp::Call;
+                inst.arg = arg;
+                inst.target = static_cast<uint32_t>(fn.call_cache.size());
+                fn.call_cache.push_back(nullptr);
+                break;
+            case NativeCall: inst.op = DecodedOp::NativeCall; inst.arg = arg; break;
+
+            case CmpEq: inst.op = family(DecodedOp::CmpEq8, int_width(arg)); break;
+            case CmpNe: inst.op = family(DecodedOp::CmpNe8, int_width(arg)); break;
+            case UCmpGt: inst.op = family(DecodedOp::UCmpGt8, int_width(arg)); break;
+            case UCmpGe: inst.op = family(DecodedOp::UCmpGe8, int_width(arg)); break;
+            case UCmpLt: inst.op = family(DecodedOp::UCmpLt8, int_width(arg)); break;
+            case UCmpLe: inst.op = family(DecodedOp::UCmpLe8, int_width(arg)); break;
+            case ICmpGt: inst.op = family(DecodedOp::ICmpGt8, int_width(arg)); break;
+            case ICmpGe: inst.op = family(DecodedOp::ICmpGe8, int_width(arg)); break;
+            case ICmpLt: inst.op = family(DecodedOp::ICmpLt8, int_width(arg)); break;
+            case ICmpLe: inst.op = family(DecodedOp::ICmpLe8, int_width(arg)); break;
+            case FCmpEq: inst.op = family(DecodedOp::FCmpEq32, fp_width(arg)); break;
+            case FCmpNe: inst.op = family(DecodedOp::FCmpNe32, fp_width(arg)); break;
+            case FCmpGt: inst.op = family(DecodedOp::FCmpGt32, fp_width(arg)); break;
+            case FCmpGe: inst.op = family(DecodedOp::FCmpGe32, fp_width(arg)); break;
+            case FCmpLt: inst.op = family(DecodedOp::FCmpLt32, fp_width(arg)); break;
+            case FCmpLe: inst.op = family(DecodedOp::FCmpLe32, fp_width(arg)); break;
+            case Shl: inst.op = family(DecodedOp::Shl8, int_width(arg)); break;
+            case Shr: inst.op = family(DecodedOp::Shr8, int_width(arg)); break;
+            case BitAnd: inst.op = family(DecodedOp::BitAnd8, int_width(arg)); break;
+            case BitOr: inst.op = family(DecodedOp::BitOr8, int_width(arg)); break;
+            case BitXor: inst.op = family(DecodedOp::BitXor8, int_width(arg)); break;
+            case Load:
+            case Store:
+                {
+                    if (arg > 10) break;
+                    inst.op = family(op == Load ? DecodedOp::LoadI8 : DecodedOp::StoreI8, arg);
+                    break;
+                }
+            case UConv:
+            case SConv:
+                {
+                    auto from = int_width(arg);
+                    auto to = int_width(static_cast<uint8_t>(operands[1]));
+                    if (from < 0 || to < 0) break;
+                    inst.op = family(op == UConv ? DecodedOp::UConv8To8 : DecodedOp::SConv8To8, from * 4 + to);
+                    break;
+                }
+            case FpConv:
+                {
+                    auto from = fp_width(arg);
+                    auto to = fp_width(static_cast<uint8_t>(operands[1]));
+                    if (from < 0 || to < 0) break;
+                    inst.op = family(DecodedOp::FpConv32To32, from * 2 + to);
+                    break;
+                }
+            case FpToSi:
+            case FpToUi:
+                {
+                    auto from = fp_width(arg);
+                    auto to = int_width(static_cast<uint8_t>(operands[1]));
+                    if (from < 0 || to < 0) break;
+                    inst.op = family(op == FpToSi ? DecodedOp::FpToSi32To8 : DecodedOp::FpToUi32To8, from * 4 + to);
+                    break;
+                }
+            case UiToFp:
+            case SiToFp:
+                {
+                    auto from = int_width(arg);
+                    auto to = fp_width(static_cast<uint8_t>(operands[1]));
+                    if (from < 0 || to < 0) break;
+                    inst.op = family(op == UiToFp ? DecodedOp::UiToFp8To32 : DecodedOp::SiToFp8To32, from * 2 + to);
+                    break;
+                }
+            case LoadLocal:
+            case StoreLocal:
+                {
+                    inst.arg = arg;
+                    auto type = static_cast<uint8_t>(operands[1]);
+                    if (type > 10) break;
+                    inst.op = family(op == LoadLocal ? DecodedOp::LoadLocalI8 : DecodedOp::StoreLocalI8, type);
+                    break;
+                }
+            case AddImm:
+                inst.op = family(DecodedOp::AddImm8, int_width(arg));
+                inst.imm = operands[1];
+                break;
+            // the target offset is kept in imm until every instruction is known
+            case Br8: case Br16: case Br32:
+            case BrIfFalse8: case BrIfFalse16: case BrIfFalse32:
+            case BrIfTrue8: case BrIfTrue16: case BrIfTrue32:
+                {
+                    auto index = static_cast<int>(op) - static_cast<int>(Br8);
+                    // a branch does exactly what a jump fused with its constant does
+                    constexpr DecodedOp kinds[] = { DecodedOp::JumpDirect, DecodedOp::BrIfFalse, DecodedOp::BrIfTrue };
+                    inst.op = kinds[index / 3];
+                    inst.imm = offset + operands[0];
+                    break;
+                }
+            case CmpJumpIfFalse:
+                {
+                    auto cmp = static_cast<OpCode>(arg);
+                    auto width = static_cast<uint8_t>(operands[1]);
+                    inst.imm = offset + operands[2];
+                    if (cmp >= CmpEq && cmp <= ICmpLe)
+                        inst.op = family(family(DecodedOp::JumpIfNotCmpEq8, (static_cast<int>(cmp) - static_cast<int>(CmpEq)) * 4), int_width(width));
+                    else if (cmp >= FCmpEq && cmp <= FCmpLe)
+                        inst.op = family(family(DecodedOp::JumpIfNotFCmpEq32, (static_cast<int>(cmp) - static_cast<int>(FCmpEq)) * 2), fp_width(width));
+                    break;
+                }
+            default: break;
+            }
+            if (reader.failed) inst.op = DecodedOp::Invalid;
+            if (inst.op == DecodedOp::Checkpoint || inst.op == DecodedOp::StackCheckpoint)
+            {
+                if (!info) fn.checkpoint_count = std::max<uint32_t>(fn.checkpoint_count, inst.arg + 1u);
+                else if (inst.arg >= info->checkpoint_count) inst.op = DecodedOp::Invalid;
+            }
+            fn.code.push_back(inst);
+            fn.offsets.push_back(offset);
+            if (reader.failed) break;
+        }
+        fn.code.push_back(DecodedInst{ DecodedOp::Invalid });
+        fn.offsets.push_back(static_cast<uint32_t>(reader.size));
+        fn.max_stack = static_cast<uint32_t>(fn.code.size());
+
+        // jumps to a constant address are resolved ahead of time like branches
+        // so the jump doesn't have to search for its target
+        for (size_t i = 0; i + 1 < fn.code.size(); i++)
+        {
+            auto& inst = fn.code[i];
+            if (inst.op != DecodedOp::Const) continue;
+            auto next = fn.code[i + 1].op;
+            if (next != DecodedOp::Jump && next != DecodedOp::JumpIfFalse) continue;
+            inst.op = next == DecodedOp::Jump ? DecodedOp::JumpDirect : DecodedOp::JumpIfFalseDirect;
+        }
+        for (auto& inst : fn.code)
+        {
+            if (is_direct_jump(inst.op)) inst.target = fn.index_of(inst.imm);
+        }
+        return fn;
+    }
+}
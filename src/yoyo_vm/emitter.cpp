@@ -1,10 +1,43 @@
 #include "yoyo_vm/emitter.h"
 
+#include <cstring>
 #include <limits>
+#include <unordered_map>
+
+#include "yoyo_vm/parallel.h"
 
 namespace Yvm
 {
     using enum OpCode;
+    namespace
+    {
+        bool is_int_constant(OpCode op)
+        {
+            switch (op)
+            {
+            case Constant8: case Constant16: case Constant32: case Constant64:
+            case Constant64FromU8: case Constant64FromU16: case Constant64FromU32:
+            case Constant64FromI8: case Constant64FromI16: case Constant64FromI32:
+                return true;
+            default: return false;
+            }
+        }
+        /// Write a constant back with the encoding it originally had
+        void write_constant(Writer& writer, OpCode op, uint64_t imm)
+        {
+            writer.write_opcode(op);
+            switch (op)
+            {
+            case Constant8: case Constant64FromU8: case Constant64FromI8:
+                writer.write_byte(static_cast<uint8_t>(imm)); break;
+            case Constant16: case Constant64FromU16: case Constant64FromI16:
+                writer.write_n(static_cast<uint16_t>(imm)); break;
+            case Constant32: case Constant64FromU32: case Constant64FromI32: case ConstantF32:
+                writer.write_n(static_cast<uint32_t>(imm)); break;
+            default: writer.write_n(imm); break;
+            }
+        }
+    }
     Emitter::Emitter(bool unify_alloc)
     {
         unify_alloca = unify_alloc;
@@ -46,9 +79,26 @@ namespace Yvm
 
     void Emitter::resolve_jumps()
     {
-        for (auto& [code, label] : unresolved_jumps)
+        for (auto& [at, jump] : unresolved_jumps)
         {
-            writer.data[code] = jump_addrs[label];
+            auto rel = static_cast<int32_t>(jump_addrs[jump.second] - jump.first);
+            memcpy(reinterpret_cast<uint8_t*>(writer.data.data()) + at, &rel, sizeof(rel));
+        }
+    }
+    void Emitter::emit_all(std::span<const std::pair<std::string, EmitFunction>> functions, Module& module,
+        unsigned threads, bool unify_alloca)
+    {
+        std::vector<Module> results(functions.size());
+        parallel_for(functions.size(), threads, [&](size_t i) {
+            Emitter emitter(unify_alloca);
+            functions[i].second(emitter);
+            emitter.close_function(&results[i], functions[i].first);
+            });
+        // moving the code keeps its buffer, so the externals stay valid
+        for (auto& result : results) {
+            for (auto& [name, code] : result.code) module.code[name] = std::move(code);
+            for (auto& [name, info] : result.function_info) module.function_info[name] = info;
+            module.unresolved_externals.merge(result.unresolved_externals);
         }
     }
     void Emitter::write_fn_addr(const std::string& fn_name) {
@@ -56,18 +106,27 @@ namespace Yvm
         auto addr = writer.data.size() - 1;
         function_addrs.emplace_back(addr, fn_name);
     }
+    void Emitter::write_native_call(const std::string& fn_name, uint8_t arg_size) {
+        // no proto, the trampoline knows the signature
+        write_const<void*>(nullptr);
+        write_fn_addr(fn_name);
+        write_2b_inst(OpCode::NativeCall, arg_size);
+    }
     void Emitter::close_function(Module* mod, const std::string& name) {
         if (last_inst == OpCode::Ret || last_inst == OpCode::RetVoid) return;
         write_1b_inst(OpCode::RetVoid);
         if (unify_alloca) {
-            alloca_writer.write_opcode(Constant64FromU8);
-            alloca_writer.write_n(static_cast<uint8_t>(jump_addrs["entry"]));
-            alloca_writer.write_opcode(Jump);
-            jump_addrs["alloca_region"] = writer.data.size() * 8;
+            auto region = writer.data.size() * 8;
+            auto inst_off = alloca_writer.byte_off;
+            alloca_writer.write_opcode(Br32);
+            alloca_writer.write_n(static_cast<int32_t>(jump_addrs["entry"] - (region + inst_off)));
+            jump_addrs["alloca_region"] = region;
             writer.data.insert(writer.data.end(), alloca_writer.data.begin(), alloca_writer.data.end());
         }
         resolve_jumps();
+        finish_code();
         mod->code[name] = std::move(writer.data);
+        mod->function_info[name] = FunctionInfo{ .checkpoint_count = static_cast<uint32_t>(last_checkpoint) };
         auto& this_fn = mod->code[name];
 
         for (auto& [addr, fn_name] : function_addrs) {
@@ -81,9 +140,180 @@ namespace Yvm
         alloca_writer.byte_off = 0;
         alloca_writer.data.clear();
         unresolved_jumps.clear();
+        function_addrs.clear();
         last_alloc = 0;
         last_checkpoint = 0;
     }
+    void Emitter::finish_code()
+    {
+        using Op = DecodedOp;
+        auto fn = decode(writer.data);
+        auto raw = reinterpret_cast<const uint8_t*>(writer.data.data());
+        // the terminating Invalid is left out
+        auto count = fn.code.size() - 1;
+        auto is_branch = [&](size_t i) {
+            auto op = static_cast<OpCode>(raw[fn.offsets[i]]);
+            return op >= Br8 && op <= BrIfTrue32;
+            };
+        // a jump fused with the constant before it spans two instructions
+        auto jump_length = [&](size_t i) -> size_t {
+            return (fn.code[i].op == Op::JumpDirect || fn.code[i].op == Op::JumpIfFalseDirect) && !is_branch(i) ? 2 : 1;
+            };
+        std::vector<bool> is_target(fn.code.size());
+        for (size_t i = 0; i < count; i++)
+        {
+            auto& inst = fn.code[i];
+            // jumps that can't be followed statically would land in the middle of the new code
+            if (inst.op == Op::Invalid || inst.op == Op::Jump || inst.op == Op::JumpIfFalse) return;
+            if (!is_direct_jump(inst.op)) continue;
+            if (fn.offsets[inst.target] != inst.imm) return;
+            is_target[inst.target] = true;
+            i += jump_length(i) - 1;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            if (is_target[i] && (fn.code[i].op == Op::Jump || fn.code[i].op == Op::JumpIfFalse)) return;
+        }
+        // instructions that are not jumped to can be merged into the one before them
+        auto fusable = [&](size_t i) { return superinstructions && i < count && !is_target[i]; };
+        auto branch_if_false = [&](size_t i) {
+            return fusable(i) && (fn.code[i].op == Op::BrIfFalse || fn.code[i].op == Op::JumpIfFalseDirect);
+            };
+
+        struct Fixup
+        {
+            /// byte offset of the offset to patch
+            size_t at;
+            uint32_t target;
+            size_t inst_off;
+            /// log2 of the offset's size
+            uint8_t size;
+            /// the instruction whose offset grows if it doesn't fit
+            size_t index;
+        };
+        std::vector<size_t> new_offsets(fn.code.size());
+        std::vector<Fixup> fixups;
+        std::unordered_map<size_t, size_t> moved_words;
+        // every branch starts with an 8 bit offset and only grows, so this settles
+        std::vector<uint8_t> sizes(count);
+        while (true)
+        {
+            Writer out;
+            fixups.clear();
+            moved_words.clear();
+            auto write_offset = [&](size_t start, uint8_t size, uint32_t target, size_t index) {
+                if (size == 0) out.write_byte(0);
+                else if (size == 1) out.write_n(int16_t{ 0 });
+                else out.write_n(int32_t{ 0 });
+                fixups.push_back({ out.byte_off - (size_t{ 1 } << size), target, start, size, index });
+                };
+            auto write_branch = [&](OpCode first, size_t start, uint32_t target, size_t index) {
+                out.write_opcode(static_cast<OpCode>(static_cast<uint8_t>(first) + sizes[index]));
+                write_offset(start, sizes[index], target, index);
+                };
+            for (size_t i = 0; i < count;)
+            {
+                auto& inst = fn.code[i];
+                auto op = static_cast<OpCode>(raw[fn.offsets[i]]);
+                auto start = out.byte_off;
+                auto next = fusable(i + 1) ? fn.code[i + 1].op : Op::Invalid;
+                size_t length = 1;
+                if (op == StackAddr && next >= Op::LoadI8 && next <= Op::StorePtr)
+                {
+                    auto load = next <= Op::LoadPtr;
+                    out.write_opcode(load ? LoadLocal : StoreLocal);
+                    out.write_byte(inst.arg);
+                    out.write_byte(static_cast<uint8_t>(static_cast<int>(next) - static_cast<int>(load ? Op::LoadI8 : Op::StoreI8)));
+                    length = 2;
+                }
+                else if (inst.op == Op::Const && is_int_constant(op) && next >= Op::Add8 && next <= Op::Add64 &&
+                    [&] {
+                        // the constant only has to match in the bits the addition uses
+                        auto bits = 8 << (static_cast<int>(next) - static_cast<int>(Op::Add8));
+                        auto mask = bits == 64 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << bits) - 1;
+                        auto extended = static_cast<uint64_t>(static_cast<int64_t>(static_cast<int8_t>(inst.imm)));
+                        return ((extended ^ inst.imm) & mask) == 0;
+                    }())
+                {
+                    out.write_opcode(AddImm);
+                    out.write_byte(static_cast<uint8_t>(8 << (static_cast<int>(next) - static_cast<int>(Op::Add8))));
+                    out.write_byte(static_cast<uint8_t>(inst.imm));
+                    length = 2;
+                }
+                else if (inst.op >= Op::CmpEq8 && inst.op <= Op::FCmpLe64 && branch_if_false(i + 1))
+                {
+                    out.write_opcode(CmpJumpIfFalse);
+                    // the comparison and its width
+                    out.write_byte(raw[fn.offsets[i]]);
+                    out.write_byte(raw[fn.offsets[i] + 1]);
+                    write_offset(start, 2, fn.code[i + 1].target, i);
+                    length = 1 + jump_length(i + 1);
+                }
+                // Not only looks at the low byte like the branch does
+                else if (inst.op == Op::Not && branch_if_false(i + 1))
+                {
+                    write_branch(BrIfTrue8, start, fn.code[i + 1].target, i);
+                    length = 1 + jump_length(i + 1);
+                }
+                else if (inst.op == Op::JumpDirect)
+                {
+                    write_branch(Br8, start, inst.target, i);
+                    length = jump_length(i);
+                }
+                else if (inst.op == Op::JumpIfFalseDirect || inst.op == Op::BrIfFalse)
+                {
+                    write_branch(BrIfFalse8, start, inst.target, i);
+                    length = jump_length(i);
+                }
+                else if (inst.op == Op::BrIfTrue) write_branch(BrIfTrue8, start, inst.target, i);
+                else if (inst.op >= Op::JumpIfNotCmpEq8 && inst.op <= Op::JumpIfNotFCmpLe64)
+                {
+                    out.write_opcode(CmpJumpIfFalse);
+                    out.write_byte(raw[fn.offsets[i] + 1]);
+                    out.write_byte(raw[fn.offsets[i] + 2]);
+                    write_offset(start, 2, inst.target, i);
+                }
+                else if (inst.op == Op::Const)
+                {
+                    write_constant(out, op, inst.imm);
+                    if (op == ConstantPtr) moved_words[fn.offsets[i + 1] / 8 - 1] = out.byte_off / 8 - 1;
+                }
+                // nothing else has aligned operands
+                else for (auto b = fn.offsets[i]; b < fn.offsets[i + 1]; b++) out.write_byte(raw[b]);
+
+                for (size_t j = i; j < i + length; j++) new_offsets[j] = start;
+                i += length;
+            }
+            new_offsets[count] = out.byte_off;
+
+            bool grown = false;
+            for (auto& fixup : fixups)
+            {
+                auto rel = static_cast<int64_t>(new_offsets[fixup.target]) - static_cast<int64_t>(fixup.inst_off);
+                auto limit = int64_t{ 1 } << (8 * (1 << fixup.size) - 1);
+                if (rel >= -limit && rel < limit) continue;
+                sizes[fixup.index]++;
+                grown = true;
+            }
+            if (grown) continue;
+
+            for (auto& [addr, fn_name] : function_addrs)
+            {
+                if (!moved_words.contains(addr)) return;
+            }
+            auto bytes = reinterpret_cast<uint8_t*>(out.data.data());
+            for (auto& fixup : fixups)
+            {
+                auto rel = static_cast<int32_t>(new_offsets[fixup.target] - fixup.inst_off);
+                // little endian, the low bytes are the narrower offset
+                memcpy(bytes + fixup.at, &rel, size_t{ 1 } << fixup.size);
+            }
+            for (auto& [addr, fn_name] : function_addrs) addr = moved_words[addr];
+            writer.data = std::move(out.data);
+            writer.byte_off = out.byte_off;
+            return;
+        }
+    }
     void Emitter::write_ptr_off(uint32_t off) {
         // we can statically skip the instruction
         if (off == 0) return;
@@ -193,16 +423,18 @@ namespace Yvm
 
     void Emitter::create_jump(OpCode code, const std::string& label_name)
     {
+        auto first = Br8;
+        if (code == JumpIfFalse || (code >= BrIfFalse8 && code <= BrIfFalse32)) first = BrIfFalse8;
+        else if (code >= BrIfTrue8 && code <= BrIfTrue32) first = BrIfTrue8;
+        // the offset is narrowed by close_function once the whole function is known
+        auto inst_off = writer.byte_off;
+        writer.write_opcode(static_cast<OpCode>(static_cast<uint8_t>(first) + 2));
+        writer.write_n<int32_t>(0);
+        auto at = writer.byte_off - sizeof(int32_t);
         if (jump_addrs.contains(label_name)) {
-            write_const(jump_addrs[label_name]);
+            auto rel = static_cast<int32_t>(jump_addrs[label_name] - inst_off);
+            memcpy(reinterpret_cast<uint8_t*>(writer.data.data()) + at, &rel, sizeof(rel));
         }
-        else
-        {
-            writer.write_opcode(Constant64);
-            writer.write_n<uint64_t>(0);
-            auto addr = writer.data.size() - 1;
-            unresolved_jumps[addr] = label_name;
-        }
-        writer.write_opcode(code);
+        else unresolved_jumps[at] = { inst_off, label_name };
     }
 }
@@ -0,0 +1,201 @@
+#include "yoyo_vm/event_loop.h"
+
+#include <condition_variable>
+#include <mutex>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+namespace Yvm
+{
+    struct EventLoop::Inbox
+    {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Task>> submitted;
+        /// calls whose completion completed, only used as keys of @c waiting
+        std::vector<Task*> completed;
+        std::condition_variable wake;
+        /// readable while there's something in the inbox, for the loop sleeping in epoll
+        int event_fd = -1;
+        ~Inbox()
+        {
+#ifdef __linux__
+            if (event_fd >= 0) close(event_fd);
+#endif
+        }
+        void notify()
+        {
+#ifdef __linux__
+            if (event_fd >= 0) {
+                uint64_t one = 1;
+                [[maybe_unused]] auto written = write(event_fd, &one, sizeof(one));
+                return;
+            }
+#endif
+            wake.notify_one();
+        }
+    };
+
+    EventLoop::EventLoop(VM& vm, const Budget& turn, const RunnerConfig& config) : vm(vm), config(config), turn(turn), inbox(std::make_shared<Inbox>())
+    {
+#ifdef __linux__
+        // without them it sleeps on the condition variable like everywhere else
+        inbox->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = inbox->event_fd;
+        if (inbox->event_fd < 0 || epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inbox->event_fd, &event) != 0) {
+            if (inbox->event_fd >= 0) close(inbox->event_fd);
+            if (epoll_fd >= 0) close(epoll_fd);
+            inbox->event_fd = epoll_fd = -1;
+        }
+#endif
+    }
+    EventLoop::~EventLoop()
+    {
+        std::lock_guard lock(inbox->mutex);
+        for (auto& task : ready) task->result.set_value(std::nullopt);
+        for (auto& [_, task] : waiting) task->result.set_value(std::nullopt);
+        for (auto& task : inbox->submitted) task->result.set_value(std::nullopt);
+        // completions of the dropped calls may still complete, they only reach the inbox
+        inbox->submitted.clear();
+        inbox->completed.clear();
+#ifdef __linux__
+        if (epoll_fd >= 0) close(epoll_fd);
+#endif
+    }
+
+    std::future<std::optional<VM::Type>> EventLoop::submit(uint64_t* code, std::vector<VM::Type> args)
+    {
+        auto task = std::make_unique<Task>(Task{ code, std::move(args), {}, std::nullopt });
+        auto result = task->result.get_future();
+        {
+            std::lock_guard lock(inbox->mutex);
+            inbox->submitted.push_back(std::move(task));
+        }
+        inbox->notify();
+        return result;
+    }
+
+    void EventLoop::poll(bool block)
+    {
+#ifdef __linux__
+        if (epoll_fd >= 0) {
+            epoll_event events[64];
+            auto count = epoll_wait(epoll_fd, events, 64, block ? -1 : 0);
+            for (int i = 0; i < count; i++) {
+                auto fd = events[i].data.fd;
+                if (fd == inbox->event_fd) {
+                    uint64_t value;
+                    [[maybe_unused]] auto read_size = read(fd, &value, sizeof(value));
+                }
+                else if (auto it = watched.find(fd); it != watched.end()) {
+                    // a callback may unwatch its own descriptor
+                    auto callback = it->second;
+                    callback(events[i].events);
+                }
+            }
+            block = false;
+        }
+#endif
+        std::unique_lock lock(inbox->mutex);
+        if (block) inbox->wake.wait(lock, [&] { return !inbox->submitted.empty() || !inbox->completed.empty(); });
+        for (auto& task : inbox->submitted) ready.push_back(std::move(task));
+        inbox->submitted.clear();
+        for (auto task : inbox->completed) {
+            auto it = waiting.find(task);
+            ready.push_back(std::move(it->second));
+            waiting.erase(it);
+        }
+        inbox->completed.clear();
+    }
+    void EventLoop::step()
+    {
+        auto task = std::move(ready.front());
+        ready.pop_front();
+        auto& runner = task->runner;
+        RunStatus status;
+        if (runner) status = runner->resume(turn);
+        else {
+            if (free_runners.empty()) runner.emplace(vm.new_runner(config));
+            else {
+                runner.emplace(std::move(free_runners.back()));
+                free_runners.pop_back();
+            }
+            status = runner->start(task->code, task->args.data(), task->args.size(), turn);
+        }
+        switch (status) {
+        case RunStatus::Suspended:
+            ready.push_back(std::move(task));
+            break;
+        case RunStatus::Waiting:
+        {
+            auto key = task.get();
+            auto completion = *runner->awaiting();
+            waiting.emplace(key, std::move(task));
+            completion.on_complete([inbox = inbox, key] {
+                {
+                    std::lock_guard lock(inbox->mutex);
+                    inbox->completed.push_back(key);
+                }
+                inbox->notify();
+            });
+            break;
+        }
+        case RunStatus::Finished:
+            task->result.set_value(runner->result);
+            free_runners.push_back(std::move(*runner));
+            break;
+        case RunStatus::Panicked:
+            // whatever the panic left behind goes with the runner
+            task->result.set_value(std::nullopt);
+            break;
+        }
+    }
+    void EventLoop::run()
+    {
+        while (true) {
+            poll(false);
+            if (ready.empty()) {
+                if (waiting.empty()) return;
+                poll(true);
+                continue;
+            }
+            // a turn of every ready call before looking for new ones
+            for (auto turns = ready.size(); turns > 0; turns--) step();
+        }
+    }
+
+    bool EventLoop::watch(int fd, uint32_t events, std::function<void(uint32_t)> callback)
+    {
+#ifdef __linux__
+        if (epoll_fd < 0 || watched.contains(fd)) return false;
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) return false;
+        watched.emplace(fd, std::move(callback));
+        return true;
+#else
+        (void)fd; (void)events; (void)callback;
+        return false;
+#endif
+    }
+    void EventLoop::unwatch(int fd)
+    {
+#ifdef __linux__
+        if (watched.erase(fd) != 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+#else
+        (void)fd;
+#endif
+    }
+    size_t EventLoop::pending() const
+    {
+        std::lock_guard lock(inbox->mutex);
+        return ready.size() + waiting.size() + inbox->submitted.size();
+    }
+}
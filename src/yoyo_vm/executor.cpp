@@ -0,0 +1,102 @@
+#include "yoyo_vm/executor.h"
+
+#include <algorithm>
+
+namespace Yvm
+{
+    namespace
+    {
+        /// the executor and worker running on this thread, calls it submits stay on it
+        thread_local const Executor* current_executor = nullptr;
+        thread_local size_t current_worker = 0;
+    }
+
+    Executor::Executor(VM& vm, unsigned threads, const RunnerConfig& config) : vm(vm), config(config)
+    {
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < threads; i++) workers.push_back(std::make_unique<Worker>());
+        for (unsigned i = 0; i < threads; i++) this->threads.emplace_back([this, i] { work(i); });
+    }
+    Executor::~Executor()
+    {
+        {
+            std::lock_guard lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads) thread.join();
+    }
+
+    std::future<std::optional<VM::Type>> Executor::submit(uint64_t* code, std::vector<VM::Type> args)
+    {
+        auto nested = current_executor == this;
+        // waiting on a call queued on the worker itself would deadlock once no other worker is free to steal it
+        auto claimed = nested ? std::make_shared<std::atomic<bool>>(false) : nullptr;
+        auto inline_args = nested ? args : std::vector<VM::Type>{};
+        Task task{ code, std::move(args), {}, claimed };
+        auto result = task.result.get_future();
+        auto index = nested ? current_worker : next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+        {
+            auto& worker = *workers[index];
+            std::lock_guard lock(worker.mutex);
+            worker.tasks.push_back(std::move(task));
+            queued.fetch_add(1);
+        }
+        // only a worker going to sleep takes sleep_mutex, it either sees the call or gets woken up
+        if (sleeping.load() != 0) {
+            { std::lock_guard lock(sleep_mutex); }
+            wake.notify_one();
+        }
+        if (!nested) return result;
+        return std::async(std::launch::deferred, [this, code, args = std::move(inline_args), claimed, result = std::move(result)]() mutable {
+            if (claimed->exchange(true)) return result.get();
+            // the calling worker's runner is busy with the call waiting on this one
+            auto runner = vm.new_runner(config);
+            auto value = runner.run_code(code, args.data(), args.size());
+            return runner.in_panic ? std::nullopt : std::optional{ value };
+        });
+    }
+
+    std::optional<Executor::Task> Executor::take(size_t self)
+    {
+        // the own queue runs in order, the others are stolen from at the back, away from their owner
+        for (size_t i = 0; i < workers.size(); i++) {
+            auto& worker = *workers[(self + i) % workers.size()];
+            std::lock_guard lock(worker.mutex);
+            if (worker.tasks.empty()) continue;
+            auto own = i == 0;
+            auto task = std::move(own ? worker.tasks.front() : worker.tasks.back());
+            if (own) worker.tasks.pop_front();
+            else worker.tasks.pop_back();
+            queued.fetch_sub(1);
+            return task;
+        }
+        return std::nullopt;
+    }
+    void Executor::work(size_t self)
+    {
+        current_executor = this;
+        current_worker = self;
+        std::optional<VMRunner> runner;
+        runner.emplace(vm.new_runner(config));
+        while (true) {
+            if (auto task = take(self)) {
+                if (task->claimed && task->claimed->exchange(true)) continue;
+                auto value = runner->run_code(task->code, task->args.data(), task->args.size());
+                if (runner->in_panic) {
+                    task->result.set_value(std::nullopt);
+                    // whatever the panic left behind goes with the runner
+                    runner.reset();
+                    runner.emplace(vm.new_runner(config));
+                }
+                else task->result.set_value(value);
+                continue;
+            }
+            std::unique_lock lock(sleep_mutex);
+            if (stopping) return;
+            sleeping.fetch_add(1);
+            wake.wait(lock, [&] { return queued.load() != 0 || stopping; });
+            sleeping.fetch_sub(1);
+        }
+    }
+}
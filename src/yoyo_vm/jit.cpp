@@ -0,0 +1,863 @@
+#include "yoyo_vm/jit.h"
+#include "yoyo_vm/vm.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <utility>
+
+#if YVM_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace Yvm
+{
+    namespace
+    {
+        // every re-entry of the interpreter costs a run_code and a setjmp frame on the host stack
+        constexpr size_t max_reentries = 1024;
+    }
+    uint64_t JitCompiler::call_helper(JitState* state, void* code, void* args, uint64_t arg_size)
+    {
+        auto& runner = *state->runner;
+        if (++state->reentries > max_reentries) panic_helper(state);
+        auto begin = static_cast<VM::Type*>(args);
+        // tell a panic of the callee apart from one that was already pending
+        auto panicked = std::exchange(runner.in_panic, false);
+        auto val = runner.run_code(static_cast<uint64_t*>(code), begin, arg_size, begin - runner.stack_data());
+        state->reentries--;
+        if (runner.in_panic) panic_helper(state);
+        runner.in_panic = panicked;
+        return val.u64;
+    }
+    void* JitCompiler::alloca_helper(JitState* state, uint64_t size)
+    {
+        auto mem = state->runner->stackalloc(size);
+        if (!mem) panic_helper(state);
+        return mem;
+    }
+    void* JitCompiler::malloc_helper(JitState* state, uint64_t size)
+    {
+        return state->runner->heap_alloc(size);
+    }
+    void JitCompiler::free_helper(JitState* state, void* ptr)
+    {
+        if (!state->runner->heap_free(ptr)) panic_helper(state);
+    }
+    void JitCompiler::grow_stack_helper(JitState* state, uint8_t* needed)
+    {
+        auto& region = state->runner->stack_region;
+        if (needed < region.data() || !region.ensure(needed - region.data())) panic_helper(state);
+        state->stack_limit = region.data() + region.committed_size();
+    }
+    void JitCompiler::panic_helper(JitState* state)
+    {
+        state->runner->in_panic = true;
+        std::longjmp(*state->panic_env, 1);
+    }
+
+#if !YVM_JIT
+    JitCompiler::~JitCompiler() = default;
+    bool JitCompiler::compile(const VM&, const DecodedFunction&)
+    {
+        return false;
+    }
+    const NativeProto* JitCompiler::native_proto(std::span<const Type>, std::optional<Type>)
+    {
+        return nullptr;
+    }
+#else
+    namespace
+    {
+        enum Reg : uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+        /// condition codes of jcc and setcc
+        enum Cond : uint8_t { CB = 0x2, CAE = 0x3, CE = 0x4, CNE = 0x5, CBE = 0x6, CA = 0x7,
+            CP = 0xA, CNP = 0xB, CL = 0xC, CGE = 0xD, CLE = 0xE, CG = 0xF };
+
+        /// Just enough of an x86-64 assembler for the templates below
+        struct X64Writer
+        {
+            std::vector<uint8_t> out;
+            size_t size() const { return out.size(); }
+            void byte(uint8_t b) { out.push_back(b); }
+            void bytes(std::initializer_list<uint8_t> b) { out.insert(out.end(), b); }
+            void u32(uint32_t v) { for (int i = 0; i < 4; i++) byte(static_cast<uint8_t>(v >> i * 8)); }
+            void u64(uint64_t v) { for (int i = 0; i < 8; i++) byte(static_cast<uint8_t>(v >> i * 8)); }
+            void patch32(size_t at, uint32_t v) { for (int i = 0; i < 4; i++) out[at + i] = static_cast<uint8_t>(v >> i * 8); }
+
+            /// REX prefix, left out when it would be empty
+            void rex(bool w, uint8_t reg, uint8_t rm)
+            {
+                uint8_t prefix = 0x40 | (w ? 8 : 0) | (reg >> 3 & 1) << 2 | (rm >> 3 & 1);
+                if (prefix != 0x40) byte(prefix);
+            }
+            /// ModRM (and SIB) of a [base + disp] operand
+            void modrm_mem(uint8_t reg, Reg base, int32_t disp)
+            {
+                bool short_disp = disp >= -128 && disp <= 127;
+                byte((short_disp ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+                if ((base & 7) == RSP) byte(0x24);
+                if (short_disp) byte(static_cast<uint8_t>(disp));
+                else u32(static_cast<uint32_t>(disp));
+            }
+            /// @p reg is either a register or the opcode extension of /digit encodings
+            void op_mem(uint8_t prefix, bool w, std::initializer_list<uint8_t> opcode, uint8_t reg, Reg base, int32_t disp)
+            {
+                if (prefix) byte(prefix);
+                rex(w, reg, base);
+                bytes(opcode);
+                modrm_mem(reg, base, disp);
+            }
+            void op_reg(uint8_t prefix, bool w, std::initializer_list<uint8_t> opcode, uint8_t reg, uint8_t rm)
+            {
+                if (prefix) byte(prefix);
+                rex(w, reg, rm);
+                bytes(opcode);
+                byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+            }
+
+            /// load @p width bits, zero or sign extended to 64
+            void load(Reg dst, Reg base, int32_t disp, int width, bool sign = false)
+            {
+                switch (width)
+                {
+                case 8: op_mem(0, sign, { 0x0F, static_cast<uint8_t>(sign ? 0xBE : 0xB6) }, dst, base, disp); break;
+                case 16: op_mem(0, sign, { 0x0F, static_cast<uint8_t>(sign ? 0xBF : 0xB7) }, dst, base, disp); break;
+                case 32: op_mem(0, sign, { static_cast<uint8_t>(sign ? 0x63 : 0x8B) }, dst, base, disp); break;
+                default: op_mem(0, true, { 0x8B }, dst, base, disp); break;
+                }
+            }
+            /// store the low @p width bits, like writing one member of VM::Type
+            void store(Reg src, Reg base, int32_t disp, int width)
+            {
+                switch (width)
+                {
+                case 8: op_mem(0, false, { 0x88 }, src, base, disp); break;
+                case 16: op_mem(0x66, false, { 0x89 }, src, base, disp); break;
+                case 32: op_mem(0, false, { 0x89 }, src, base, disp); break;
+                default: op_mem(0, true, { 0x89 }, src, base, disp); break;
+                }
+            }
+            void lea(Reg dst, Reg base, int32_t disp) { op_mem(0, true, { 0x8D }, dst, base, disp); }
+            void mov(Reg dst, Reg src) { op_reg(0, true, { 0x89 }, src, dst); }
+            void mov_imm(Reg dst, uint64_t value)
+            {
+                if (value <= UINT32_MAX) { rex(false, 0, dst); byte(0xB8 | (dst & 7)); u32(static_cast<uint32_t>(value)); }
+                else { rex(true, 0, dst); byte(0xB8 | (dst & 7)); u64(value); }
+            }
+            void setcc(Cond cond, Reg dst) { op_reg(0, false, { 0x0F, static_cast<uint8_t>(0x90 | cond) }, 0, dst); }
+            void cmp_byte_zero(Reg base, int32_t disp) { op_mem(0, false, { 0x80 }, 7, base, disp); byte(0); }
+            void push(Reg reg) { rex(false, 0, reg); byte(0x50 | (reg & 7)); }
+            void pop(Reg reg) { rex(false, 0, reg); byte(0x58 | (reg & 7)); }
+            void call(const void* target) { mov_imm(RAX, reinterpret_cast<uint64_t>(target)); bytes({ 0xFF, 0xD0 }); }
+            /// @return where the rel32 to patch is
+            size_t jcc(Cond cond) { bytes({ 0x0F, static_cast<uint8_t>(0x80 | cond) }); u32(0); return size() - 4; }
+            size_t jmp() { byte(0xE9); u32(0); return size() - 4; }
+            /// scalar sse operation, @p width selects the ss or sd form
+            void sse(int width, std::initializer_list<uint8_t> opcode, uint8_t xmm, Reg base, int32_t disp, bool w = false)
+            {
+                op_mem(width == 32 ? 0xF3 : 0xF2, w, opcode, xmm, base, disp);
+            }
+        };
+
+        bool in_range(DecodedOp op, DecodedOp first, DecodedOp last)
+        {
+            return static_cast<uint16_t>(op) >= static_cast<uint16_t>(first) && static_cast<uint16_t>(op) <= static_cast<uint16_t>(last);
+        }
+        int index_in(DecodedOp op, DecodedOp first)
+        {
+            return static_cast<int>(op) - static_cast<int>(first);
+        }
+        constexpr int typed_widths[] = { 8, 16, 32, 64, 8, 16, 32, 64, 32, 64, 64 };
+        constexpr int32_t unreached = INT32_MIN;
+
+        /// Stack effect of the instructions the compiler can translate
+        /// @return false if @p inst has to stay interpreted
+        bool stack_effect(const DecodedInst& inst, int32_t& delta)
+        {
+            using enum DecodedOp;
+            auto op = inst.op;
+            if (in_range(op, Add8, URem64) || in_range(op, FAdd32, FDiv64) || in_range(op, CmpEq8, FCmpLe64)
+                || in_range(op, Shl8, BitXor64) || op == Or || op == And || op == PtrOff || op == Free
+                || op == Pop || op == TopConsume || op == JumpIfFalseDirect || op == Ret)
+                delta = -1;
+            else if (in_range(op, StoreI8, StorePtr) || in_range(op, JumpIfNotCmpEq8, JumpIfNotFCmpLe64)) delta = -2;
+            else if (in_range(op, StoreLocalI8, StoreLocalPtr) || op == BrIfFalse || op == BrIfTrue) delta = -1;
+            else if (in_range(op, LoadLocalI8, LoadLocalPtr)) delta = 1;
+            else if (op == MemCpy) delta = -3;
+            else if (op == Const || op == Dup || op == StackAddr || op == RevStackAddr || op == AllocaConst) delta = 1;
+            else if (op == Call) delta = -inst.arg;
+            else if (op == CallDirect) delta = 1 - inst.arg;
+            else if (op == NativeCall) delta = -inst.arg - 1;
+            else if (op == NativeCallDirect) delta = -inst.arg;
+            // 64 bit unsigned conversions to and from floats have no single instruction
+            else if (in_range(op, FpToUi32To64, FpToUi32To64) || in_range(op, FpToUi64To64, FpToUi64To64)
+                || in_range(op, UiToFp64To32, UiToFp64To64))
+                return false;
+            else if (op == Nop || op == Not || op == Alloca || op == Malloc || op == FNeg32 || op == FNeg64
+                || op == JumpDirect || op == RetVoid || op == Switch || op == PtrOffConst || op == Panic || op == Invalid
+                || in_range(op, LoadI8, LoadPtr) || in_range(op, UConv8To8, SiToFp64To64) || in_range(op, AddImm8, AddImm64))
+                delta = 0;
+            else return false;
+            return true;
+        }
+
+        /// What has to be known about a function before it's translated
+        struct Analysis
+        {
+            /// operand stack depth before each instruction, relative to the arguments' end
+            std::vector<int32_t> depths;
+            int32_t max_depth = 0;
+            bool uses_alloca = false;
+            /// linked functions called through a constant
+            std::vector<const DecodedFunction*> callees;
+        };
+        /// Walk every path of @p fn, the depth of the stack must not depend on the path taken
+        bool analyze(const DecodedFunction& fn, Analysis& out)
+        {
+            using enum DecodedOp;
+            auto& code = fn.code;
+            out.depths.assign(code.size(), unreached);
+            std::vector<uint32_t> worklist{ 0 };
+            out.depths[0] = 0;
+            auto reach = [&](size_t index, int32_t depth) {
+                if (index >= code.size()) return false;
+                if (out.depths[index] == unreached) {
+                    out.depths[index] = depth;
+                    worklist.push_back(static_cast<uint32_t>(index));
+                    return true;
+                }
+                return out.depths[index] == depth;
+                };
+            while (!worklist.empty()) {
+                auto i = worklist.back();
+                worklist.pop_back();
+                auto& inst = code[i];
+                auto depth = out.depths[i];
+                int32_t delta = 0;
+                if (!stack_effect(inst, delta)) return false;
+                out.max_depth = std::max(out.max_depth, depth + std::max(delta, 0));
+                if (inst.op == Alloca || inst.op == AllocaConst) out.uses_alloca = true;
+                if (inst.op == CallDirect)
+                    out.callees.push_back(reinterpret_cast<const FunctionSlot*>(inst.imm)->current.load(std::memory_order_acquire));
+                switch (inst.op)
+                {
+                case Ret: case RetVoid: case Panic: case Invalid: break;
+                case CallDirect: case NativeCallDirect:
+                    // the call it's fused with is skipped
+                    if (!reach(i + 2, depth + delta)) return false;
+                    break;
+                case JumpDirect:
+                    if (inst.target >= code.size()) return false;
+                    if (!reach(inst.target, depth)) return false;
+                    break;
+                case JumpIfFalseDirect:
+                    if (inst.target >= code.size()) return false;
+                    // the fall through skips the jump this was fused with
+                    if (!reach(inst.target, depth + delta) || !reach(i + 2, depth + delta)) return false;
+                    break;
+                default:
+                    if (in_range(inst.op, BrIfFalse, JumpIfNotFCmpLe64)) {
+                        if (!reach(inst.target, depth + delta)) return false;
+                    }
+                    if (!reach(i + 1, depth + delta)) return false;
+                    break;
+                }
+            }
+            return true;
+        }
+
+        /// Runtime entry points compiled code calls into
+        struct Helpers
+        {
+            const void* call;
+            const void* alloca;
+            const void* grow_stack;
+            const void* panic;
+            const void* malloc;
+            const void* free;
+        };
+        /// Writes the machine code of one function.
+        /// rbx holds the frame base, r13 the end of the arguments (every operand slot is addressed from it)
+        /// and r12 the runner's JitState
+        struct CodeGen
+        {
+            const VM& vm;
+            const DecodedFunction& fn;
+            const Analysis& analysis;
+            const Helpers& helpers;
+            X64Writer w{};
+            std::vector<int64_t> labels{};
+            std::vector<std::pair<size_t, uint32_t>> fixups{};
+            std::vector<size_t> panic_fixups{};
+
+            static int32_t slot(int32_t index) { return index * static_cast<int32_t>(sizeof(VM::Type)); }
+            static int32_t field(size_t offset) { return static_cast<int32_t>(offset); }
+
+            void prologue()
+            {
+                w.push(RBX); w.push(R12); w.push(R13);
+                w.mov(RBX, RDI); w.mov(R13, RSI); w.mov(R12, RDX);
+                // ++depth > max_depth panics
+                w.op_mem(0, true, { 0xFF }, 0, R12, field(offsetof(JitState, depth)));
+                w.load(RAX, R12, field(offsetof(JitState, depth)), 64);
+                w.op_mem(0, true, { 0x3B }, RAX, R12, field(offsetof(JitState, max_depth)));
+                panic_fixups.push_back(w.jcc(CA));
+                // commit the operand stack up to the deepest slot
+                w.lea(RAX, R13, slot(analysis.max_depth + 1));
+                w.op_mem(0, true, { 0x3B }, RAX, R12, field(offsetof(JitState, stack_limit)));
+                auto skip = w.jcc(CBE);
+                w.mov(RDI, R12); w.mov(RSI, RAX);
+                w.call(helpers.grow_stack);
+                w.patch32(skip, static_cast<uint32_t>(w.size() - (skip + 4)));
+                if (analysis.uses_alloca) {
+                    // the alloca's of the call are released on return, pushed twice to keep rsp aligned
+                    w.load(RAX, R12, field(offsetof(JitState, alloca_top)), 64);
+                    w.load(RAX, RAX, 0, 64);
+                    w.push(RAX); w.push(RAX);
+                }
+            }
+            void epilogue()
+            {
+                if (analysis.uses_alloca) {
+                    w.pop(RCX); w.pop(RCX);
+                    w.load(RDX, R12, field(offsetof(JitState, alloca_top)), 64);
+                    w.store(RCX, RDX, 0, 64);
+                }
+                w.op_mem(0, true, { 0xFF }, 1, R12, field(offsetof(JitState, depth)));
+                w.pop(R13); w.pop(R12); w.pop(RBX);
+                w.byte(0xC3);
+            }
+            void jump_to(size_t rel, uint32_t target) { fixups.emplace_back(rel, target); }
+            /// An instruction fused with the one after it continues at @p index + 2. The one it was fused with
+            /// is still emitted right after it when a branch reaches it, so it has to be jumped over then
+            void skip_fused(uint32_t index)
+            {
+                if (analysis.depths[index + 1] != unreached) jump_to(w.jmp(), index + 2);
+            }
+
+            /// int operations on zero extended values, the low bits are the same for both signs
+            void int_binary(int32_t depth, int width, bool sign, std::initializer_list<uint8_t> op)
+            {
+                w.load(RAX, R13, slot(depth - 1), width, sign);
+                w.load(RCX, R13, slot(depth - 2), width, sign);
+                w.op_reg(0, true, op, RCX, RAX);
+                w.store(RAX, R13, slot(depth - 2), width);
+            }
+            void int_condition(int32_t depth, int width, bool sign)
+            {
+                w.load(RAX, R13, slot(depth - 1), width, sign);
+                w.load(RCX, R13, slot(depth - 2), width, sign);
+                w.op_reg(0, true, { 0x39 }, RCX, RAX);
+            }
+            void int_compare(int32_t depth, int width, bool sign, Cond cond)
+            {
+                int_condition(depth, width, sign);
+                w.setcc(cond, RAX);
+                w.store(RAX, R13, slot(depth - 2), 8);
+            }
+            /// leaves the result of the comparison in al
+            void fp_condition(int32_t depth, int width, DecodedOp kind)
+            {
+                using enum DecodedOp;
+                uint8_t prefix = width == 64 ? 0x66 : 0;
+                w.sse(width, { 0x0F, 0x10 }, 0, R13, slot(depth - 1));
+                w.sse(width, { 0x0F, 0x10 }, 1, R13, slot(depth - 2));
+                // lhs < rhs is tested as rhs > lhs so unordered operands compare false
+                bool swapped = kind == FCmpLt32 || kind == FCmpLe32;
+                w.op_reg(prefix, false, { 0x0F, 0x2E }, swapped ? 1 : 0, swapped ? 0 : 1);
+                switch (kind)
+                {
+                case FCmpEq32: w.setcc(CE, RAX); w.setcc(CNP, RCX); w.op_reg(0, false, { 0x20 }, RCX, RAX); break;
+                case FCmpNe32: w.setcc(CNE, RAX); w.setcc(CP, RCX); w.op_reg(0, false, { 0x08 }, RCX, RAX); break;
+                case FCmpGt32: case FCmpLt32: w.setcc(CA, RAX); break;
+                default: w.setcc(CAE, RAX); break;
+                }
+            }
+            void fp_compare(int32_t depth, int width, DecodedOp kind)
+            {
+                fp_condition(depth, width, kind);
+                w.store(RAX, R13, slot(depth - 2), 8);
+            }
+            /// Call with @p arg_size arguments starting at @p begin, the result replaces the first one.
+            /// If @p target is null the callee is only known at runtime and its address is in the slot after the arguments
+            void call_function(int32_t begin, const FunctionSlot* target, uint8_t arg_size)
+            {
+                auto end = begin + arg_size;
+                auto callee = target ? target->current.load(std::memory_order_acquire) : nullptr;
+                void* entry = callee ? std::atomic_ref(callee->jit_entry).load(std::memory_order_acquire) : nullptr;
+                auto indirect = [&] {
+                    w.mov(RDI, R12);
+                    if (callee) w.mov_imm(RSI, reinterpret_cast<uint64_t>(callee->source));
+                    else w.load(RSI, R13, slot(end), 64);
+                    w.lea(RDX, R13, slot(begin));
+                    w.mov_imm(RCX, arg_size);
+                    w.call(helpers.call);
+                    };
+                // too few arguments panic in the interpreter
+                if (callee && arg_size < callee->min_args) indirect();
+                else if (callee == &fn || entry) {
+                    // the direct call only holds while the callee isn't reloaded
+                    w.mov_imm(RAX, reinterpret_cast<uint64_t>(target));
+                    w.load(RAX, RAX, 0, 64);
+                    w.mov_imm(RCX, reinterpret_cast<uint64_t>(callee));
+                    w.op_reg(0, true, { 0x3B }, RAX, RCX);
+                    auto replaced = w.jcc(CNE);
+                    w.lea(RDI, R13, slot(begin));
+                    w.lea(RSI, R13, slot(end));
+                    w.mov(RDX, R12);
+                    if (entry) w.call(entry);
+                    else {
+                        w.byte(0xE8); w.u32(0);
+                        w.patch32(w.size() - 4, static_cast<uint32_t>(-static_cast<int64_t>(w.size())));
+                    }
+                    auto done = w.jmp();
+                    w.patch32(replaced, static_cast<uint32_t>(w.size() - (replaced + 4)));
+                    indirect();
+                    w.patch32(done, static_cast<uint32_t>(w.size() - (done + 4)));
+                }
+                else indirect();
+                w.store(RAX, R13, slot(begin), 64);
+            }
+
+            bool instruction(uint32_t index)
+            {
+                using enum DecodedOp;
+                auto& inst = fn.code[index];
+                auto op = inst.op;
+                auto depth = analysis.depths[index];
+                auto top = slot(depth - 1);
+                if (in_range(op, Add8, URem64)) {
+                    auto width = 8 << index_in(op, Add8) % 4;
+                    switch (index_in(op, Add8) / 4)
+                    {
+                    case 0: int_binary(depth, width, false, { 0x01 }); break;
+                    case 1: int_binary(depth, width, false, { 0x29 }); break;
+                    case 2:
+                        w.load(RAX, R13, top, width);
+                        w.load(RCX, R13, slot(depth - 2), width);
+                        w.op_reg(0, true, { 0x0F, 0xAF }, RAX, RCX);
+                        w.store(RAX, R13, slot(depth - 2), width);
+                        break;
+                    default:
+                        {
+                            bool sign = op <= IDiv64 || in_range(op, IRem8, IRem64);
+                            w.load(RAX, R13, top, width, sign);
+                            w.load(RCX, R13, slot(depth - 2), width, sign);
+                            if (sign) { w.bytes({ 0x48, 0x99 }); w.op_reg(0, true, { 0xF7 }, 7, RCX); }
+                            else { w.bytes({ 0x31, 0xD2 }); w.op_reg(0, true, { 0xF7 }, 6, RCX); }
+                            bool remainder = op >= IRem8;
+                            w.store(remainder ? RDX : RAX, R13, slot(depth - 2), width);
+                        }
+                        break;
+                    }
+                }
+                else if (in_range(op, FAdd32, FDiv64)) {
+                    auto width = 32 << index_in(op, FAdd32) % 2;
+                    constexpr uint8_t ops[] = { 0x58, 0x5C, 0x59, 0x5E };
+                    w.sse(width, { 0x0F, 0x10 }, 0, R13, top);
+                    w.sse(width, { 0x0F, ops[index_in(op, FAdd32) / 2] }, 0, R13, slot(depth - 2));
+                    w.sse(width, { 0x0F, 0x11 }, 0, R13, slot(depth - 2));
+                }
+                else if (in_range(op, CmpEq8, ICmpLe64)) {
+                    constexpr Cond conds[] = { CE, CNE, CA, CAE, CB, CBE, CG, CGE, CL, CLE };
+                    auto kind = index_in(op, CmpEq8) / 4;
+                    int_compare(depth, 8 << index_in(op, CmpEq8) % 4, kind >= 6, conds[kind]);
+                }
+                else if (in_range(op, FCmpEq32, FCmpLe64)) {
+                    auto kind = static_cast<DecodedOp>(static_cast<int>(FCmpEq32) + index_in(op, FCmpEq32) / 2 * 2);
+                    fp_compare(depth, 32 << index_in(op, FCmpEq32) % 2, kind);
+                }
+                else if (in_range(op, Shl8, Shr64)) {
+                    auto width = 8 << index_in(op, Shl8) % 4;
+                    // narrow shifts happen on promoted ints in the interpreter
+                    w.load(RAX, R13, top, width);
+                    w.load(RCX, R13, slot(depth - 2), width);
+                    w.op_reg(0, width == 64, { 0xD3 }, op <= Shl64 ? 4 : 5, RAX);
+                    w.store(RAX, R13, slot(depth - 2), width);
+                }
+                else if (in_range(op, BitAnd8, BitXor64)) {
+                    constexpr uint8_t ops[] = { 0x21, 0x09, 0x31 };
+                    int_binary(depth, 8 << index_in(op, BitAnd8) % 4, false, { ops[index_in(op, BitAnd8) / 4] });
+                }
+                else if (in_range(op, LoadI8, LoadPtr)) {
+                    auto width = typed_widths[index_in(op, LoadI8)];
+                    w.load(RAX, R13, top, 64);
+                    w.load(RCX, RAX, 0, width);
+                    w.store(RCX, R13, top, width);
+                }
+                else if (in_range(op, StoreI8, StorePtr)) {
+                    auto width = typed_widths[index_in(op, StoreI8)];
+                    w.load(RAX, R13, top, 64);
+                    w.load(RCX, R13, slot(depth - 2), width);
+                    w.store(RCX, RAX, 0, width);
+                }
+                else if (in_range(op, LoadLocalI8, LoadLocalPtr)) {
+                    auto width = typed_widths[index_in(op, LoadLocalI8)];
+                    w.load(RAX, RBX, slot(inst.arg), 64);
+                    w.load(RCX, RAX, 0, width);
+                    w.store(RCX, R13, slot(depth), width);
+                }
+                else if (in_range(op, StoreLocalI8, StoreLocalPtr)) {
+                    auto width = typed_widths[index_in(op, StoreLocalI8)];
+                    w.load(RAX, RBX, slot(inst.arg), 64);
+                    w.load(RCX, R13, top, width);
+                    w.store(RCX, RAX, 0, width);
+                }
+                else if (in_range(op, AddImm8, AddImm64)) {
+                    auto width = 8 << index_in(op, AddImm8);
+                    w.load(RAX, R13, top, width);
+                    w.op_reg(0, true, { 0x81 }, 0, RAX);
+                    w.u32(static_cast<uint32_t>(inst.imm));
+                    w.store(RAX, R13, top, width);
+                }
+                else if (in_range(op, JumpIfNotCmpEq8, JumpIfNotICmpLe64)) {
+                    constexpr Cond conds[] = { CE, CNE, CA, CAE, CB, CBE, CG, CGE, CL, CLE };
+                    auto kind = index_in(op, JumpIfNotCmpEq8) / 4;
+                    int_condition(depth, 8 << index_in(op, JumpIfNotCmpEq8) % 4, kind >= 6);
+                    // flipping the low bit negates an x86 condition
+                    jump_to(w.jcc(static_cast<Cond>(conds[kind] ^ 1)), inst.target);
+                }
+                else if (in_range(op, JumpIfNotFCmpEq32, JumpIfNotFCmpLe64)) {
+                    auto kind = static_cast<DecodedOp>(static_cast<int>(FCmpEq32) + index_in(op, JumpIfNotFCmpEq32) / 2 * 2);
+                    fp_condition(depth, 32 << index_in(op, JumpIfNotFCmpEq32) % 2, kind);
+                    w.bytes({ 0x84, 0xC0 });
+                    jump_to(w.jcc(CE), inst.target);
+                }
+                else if (in_range(op, UConv8To8, SConv64To64)) {
+                    auto conv = index_in(op, UConv8To8) % 16;
+                    w.load(RAX, R13, top, 8 << conv / 4, op >= SConv8To8);
+                    w.store(RAX, R13, top, 8 << conv % 4);
+                }
+                else if (in_range(op, FpConv32To32, FpConv64To64)) {
+                    if (op == FpConv32To64 || op == FpConv64To32) {
+                        auto from = op == FpConv32To64 ? 32 : 64;
+                        w.sse(from, { 0x0F, 0x5A }, 0, R13, top);
+                        w.sse(96 - from, { 0x0F, 0x11 }, 0, R13, top);
+                    }
+                }
+                else if (in_range(op, FpToSi32To8, FpToUi64To64)) {
+                    auto conv = index_in(op, FpToSi32To8) % 8;
+                    w.sse(32 << conv / 4, { 0x0F, 0x2C }, RAX, R13, top, true);
+                    w.store(RAX, R13, top, 8 << conv % 4);
+                }
+                else if (in_range(op, UiToFp8To32, SiToFp64To64)) {
+                    auto conv = index_in(op, UiToFp8To32) % 8;
+                    auto to = 32 << conv % 2;
+                    w.load(RAX, R13, top, 8 << conv / 2, op >= SiToFp8To32);
+                    w.op_reg(to == 32 ? 0xF3 : 0xF2, true, { 0x0F, 0x2A }, 0, RAX);
+                    w.sse(to, { 0x0F, 0x11 }, 0, R13, top);
+                }
+                else switch (op)
+                {
+                case Nop: case Pop: case FpConv32To32: case FpConv64To64: break;
+                case Const:
+                    if (static_cast<int64_t>(inst.imm) == static_cast<int32_t>(inst.imm)) {
+                        w.op_mem(0, true, { 0xC7 }, 0, R13, slot(depth));
+                        w.u32(static_cast<uint32_t>(inst.imm));
+                    }
+                    else {
+                        w.mov_imm(RAX, inst.imm);
+                        w.store(RAX, R13, slot(depth), 64);
+                    }
+                    break;
+                case StackAddr:
+                    w.load(RAX, RBX, slot(inst.arg), 64);
+                    w.store(RAX, R13, slot(depth), 64);
+                    break;
+                case RevStackAddr:
+                    w.load(RAX, R13, slot(depth - 1 - inst.arg), 64);
+                    w.store(RAX, R13, slot(depth), 64);
+                    break;
+                case Dup:
+                    w.load(RAX, R13, top, 64);
+                    w.store(RAX, R13, slot(depth), 64);
+                    break;
+                case Switch:
+                    w.load(RAX, R13, top, 64);
+                    w.load(RCX, R13, slot(depth - 2), 64);
+                    w.store(RAX, R13, slot(depth - 2), 64);
+                    w.store(RCX, R13, top, 64);
+                    break;
+                case TopConsume:
+                    w.load(RAX, R13, top, 64);
+                    w.store(RAX, R13, slot(depth - 2), 64);
+                    break;
+                case Or:
+                    w.load(RAX, R13, top, 8);
+                    w.op_mem(0, false, { 0x0A }, RAX, R13, slot(depth - 2));
+                    w.setcc(CNE, RAX);
+                    w.store(RAX, R13, slot(depth - 2), 8);
+                    break;
+                case And:
+                    w.cmp_byte_zero(R13, top);
+                    w.setcc(CNE, RAX);
+                    w.cmp_byte_zero(R13, slot(depth - 2));
+                    w.setcc(CNE, RCX);
+                    w.op_reg(0, false, { 0x20 }, RCX, RAX);
+                    w.store(RAX, R13, slot(depth - 2), 8);
+                    break;
+                case Not:
+                    w.cmp_byte_zero(R13, top);
+                    w.setcc(CE, RAX);
+                    w.store(RAX, R13, top, 8);
+                    break;
+                case PtrOff:
+                    w.load(RAX, R13, top, 64);
+                    w.op_mem(0, true, { 0x03 }, RAX, R13, slot(depth - 2));
+                    w.store(RAX, R13, slot(depth - 2), 64);
+                    break;
+                case PtrOffConst:
+                    w.op_mem(0, true, { 0x81 }, 0, R13, top);
+                    w.u32(inst.arg);
+                    break;
+                case FNeg32:
+                    w.op_mem(0, false, { 0x81 }, 6, R13, top);
+                    w.u32(0x80000000u);
+                    break;
+                case FNeg64:
+                    w.op_mem(0, true, { 0x0F, 0xBA }, 7, R13, top);
+                    w.byte(63);
+                    break;
+                case Alloca: case AllocaConst:
+                    w.mov(RDI, R12);
+                    if (op == Alloca) w.load(RSI, R13, top, 32);
+                    else w.mov_imm(RSI, inst.arg);
+                    w.call(helpers.alloca);
+                    w.store(RAX, R13, op == Alloca ? top : slot(depth), 64);
+                    break;
+                case Malloc:
+                    w.mov(RDI, R12);
+                    w.load(RSI, R13, top, 64);
+                    w.call(helpers.malloc);
+                    w.store(RAX, R13, top, 64);
+                    break;
+                case Free:
+                    w.mov(RDI, R12);
+                    w.load(RSI, R13, top, 64);
+                    w.call(helpers.free);
+                    break;
+                case MemCpy:
+                    w.load(RDI, R13, top, 64);
+                    w.load(RSI, R13, slot(depth - 2), 64);
+                    w.load(RDX, R13, slot(depth - 3), 64);
+                    w.call(reinterpret_cast<const void*>(&memcpy));
+                    break;
+                case JumpDirect:
+                    jump_to(w.jmp(), inst.target);
+                    break;
+                case BrIfFalse:
+                    w.cmp_byte_zero(R13, top);
+                    jump_to(w.jcc(CE), inst.target);
+                    break;
+                case BrIfTrue:
+                    w.cmp_byte_zero(R13, top);
+                    jump_to(w.jcc(CNE), inst.target);
+                    break;
+                case JumpIfFalseDirect:
+                    // falls through to index + 2, which is emitted next as the fused jump is never reached
+                    w.cmp_byte_zero(R13, top);
+                    jump_to(w.jcc(CE), inst.target);
+                    break;
+                case Ret:
+                    w.load(RAX, R13, top, 64);
+                    epilogue();
+                    break;
+                case RetVoid:
+                    w.bytes({ 0x31, 0xC0 });
+                    epilogue();
+                    break;
+                case Call:
+                    call_function(depth - 1 - inst.arg, nullptr, inst.arg);
+                    break;
+                case CallDirect:
+                    call_function(depth - inst.arg, reinterpret_cast<const FunctionSlot*>(inst.imm), inst.arg);
+                    skip_fused(index);
+                    break;
+                case NativeCall:
+                    if (vm.native_thunks) {
+                        auto begin = depth - 2 - inst.arg;
+                        w.load(RDI, R13, top, 64);
+                        w.lea(RSI, R13, slot(begin));
+                        // call the proto's thunk
+                        w.load(RAX, R13, slot(depth - 2), 64);
+                        w.op_mem(0, false, { 0xFF }, 2, RAX, 0);
+                        w.store(RAX, R13, slot(begin), 64);
+                    }
+                    else {
+                        auto begin = depth - 2 - inst.arg;
+                        w.load(RDI, R13, top, 64);
+                        w.lea(RSI, R13, slot(begin));
+                        w.mov_imm(RDX, inst.arg);
+                        w.load(RCX, R13, slot(depth - 2), 64);
+                        // read through the vm, the handler can be swapped after compilation
+                        w.mov_imm(RAX, reinterpret_cast<uint64_t>(&vm.do_native_call));
+                        w.op_mem(0, false, { 0xFF }, 2, RAX, 0);
+                        w.store(RAX, R13, slot(begin), 64);
+                    }
+                    break;
+                case NativeCallDirect:
+                    {
+                        auto begin = depth - 1 - inst.arg;
+                        w.lea(RDI, R13, slot(begin));
+                        w.call(reinterpret_cast<const void*>(inst.imm));
+                        w.store(RAX, R13, slot(begin), 64);
+                        skip_fused(index);
+                    }
+                    break;
+                case Panic: case Invalid:
+                    panic_fixups.push_back(w.jmp());
+                    break;
+                default:
+                    return false;
+                }
+                return true;
+            }
+
+            bool generate()
+            {
+                prologue();
+                labels.assign(fn.code.size(), -1);
+                for (uint32_t i = 0; i < fn.code.size(); i++) {
+                    if (analysis.depths[i] == unreached) continue;
+                    labels[i] = static_cast<int64_t>(w.size());
+                    if (!instruction(i)) return false;
+                }
+                auto panic_label = w.size();
+                w.mov(RDI, R12);
+                w.call(helpers.panic);
+                for (auto [at, target] : fixups) {
+                    if (labels[target] < 0) return false;
+                    w.patch32(at, static_cast<uint32_t>(labels[target] - static_cast<int64_t>(at + 4)));
+                }
+                for (auto at : panic_fixups) w.patch32(at, static_cast<uint32_t>(panic_label - (at + 4)));
+                return true;
+            }
+        };
+
+        /// Code of a thunk for the signature of @p args and @p result, see @c NativeProto::thunk.
+        /// The function goes to r10 and the slots to r11, then each argument is loaded into the next free
+        /// register of its class or copied to the stack, narrow integers extended to 64 bits
+        std::vector<uint8_t> thunk_code(std::span<const Type> args, std::optional<Type> result)
+        {
+            constexpr Reg int_regs[] = { RDI, RSI, RDX, RCX, R8, R9 };
+            constexpr int widths[] = { 8, 16, 32, 64, 8, 16, 32, 64, 32, 64, 64 };
+            auto is_float = [](Type type) { return type == Type::f32 || type == Type::f64; };
+            auto is_signed = [](Type type) { return type <= Type::i64; };
+            auto width = [&](Type type) { return widths[static_cast<uint8_t>(type)]; };
+            size_t int_count = 0, float_count = 0, stack_count = 0;
+            for (auto type : args) {
+                if (is_float(type) && float_count < 8) float_count++;
+                else if (!is_float(type) && int_count < 6) int_count++;
+                else stack_count++;
+            }
+            // rsp is 8 off a multiple of 16 on entry and has to be one at the call
+            auto frame = static_cast<uint32_t>((stack_count * 8 + 15) / 16 * 16 + 8);
+
+            X64Writer w;
+            w.mov(R10, RDI);
+            w.mov(R11, RSI);
+            w.op_reg(0, true, { 0x81 }, 5, RSP);
+            w.u32(frame);
+            size_t ints = 0, floats = 0, spilled = 0;
+            for (size_t i = 0; i < args.size(); i++) {
+                auto type = args[i];
+                auto disp = static_cast<int32_t>(i * sizeof(uint64_t));
+                if (is_float(type) && floats < 8) w.sse(width(type), { 0x0F, 0x10 }, static_cast<uint8_t>(floats++), R11, disp);
+                else if (!is_float(type) && ints < 6) w.load(int_regs[ints++], R11, disp, width(type), is_signed(type));
+                else {
+                    w.load(RAX, R11, disp, is_float(type) ? 64 : width(type), is_signed(type));
+                    w.store(RAX, RSP, static_cast<int32_t>(spilled++ * sizeof(uint64_t)), 64);
+                }
+            }
+            // the vector registers used, for variadic functions
+            w.byte(0xB0);
+            w.byte(static_cast<uint8_t>(floats));
+            w.op_reg(0, false, { 0xFF }, 2, R10);
+
+            if (!result) w.bytes({ 0x31, 0xC0 });
+            else if (*result == Type::f32) w.op_reg(0x66, false, { 0x0F, 0x7E }, 0, RAX);
+            else if (*result == Type::f64) w.op_reg(0x66, true, { 0x0F, 0x7E }, 0, RAX);
+            else if (width(*result) == 8) w.op_reg(0, is_signed(*result), { 0x0F, static_cast<uint8_t>(is_signed(*result) ? 0xBE : 0xB6) }, RAX, RAX);
+            else if (width(*result) == 16) w.op_reg(0, is_signed(*result), { 0x0F, static_cast<uint8_t>(is_signed(*result) ? 0xBF : 0xB7) }, RAX, RAX);
+            else if (width(*result) == 32) {
+                if (is_signed(*result)) w.op_reg(0, true, { 0x63 }, RAX, RAX);
+                // mov eax, eax clears the upper half
+                else w.op_reg(0, false, { 0x89 }, RAX, RAX);
+            }
+            w.op_reg(0, true, { 0x81 }, 0, RSP);
+            w.u32(frame);
+            w.byte(0xC3);
+            return w.out;
+        }
+
+        void* map_code(const std::vector<uint8_t>& code, size_t& size)
+        {
+            auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            size = (code.size() + page - 1) / page * page;
+            // never writable and executable at the same time
+            auto mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) return nullptr;
+            memcpy(mem, code.data(), code.size());
+            if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(mem, size);
+                return nullptr;
+            }
+            return mem;
+        }
+    }
+
+    JitCompiler::~JitCompiler()
+    {
+        for (auto& mapping : mappings) munmap(mapping.address, mapping.size);
+    }
+    bool JitCompiler::compile(const VM& vm, const DecodedFunction& fn)
+    {
+        std::lock_guard lock(mutex);
+        return compile_locked(vm, fn);
+    }
+    bool JitCompiler::compile_locked(const VM& vm, const DecodedFunction& fn)
+    {
+        std::atomic_ref published(fn.jit_entry);
+        if (published.load(std::memory_order_acquire)) return true;
+        if (std::ranges::find(in_progress, &fn) != in_progress.end()) return false;
+        Analysis analysis;
+        if (!analyze(fn, analysis)) return false;
+        // compiling the callees first lets the calls to them be direct
+        in_progress.push_back(&fn);
+        for (auto callee : analysis.callees) if (callee != &fn) compile_locked(vm, *callee);
+        in_progress.pop_back();
+
+        const Helpers helpers{
+            reinterpret_cast<const void*>(&call_helper), reinterpret_cast<const void*>(&alloca_helper),
+            reinterpret_cast<const void*>(&grow_stack_helper), reinterpret_cast<const void*>(&panic_helper),
+            reinterpret_cast<const void*>(&malloc_helper), reinterpret_cast<const void*>(&free_helper) };
+        CodeGen gen{ vm, fn, analysis, helpers };
+        if (!gen.generate()) return false;
+        size_t size = 0;
+        auto mem = map_code(gen.w.out, size);
+        if (!mem) return false;
+        mappings.push_back(Mapping{ mem, size });
+        published.store(mem, std::memory_order_release);
+        return true;
+    }
+    const NativeProto* JitCompiler::native_proto(std::span<const Type> args, std::optional<Type> result)
+    {
+        std::lock_guard lock(mutex);
+        for (auto& proto : protos)
+            if (std::ranges::equal(proto.args, args) && proto.result == result) return &proto;
+        if (std::ranges::any_of(args, [](Type type) { return type > Type::ptr; }) || (result && *result > Type::ptr)) return nullptr;
+        size_t size = 0;
+        auto mem = map_code(thunk_code(args, result), size);
+        if (!mem) return nullptr;
+        mappings.push_back(Mapping{ mem, size });
+        return &protos.emplace_back(NativeProto{
+            reinterpret_cast<uint64_t(*)(void*, const void*)>(mem), std::vector(args.begin(), args.end()), result });
+    }
+#endif
+}
@@ -0,0 +1,260 @@
+#include "yoyo_vm/module_file.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "yoyo_vm/decoder.h"
+#include "yoyo_vm/instructions.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Yvm
+{
+    namespace
+    {
+        // "YVMM", a file of the other endianness doesn't match
+        constexpr uint32_t file_magic = 0x4D4D5659;
+        constexpr uint32_t file_version = 1;
+        /// the code starts on a boundary of this, so relocated pages aren't shared with the tables
+        constexpr uint64_t code_alignment = 4096;
+
+        // Layout: header, function table, relocation table, string pool, code
+        struct Header
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t function_count;
+            uint32_t relocation_count;
+            uint64_t pool_offset;
+            uint64_t pool_size;
+            uint64_t code_offset;
+            uint64_t code_size;
+        };
+        struct FunctionEntry
+        {
+            /// in bytes from the start of the code
+            uint64_t code_offset;
+            uint64_t code_words;
+            /// offset in the string pool
+            uint32_t name;
+            uint32_t checkpoint_count;
+            uint32_t has_info;
+            uint32_t reserved;
+        };
+        enum class RelocationKind : uint32_t
+        {
+            /// the address of the function named by @c target, resolved when linking
+            Symbol,
+            /// the address of the string at @c target
+            String,
+        };
+        struct Relocation
+        {
+            uint32_t function;
+            RelocationKind kind;
+            /// index of the patched word in the function's code
+            uint64_t word;
+            /// offset in the string pool
+            uint64_t target;
+        };
+
+        class PoolBuilder
+        {
+            std::unordered_map<std::string, uint32_t> offsets;
+        public:
+            std::string data;
+            uint32_t add(const std::string& str)
+            {
+                auto [it, inserted] = offsets.try_emplace(str, static_cast<uint32_t>(data.size()));
+                if (inserted) data.append(str.c_str(), str.size() + 1);
+                return it->second;
+            }
+        };
+
+        /// whether the whole null terminated string at @p offset lies within the pool
+        bool valid_string(std::span<const char> pool, uint64_t offset)
+        {
+            return offset < pool.size() && std::memchr(pool.data() + offset, 0, pool.size() - offset);
+        }
+
+        struct Mapping
+        {
+            void* data = nullptr;
+            size_t size = 0;
+        };
+        void unmap_file(const Mapping& mapping)
+        {
+#ifdef _WIN32
+            UnmapViewOfFile(mapping.data);
+#else
+            munmap(mapping.data, mapping.size);
+#endif
+        }
+        /// Map the whole file copy on write, so patching the code never touches the file
+        bool map_file(const std::string& path, Mapping& out)
+        {
+#ifdef _WIN32
+            auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE) return false;
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) { CloseHandle(file); return false; }
+            auto section = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+            CloseHandle(file);
+            if (!section) return false;
+            out.data = MapViewOfFile(section, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(section);
+            out.size = static_cast<size_t>(size.QuadPart);
+            return out.data != nullptr;
+#else
+            auto fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            struct stat info;
+            if (fstat(fd, &info) != 0 || info.st_size <= 0) { close(fd); return false; }
+            out.size = static_cast<size_t>(info.st_size);
+            auto mem = mmap(nullptr, out.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (mem == MAP_FAILED) return false;
+            out.data = mem;
+            return true;
+#endif
+        }
+    }
+
+    bool ModuleFile::save(const Module& module, const VM& vm, const std::string& path)
+    {
+        // sorted so the same module always gives the same file
+        std::vector<const std::pair<const std::string, FunctionCode>*> functions;
+        for (auto& function : module.code) functions.push_back(&function);
+        std::ranges::sort(functions, {}, [](auto function) { return std::string_view(function->first); });
+
+        PoolBuilder pool;
+        std::vector<FunctionEntry> entries;
+        std::vector<Relocation> relocations;
+        std::vector<uint64_t> code;
+        for (uint32_t index = 0; index < functions.size(); index++) {
+            auto& [name, fn_code] = *functions[index];
+            auto entry = FunctionEntry{ code.size() * sizeof(uint64_t), fn_code.size(), pool.add(name), 0, 0, 0 };
+            if (auto info = module.function_info.find(name); info != module.function_info.end()) {
+                entry.checkpoint_count = info->second.checkpoint_count;
+                entry.has_info = 1;
+            }
+            entries.push_back(entry);
+            auto base = code.size();
+            code.insert(code.end(), fn_code.begin(), fn_code.end());
+
+            auto decoded = decode(fn_code);
+            auto raw = reinterpret_cast<const uint8_t*>(fn_code.data());
+            for (size_t i = 0; i + 1 < decoded.code.size(); i++) {
+                if (decoded.code[i].op != DecodedOp::Const) continue;
+                auto opcode = static_cast<OpCode>(raw[decoded.offsets[i]]);
+                if (opcode != OpCode::ConstantPtr && opcode != OpCode::Constant64) continue;
+                auto text = reinterpret_cast<const char*>(decoded.code[i].imm);
+                if (!vm.is_registered_string(text)) continue;
+                // the constant is aligned right after the opcode
+                uint64_t word = decoded.offsets[i] / sizeof(uint64_t) + 1;
+                relocations.push_back(Relocation{ index, RelocationKind::String, word, pool.add(text) });
+                code[base + word] = 0;
+            }
+        }
+        for (auto& [addr, name] : module.unresolved_externals) {
+            auto at = reinterpret_cast<const uint64_t*>(addr);
+            auto owner = std::ranges::find_if(functions, [at](auto function) {
+                auto& fn_code = function->second;
+                return at >= fn_code.data() && at < fn_code.data() + fn_code.size();
+                });
+            // a reference outside of the module's code can't be saved
+            if (owner == functions.end()) return false;
+            auto index = static_cast<uint32_t>(owner - functions.begin());
+            uint64_t word = at - (*owner)->second.data();
+            relocations.push_back(Relocation{ index, RelocationKind::Symbol, word, pool.add(name) });
+            code[entries[index].code_offset / sizeof(uint64_t) + word] = 0;
+        }
+        std::ranges::sort(relocations, {}, [](auto& relocation) { return std::pair(relocation.function, relocation.word); });
+
+        uint64_t pool_offset = sizeof(Header) + entries.size() * sizeof(FunctionEntry) + relocations.size() * sizeof(Relocation);
+        Header header{
+            .magic = file_magic, .version = file_version,
+            .function_count = static_cast<uint32_t>(entries.size()), .relocation_count = static_cast<uint32_t>(relocations.size()),
+            .pool_offset = pool_offset, .pool_size = pool.data.size(),
+            .code_offset = (pool_offset + pool.data.size() + code_alignment - 1) / code_alignment * code_alignment,
+            .code_size = code.size() * sizeof(uint64_t) };
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(entries.data()), static_cast<std::streamsize>(entries.size() * sizeof(FunctionEntry)));
+        file.write(reinterpret_cast<const char*>(relocations.data()), static_cast<std::streamsize>(relocations.size() * sizeof(Relocation)));
+        file.write(pool.data.data(), static_cast<std::streamsize>(pool.data.size()));
+        std::string padding(header.code_offset - header.pool_offset - header.pool_size, '\0');
+        file.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+        file.write(reinterpret_cast<const char*>(code.data()), static_cast<std::streamsize>(header.code_size));
+        return static_cast<bool>(file.flush());
+    }
+
+    bool ModuleFile::load(const std::string& path, Module& module, VM& vm)
+    {
+        Mapping mapping;
+        if (!map_file(path, mapping)) return false;
+        auto bytes = static_cast<uint8_t*>(mapping.data);
+        auto fail = [&] { unmap_file(mapping); return false; };
+
+        // everything is checked before the module is touched
+        Header header;
+        if (mapping.size < sizeof(Header)) return fail();
+        std::memcpy(&header, bytes, sizeof(Header));
+        if (header.magic != file_magic || header.version != file_version) return fail();
+        uint64_t tables_end = sizeof(Header) + uint64_t{ header.function_count } * sizeof(FunctionEntry)
+            + uint64_t{ header.relocation_count } * sizeof(Relocation);
+        if (header.pool_offset < tables_end || header.pool_offset > mapping.size || header.pool_size > mapping.size - header.pool_offset)
+            return fail();
+        if (header.code_offset % code_alignment != 0 || header.code_offset < header.pool_offset + header.pool_size
+            || header.code_offset > mapping.size || header.code_size > mapping.size - header.code_offset)
+            return fail();
+        auto entries = std::span(reinterpret_cast<const FunctionEntry*>(bytes + sizeof(Header)), header.function_count);
+        auto relocations = std::span(reinterpret_cast<const Relocation*>(entries.data() + entries.size()), header.relocation_count);
+        auto pool = std::span(reinterpret_cast<const char*>(bytes + header.pool_offset), header.pool_size);
+        auto code = reinterpret_cast<uint64_t*>(bytes + header.code_offset);
+        for (auto& entry : entries) {
+            if (entry.code_offset % sizeof(uint64_t) != 0 || entry.code_offset > header.code_size) return fail();
+            if (entry.code_words > (header.code_size - entry.code_offset) / sizeof(uint64_t)) return fail();
+            if (!valid_string(pool, entry.name)) return fail();
+        }
+        for (auto& relocation : relocations) {
+            if (relocation.function >= entries.size() || relocation.word >= entries[relocation.function].code_words) return fail();
+            if (relocation.kind != RelocationKind::Symbol && relocation.kind != RelocationKind::String) return fail();
+            if (!valid_string(pool, relocation.target)) return fail();
+        }
+
+        std::vector<uint64_t*> function_code;
+        for (auto& entry : entries) {
+            auto name = pool.data() + entry.name;
+            function_code.push_back(code + entry.code_offset / sizeof(uint64_t));
+            module.code.insert_or_assign(name, FunctionCode::view({ function_code.back(), entry.code_words }));
+            if (entry.has_info) module.function_info[name] = FunctionInfo{ .checkpoint_count = entry.checkpoint_count };
+        }
+        for (auto& relocation : relocations) {
+            auto at = function_code[relocation.function] + relocation.word;
+            auto target = pool.data() + relocation.target;
+            if (relocation.kind == RelocationKind::String) {
+                auto ptr = reinterpret_cast<uint64_t>(target);
+                std::memcpy(at, &ptr, sizeof(ptr));
+            }
+            else module.unresolved_externals[reinterpret_cast<void**>(at)] = target;
+        }
+        vm.add_strings(pool);
+        module.storage.emplace_back(mapping.data, [mapping](void*) { unmap_file(mapping); });
+        return true;
+    }
+}
@@ -0,0 +1,78 @@
+#include "yoyo_vm/parallel.h"
+
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Yvm
+{
+    namespace
+    {
+        /// the indices a thread has left, padded so threads don't share a cache line
+        struct alignas(64) WorkRange
+        {
+            std::mutex mutex;
+            size_t begin = 0;
+            size_t end = 0;
+        };
+    }
+    void parallel_for(size_t count, unsigned threads, const std::function<void(size_t)>& body)
+    {
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = static_cast<unsigned>(std::min<size_t>(threads, count));
+        if (threads <= 1) {
+            for (size_t i = 0; i < count; i++) body(i);
+            return;
+        }
+        std::vector<WorkRange> ranges(threads);
+        for (unsigned i = 0; i < threads; i++) {
+            ranges[i].begin = count * i / threads;
+            ranges[i].end = count * (i + 1) / threads;
+        }
+        std::mutex error_mutex;
+        std::exception_ptr error;
+        auto worker = [&](unsigned self) {
+            auto& own = ranges[self];
+            while (true) {
+                size_t index = count;
+                {
+                    std::lock_guard lock(own.mutex);
+                    if (own.begin < own.end) index = own.begin++;
+                }
+                if (index != count) {
+                    try { body(index); }
+                    catch (...) {
+                        std::lock_guard lock(error_mutex);
+                        if (!error) error = std::current_exception();
+                    }
+                    continue;
+                }
+                // out of work, take the back half of the first thread that has some left
+                bool stolen = false;
+                for (unsigned k = 1; k < threads && !stolen; k++) {
+                    auto& victim = ranges[(self + k) % threads];
+                    size_t begin, end;
+                    {
+                        std::lock_guard lock(victim.mutex);
+                        if (victim.begin >= victim.end) continue;
+                        end = victim.end;
+                        begin = victim.begin + (victim.end - victim.begin) / 2;
+                        victim.end = begin;
+                    }
+                    std::lock_guard lock(own.mutex);
+                    own.begin = begin;
+                    own.end = end;
+                    stolen = true;
+                }
+                if (!stolen) return;
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < threads; i++) pool.emplace_back(worker, i);
+        worker(0);
+        for (auto& thread : pool) thread.join();
+        if (error) std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,97 @@
+#include "yoyo_vm/profiler.h"
+
+#include <algorithm>
+#include <format>
+
+#include "yoyo_vm/vm.h"
+
+namespace Yvm
+{
+    namespace
+    {
+        void add(Profile::Counter& to, const Profile::Counter& from)
+        {
+            to.count += from.count;
+            to.cycles += from.cycles;
+        }
+        std::string json_string(std::string_view text)
+        {
+            std::string result = "\"";
+            for (auto c : text) {
+                if (c == '"' || c == '\\') result += '\\';
+                if (static_cast<unsigned char>(c) < 0x20) result += std::format("\\u{:04x}", c);
+                else result += c;
+            }
+            return result + '"';
+        }
+        std::string json_counter(const Profile::Counter& counter)
+        {
+            return std::format("\"count\": {}, \"cycles\": {}", counter.count, counter.cycles);
+        }
+    }
+
+    void Profile::merge(const Profile& other)
+    {
+        operations.resize(std::max(operations.size(), other.operations.size()));
+        for (size_t i = 0; i < other.operations.size(); i++) add(operations[i], other.operations[i]);
+        pairs.resize(std::max(pairs.size(), other.pairs.size()));
+        for (size_t i = 0; i < other.pairs.size(); i++) pairs[i] += other.pairs[i];
+        for (auto& [code, function] : other.functions) {
+            auto& mine = functions[code];
+            // the function was decoded again, only its instruction count is known to match
+            mine.fn = function.fn;
+            mine.instructions.resize(std::max(mine.instructions.size(), function.instructions.size()));
+            for (size_t i = 0; i < function.instructions.size(); i++) add(mine.instructions[i], function.instructions[i]);
+            add(mine.total, function.total);
+        }
+    }
+    void Profile::clear()
+    {
+        operations.clear();
+        pairs.clear();
+        functions.clear();
+    }
+
+    std::string Profile::to_json(const VM& vm) const
+    {
+        std::string out = "{\n  \"operations\": [";
+        std::vector<size_t> order;
+        for (size_t i = 0; i < operations.size(); i++) if (operations[i].count) order.push_back(i);
+        std::ranges::sort(order, std::greater{}, [&](size_t i) { return operations[i].cycles; });
+        for (size_t i = 0; i < order.size(); i++) {
+            out += std::format("{}\n    {{ \"op\": {}, {} }}", i ? "," : "",
+                json_string(operation_name(static_cast<DecodedOp>(order[i]))), json_counter(operations[order[i]]));
+        }
+
+        out += "\n  ],\n  \"pairs\": [";
+        order.clear();
+        for (size_t i = 0; i < pairs.size(); i++) if (pairs[i]) order.push_back(i);
+        std::ranges::sort(order, std::greater{}, [&](size_t i) { return pairs[i]; });
+        for (size_t i = 0; i < order.size(); i++) {
+            out += std::format("{}\n    {{ \"first\": {}, \"second\": {}, \"count\": {} }}", i ? "," : "",
+                json_string(operation_name(static_cast<DecodedOp>(order[i] / decoded_op_count))),
+                json_string(operation_name(static_cast<DecodedOp>(order[i] % decoded_op_count))), pairs[order[i]]);
+        }
+
+        out += "\n  ],\n  \"functions\": [";
+        std::vector<const std::pair<const uint64_t* const, FunctionProfile>*> hot;
+        for (auto& function : functions) hot.push_back(&function);
+        std::ranges::sort(hot, std::greater{}, [](auto function) { return function->second.total.cycles; });
+        for (size_t i = 0; i < hot.size(); i++) {
+            auto& [code, function] = *hot[i];
+            out += std::format("{}\n    {{ \"name\": {}, {}, \"instructions\": [", i ? "," : "",
+                json_string(vm.name_of(const_cast<uint64_t*>(code))), json_counter(function.total));
+            bool first = true;
+            for (size_t index = 0; index < function.instructions.size() && index < function.fn->code.size(); index++) {
+                auto& counter = function.instructions[index];
+                if (!counter.count) continue;
+                out += std::format("{}\n      {{ \"offset\": {}, \"op\": {}, {} }}", first ? "" : ",", function.fn->offsets[index],
+                    json_string(operation_name(function.fn->code[index].op)), json_counter(counter));
+                first = false;
+            }
+            out += "\n    ] }";
+        }
+        out += "\n  ]\n}\n";
+        return out;
+    }
+}
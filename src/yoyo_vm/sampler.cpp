@@ -0,0 +1,151 @@
+#include "yoyo_vm/sampler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "yoyo_vm/vm.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+namespace Yvm
+{
+    namespace
+    {
+        std::atomic<Sampler*> active_sampler{ nullptr };
+        /// signal handlers inside the active sampler, it's only let go once there are none
+        std::atomic<int> handlers_running{ 0 };
+        /// stands for the compiled frames between two interpreted ones
+        constexpr char compiled_frame = 0;
+    }
+
+    Sampler::Sampler(size_t buffer_words) : buffer(new const void* [buffer_words] {}), capacity(buffer_words) {}
+    Sampler::~Sampler()
+    {
+        stop();
+    }
+
+    bool Sampler::start(unsigned hz)
+    {
+#ifdef _WIN32
+        return false;
+#else
+        if (hz == 0) return false;
+        Sampler* expected = nullptr;
+        if (!active_sampler.compare_exchange_strong(expected, this)) return expected == this;
+        struct sigaction action {};
+        action.sa_handler = &Sampler::on_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        auto interval = 1000000 / std::min(hz, 1000000u);
+        itimerval timer{};
+        timer.it_interval.tv_sec = static_cast<time_t>(interval / 1000000);
+        timer.it_interval.tv_usec = static_cast<suseconds_t>(interval % 1000000);
+        timer.it_value = timer.it_interval;
+        if (sigaction(SIGPROF, &action, nullptr) != 0 || setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+            active_sampler.store(nullptr);
+            return false;
+        }
+        return true;
+#endif
+    }
+    void Sampler::stop()
+    {
+#ifndef _WIN32
+        if (active_sampler.load() != this) return;
+        itimerval timer{};
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        active_sampler.store(nullptr);
+        // a signal already delivered may still be recording on another thread
+        while (handlers_running.load() != 0) std::this_thread::yield();
+        // the handler stays installed, a signal still pending would end the process with the default action
+#endif
+    }
+    void Sampler::clear()
+    {
+        std::fill_n(buffer.get(), std::min(used.load(), capacity), nullptr);
+        used.store(0);
+        dropped_samples.store(0);
+        sample_count.store(0);
+    }
+
+    void Sampler::on_signal(int)
+    {
+        auto saved_errno = errno;
+        handlers_running.fetch_add(1);
+        if (auto sampler = active_sampler.load()) sampler->record();
+        handlers_running.fetch_sub(1);
+        errno = saved_errno;
+    }
+    void Sampler::record()
+    {
+        auto runner = VMRunner::thread_runner();
+        // the frames may be half way to a new buffer
+        if (!runner || runner->frames_moving) return;
+        const void* stack[max_depth];
+        size_t depth = 0;
+        auto add = [&](const void* fn) { if (depth < max_depth) stack[depth++] = fn; };
+
+        // each nested run_code, innermost first: the compiled code it's running, its function, then the callers
+        auto fn = runner->running;
+        auto jit_depth = runner->jit_state.depth;
+        auto frames = runner->frames.data();
+        auto frame_count = runner->frames.size();
+        for (auto link = runner->innermost_entry; link; link = link->outer) {
+            if (jit_depth > link->jit_depth) add(&compiled_frame);
+            if (fn) add(fn);
+            for (; frame_count > link->frame_count; frame_count--) add(frames[frame_count - 1].fn);
+            fn = link->caller;
+            jit_depth = link->jit_depth;
+        }
+        if (depth == 0) return;
+
+        sample_count.fetch_add(1, std::memory_order_relaxed);
+        auto at = used.fetch_add(depth + 1, std::memory_order_relaxed);
+        if (at + depth + 1 > capacity) {
+            dropped_samples.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        buffer[at] = reinterpret_cast<const void*>(depth);
+        std::copy_n(stack, depth, &buffer[at + 1]);
+    }
+
+    std::string Sampler::folded(const VM& vm) const
+    {
+        // the recorded pointers are only trusted once they're known to be functions of the vm
+        std::unordered_map<const void*, std::string> names{ { &compiled_frame, "[compiled]" } };
+        {
+            std::shared_lock lock(vm.slots_mutex);
+            for (auto& fn : vm.decoded_functions) {
+                auto name = vm.name_of(const_cast<uint64_t*>(fn.source));
+                // ; separates the frames of a folded stack
+                std::ranges::replace(name, ';', ':');
+                names.emplace(&fn, name.empty() ? "[unnamed]" : name);
+            }
+        }
+        std::map<std::string, uint64_t> stacks;
+        auto end = std::min(used.load(), capacity);
+        for (size_t at = 0; at < end && buffer[at];) {
+            auto depth = reinterpret_cast<size_t>(buffer[at]);
+            std::string line = depth == max_depth ? "[truncated]" : "";
+            for (size_t i = depth; i > 0; i--) {
+                auto it = names.find(buffer[at + i]);
+                if (!line.empty()) line += ';';
+                line += it == names.end() ? "[unknown]" : it->second;
+            }
+            stacks[line]++;
+            at += depth + 1;
+        }
+        std::string out;
+        for (auto& [line, count] : stacks) out += line + ' ' + std::to_string(count) + '\n';
+        return out;
+    }
+}
@@ -0,0 +1,83 @@
+#include "yoyo_vm/stack_region.h"
+
+#include <algorithm>
+#include <new>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace Yvm
+{
+    namespace
+    {
+        size_t page_size()
+        {
+#ifdef _WIN32
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            static const size_t size = info.dwPageSize;
+#else
+            static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+            return size;
+        }
+        size_t round_to_page(size_t size)
+        {
+            auto page = page_size();
+            return (size + page - 1) / page * page;
+        }
+        // commit in steps of at least this much so growing isn't a syscall per call
+        constexpr size_t commit_step = 64 * 1024;
+    }
+    StackRegion::StackRegion(size_t max_size)
+    {
+        reserved = round_to_page(std::max<size_t>(max_size, 1));
+        auto total = reserved + page_size();
+#ifdef _WIN32
+        base = static_cast<uint8_t*>(VirtualAlloc(nullptr, total, MEM_RESERVE, PAGE_NOACCESS));
+        if (!base) throw std::bad_alloc();
+#else
+        auto mem = mmap(nullptr, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED) throw std::bad_alloc();
+        base = static_cast<uint8_t*>(mem);
+#endif
+    }
+    StackRegion::~StackRegion()
+    {
+        if (!base) return;
+#ifdef _WIN32
+        VirtualFree(base, 0, MEM_RELEASE);
+#else
+        munmap(base, reserved + page_size());
+#endif
+    }
+    StackRegion::StackRegion(StackRegion&& other) noexcept
+        : base(std::exchange(other.base, nullptr)),
+          committed(std::exchange(other.committed, 0)),
+          reserved(std::exchange(other.reserved, 0)) {}
+    StackRegion& StackRegion::operator=(StackRegion&& other) noexcept
+    {
+        std::swap(base, other.base);
+        std::swap(committed, other.committed);
+        std::swap(reserved, other.reserved);
+        return *this;
+    }
+    bool StackRegion::grow(size_t size)
+    {
+        if (size > reserved) return false;
+        auto new_committed = std::min(reserved, round_to_page(std::max(size, committed + commit_step)));
+#ifdef _WIN32
+        if (!VirtualAlloc(base + committed, new_committed - committed, MEM_COMMIT, PAGE_READWRITE)) return false;
+#else
+        if (mprotect(base + committed, new_committed - committed, PROT_READ | PROT_WRITE) != 0) return false;
+#endif
+        committed = new_committed;
+        return true;
+    }
+}
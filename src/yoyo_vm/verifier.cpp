@@ -0,0 +1,237 @@
+#include "yoyo_vm/verifier.h"
+
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <format>
+#include <vector>
+
+#include "yoyo_vm/opcode_info.h"
+
+namespace Yvm
+{
+    namespace
+    {
+        bool in_range(DecodedOp op, DecodedOp first, DecodedOp last)
+        {
+            return static_cast<uint16_t>(op) >= static_cast<uint16_t>(first) && static_cast<uint16_t>(op) <= static_cast<uint16_t>(last);
+        }
+        int index_in(DecodedOp op, DecodedOp first)
+        {
+            return static_cast<int>(op) - static_cast<int>(first);
+        }
+        /// a value nothing is known about (an argument, a copied slot), it's trusted to fill the slot
+        constexpr uint8_t any = 64;
+        /// bits of each load/store type, in the order of YVM_TYPED_OPS
+        constexpr uint8_t type_widths[] = { 8, 16, 32, 64, 8, 16, 32, 64, 32, 64, 64 };
+
+        /// The bits an operation reads of the values it pops (topmost first, 0 reads nothing)
+        /// and the bits it writes of the values it pushes
+        struct Widths
+        {
+            std::array<uint8_t, 3> reads{};
+            uint8_t result = any;
+        };
+        Widths widths_of(DecodedOp op)
+        {
+            using enum DecodedOp;
+            auto bits = [](int value) { return static_cast<uint8_t>(value); };
+            auto int_width = [&](DecodedOp first) { return bits(8 << index_in(op, first) % 4); };
+            auto fp_width = [&](DecodedOp first) { return bits(32 << index_in(op, first) % 2); };
+            if (in_range(op, Add8, URem64)) return { { int_width(Add8), int_width(Add8) }, int_width(Add8) };
+            if (in_range(op, Shl8, BitXor64)) return { { int_width(Shl8), int_width(Shl8) }, int_width(Shl8) };
+            if (in_range(op, FAdd32, FDiv64)) return { { fp_width(FAdd32), fp_width(FAdd32) }, fp_width(FAdd32) };
+            if (in_range(op, CmpEq8, ICmpLe64)) return { { int_width(CmpEq8), int_width(CmpEq8) }, 8 };
+            if (in_range(op, FCmpEq32, FCmpLe64)) return { { fp_width(FCmpEq32), fp_width(FCmpEq32) }, 8 };
+            if (in_range(op, JumpIfNotCmpEq8, JumpIfNotICmpLe64)) return { { int_width(JumpIfNotCmpEq8), int_width(JumpIfNotCmpEq8) } };
+            if (in_range(op, JumpIfNotFCmpEq32, JumpIfNotFCmpLe64)) return { { fp_width(JumpIfNotFCmpEq32), fp_width(JumpIfNotFCmpEq32) } };
+            if (in_range(op, AddImm8, AddImm64)) return { { int_width(AddImm8) }, int_width(AddImm8) };
+            if (in_range(op, LoadI8, LoadPtr)) return { { 64 }, type_widths[index_in(op, LoadI8)] };
+            if (in_range(op, StoreI8, StorePtr)) return { { 64, type_widths[index_in(op, StoreI8)] } };
+            if (in_range(op, LoadLocalI8, LoadLocalPtr)) return { {}, type_widths[index_in(op, LoadLocalI8)] };
+            if (in_range(op, StoreLocalI8, StoreLocalPtr)) return { { type_widths[index_in(op, StoreLocalI8)] } };
+            // conversion families are ordered by source then destination width
+            if (in_range(op, UConv8To8, SConv64To64)) {
+                auto index = index_in(op, UConv8To8) % 16;
+                return { { bits(8 << index / 4) }, bits(8 << index % 4) };
+            }
+            if (in_range(op, FpConv32To32, FpConv64To64)) {
+                auto index = index_in(op, FpConv32To32);
+                return { { bits(32 << index / 2) }, bits(32 << index % 2) };
+            }
+            if (in_range(op, FpToSi32To8, FpToUi64To64)) {
+                auto index = index_in(op, FpToSi32To8) % 8;
+                return { { bits(32 << index / 4) }, bits(8 << index % 4) };
+            }
+            if (in_range(op, UiToFp8To32, SiToFp64To64)) {
+                auto index = index_in(op, UiToFp8To32) % 8;
+                return { { bits(8 << index / 2) }, bits(32 << index % 2) };
+            }
+            switch (op)
+            {
+            case Or: case And: return { { 8, 8 }, 8 };
+            case Not: return { { 8 }, 8 };
+            case FNeg32: return { { 32 }, 32 };
+            case FNeg64: return { { 64 }, 64 };
+            case BrIfFalse: case BrIfTrue: case JumpIfFalseDirect: return { { 8 } };
+            case Alloca: return { { 32 } };
+            case MemCpy: return { { 64, 64, 64 } };
+            case PtrOff: return { { 64, 64 } };
+            case Malloc: case Free: case PtrOffConst: case RegObj: case CheckReg: case PopReg: case Call: return { { 64 } };
+            // the function and its prototype, the arguments are passed on as they are
+            case NativeCall: return { { 64, 64 } };
+            default: return {};
+            }
+        }
+
+        constexpr int32_t unset = INT32_MIN;
+        /// What is known of the operand stack before an instruction.
+        /// Positions are relative to the end of the arguments, negative ones are arguments
+        struct State
+        {
+            int32_t depth = 0;
+            /// width of each value the function pushed at a position >= 0, in the order of the stack
+            std::vector<uint8_t> widths;
+            /// position of the slot each checkpoint holds, @c unset if some path didn't set it
+            std::vector<int32_t> checkpoints;
+
+            uint8_t pop()
+            {
+                if (depth-- <= 0) return any;
+                auto width = widths.back();
+                widths.pop_back();
+                return width;
+            }
+            void push(uint8_t width)
+            {
+                if (depth++ >= 0) widths.push_back(width);
+            }
+            uint8_t width_at(int32_t position) const
+            {
+                return position >= 0 && position < depth ? widths[position] : any;
+            }
+        };
+    }
+
+    std::optional<VerifyError> verify(DecodedFunction& fn, const std::unordered_map<uint8_t, StackEffect>& intrinsics)
+    {
+        using enum DecodedOp;
+        auto& code = fn.code;
+        auto raw = reinterpret_cast<const uint8_t*>(fn.source);
+        auto fail = [&](size_t index, std::string message) { return VerifyError{ fn.offsets[index], std::move(message) }; };
+
+        std::vector<std::optional<State>> states(code.size());
+        std::vector<uint32_t> worklist;
+        // merge @p state into the one known for @p index, it's walked (again) if that taught anything new
+        auto reach = [&](size_t from, uint32_t index, const State& state, bool branch) -> std::optional<VerifyError> {
+            // the terminating Invalid, where branches to the middle of an instruction land too
+            if (index + 1 >= code.size())
+                return fail(from, branch ? "the branch target isn't the start of an instruction" : "execution runs past the end of the function");
+            auto& known = states[index];
+            if (!known) {
+                known = state;
+                worklist.push_back(index);
+                return {};
+            }
+            if (known->depth != state.depth)
+                return fail(from, std::format("reaches the instruction at {} with {} values on the stack, another path has {}",
+                    fn.offsets[index], state.depth, known->depth));
+            bool changed = false;
+            for (size_t i = 0; i < known->widths.size(); i++) {
+                if (state.widths[i] >= known->widths[i]) continue;
+                known->widths[i] = state.widths[i];
+                changed = true;
+            }
+            for (size_t i = 0; i < known->checkpoints.size(); i++) {
+                if (known->checkpoints[i] == state.checkpoints[i] || known->checkpoints[i] == unset) continue;
+                known->checkpoints[i] = unset;
+                changed = true;
+            }
+            if (changed) worklist.push_back(index);
+            return {};
+            };
+
+        int32_t min_args = 0;
+        int32_t max_depth = 0;
+        if (auto error = reach(0, 0, State{ 0, {}, std::vector<int32_t>(fn.checkpoint_count, unset) }, false)) return error;
+        while (!worklist.empty()) {
+            auto i = worklist.back();
+            worklist.pop_back();
+            auto& inst = code[i];
+            auto state = *states[i];
+            if (inst.op == Invalid) return fail(i, "invalid instruction");
+
+            auto info = *opcode_info(static_cast<OpCode>(raw[fn.offsets[i]]));
+            auto next = i + 1;
+            if (is_direct_jump(inst.op) && !info.has(Branches)) {
+                // a constant fused with the jump after it, the jump pops the constant
+                auto& jump = *opcode_info(static_cast<OpCode>(raw[fn.offsets[i + 1]]));
+                info = OpInfo{ jump.mnemonic, {}, static_cast<uint8_t>(jump.pops - 1), jump.pushes, static_cast<uint16_t>(jump.effects & ~DynamicTarget) };
+                next = i + 2;
+            }
+            if (info.has(DynamicTarget))
+                return fail(i, std::format("'{}' takes its target from the stack, only constant targets can be verified", info.mnemonic));
+            int32_t pops = info.pops;
+            int32_t pushes = info.pushes;
+            if (info.has(UnknownStack)) {
+                auto effect = intrinsics.find(inst.arg);
+                if (effect == intrinsics.end()) return fail(i, std::format("intrinsic {} has no declared stack effect", inst.arg));
+                pops = effect->second.pops;
+                pushes = effect->second.pushes;
+            }
+            if (info.has(PopsArgs)) pops += inst.arg;
+
+            // what the function reaches below its own values has to be passed as arguments
+            auto reaches = [&](int32_t slots) { min_args = std::max(min_args, slots); };
+            reaches(pops - state.depth);
+            if (inst.op == RevStackAddr) reaches(inst.arg + 1 - state.depth);
+            // a slot picked by its index is read once the popped values are gone
+            else if (info.has(ReadsSlot)) reaches(inst.arg + 1 - (state.depth - pops));
+            if (info.has(UsesCheckpoint) && inst.arg >= fn.checkpoint_count)
+                return fail(i, std::format("checkpoint {} is out of range, the function has {}", inst.arg, fn.checkpoint_count));
+            if (inst.op == Checkpoint) {
+                reaches(1 - state.depth);
+                state.checkpoints[inst.arg] = state.depth - 1;
+            }
+            auto checkpoint_slot = unset;
+            if (inst.op == StackCheckpoint) {
+                checkpoint_slot = state.checkpoints[inst.arg];
+                if (checkpoint_slot == unset) return fail(i, std::format("checkpoint {} isn't set on every path reaching it", inst.arg));
+                if (checkpoint_slot >= state.depth) return fail(i, std::format("the slot of checkpoint {} was popped", inst.arg));
+            }
+            auto copied = inst.op == RevStackAddr ? state.width_at(state.depth - 1 - inst.arg) : state.width_at(checkpoint_slot);
+
+            auto widths = widths_of(inst.op);
+            std::array<uint8_t, 3> popped{};
+            for (int32_t k = 0; k < pops; k++) {
+                auto width = state.pop();
+                if (k >= 3) continue;
+                popped[k] = width;
+                if (width < widths.reads[k])
+                    return fail(i, std::format("'{}' reads a {} bit value as {} bits", info.mnemonic, width, widths.reads[k]));
+            }
+            switch (inst.op)
+            {
+            case Dup: state.push(popped[0]); state.push(popped[0]); break;
+            case Switch: state.push(popped[0]); state.push(popped[1]); break;
+            case TopConsume: state.push(popped[0]); break;
+            // the object stays, the destructor is popped
+            case RegObj: state.push(popped[1]); break;
+            case CheckReg: case PopReg: state.push(popped[0]); state.push(8); break;
+            case RevStackAddr: case StackCheckpoint: state.push(copied); break;
+            default: for (int32_t k = 0; k < pushes; k++) state.push(widths.result); break;
+            }
+            max_depth = std::max(max_depth, state.depth);
+
+            if (is_direct_jump(inst.op)) {
+                if (auto error = reach(i, inst.target, state, true)) return error;
+            }
+            if (!info.has(NoFallthrough)) {
+                if (auto error = reach(i, next, state, false)) return error;
+            }
+        }
+        fn.max_stack = static_cast<uint32_t>(max_depth);
+        fn.min_args = static_cast<uint32_t>(min_args);
+        return {};
+    }
+}
@@ -1,443 +1,989 @@
 #include "yoyo_vm/vm.h"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <cstddef>
 #include <exception>
+#include <iterator>
+#include <mutex>
 #include <cstring>
+#include <utility>
 
 #include "yoyo_vm/instructions.h"
-#define FP_OP(PUSH_TY, OP) switch (static_cast<uint8_t>(*++ip))\
+#include "yoyo_vm/decoder.h"
+#include "yoyo_vm/jit.h"
+#include "yoyo_vm/verifier.h"
+
+#if YVM_PROFILE
+#include <chrono>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+// Dispatch engine for VMRunner::run_code, chosen at build time.
+// With computed goto every handler ends in its own indirect jump through a label table,
+// so the branch predictor gets one history per opcode instead of the single shared
+// jump of the switch. The switch stays as the portable fallback (MSVC has no labels as values).
+#ifndef YVM_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define YVM_COMPUTED_GOTO 1
+#else
+#define YVM_COMPUTED_GOTO 0
+#endif
+#endif
+
+#if YVM_COMPUTED_GOTO
+#define VM_CASE(OP) L_##OP
+#define VM_LABEL(OP) &&L_##OP,
+#define DISPATCH() do { PROFILE_STEP(); BUDGET_STEP(); goto *dispatch_table[static_cast<uint16_t>(ip->op)]; } while (0)
+#else
+#define VM_CASE(OP) case DecodedOp::OP
+#define DISPATCH() continue
+#endif
+
+// every instruction the interpreter is about to run, only seen by a profiling build
+#if YVM_PROFILE
+#define PROFILE_STEP() profile_cursor.step(fn, ip)
+#else
+#define PROFILE_STEP() do {} while (0)
+#endif
+
+// a budgeted interpreter suspends the call before the next instruction once its budget ran out
+#define BUDGET_STEP() do { if constexpr (budgeted) {\
+    if (left == 0 && !refill_budget(budget, slice, left)) {\
+        suspended_call = Cursor{ fn, ip, stack, checkpoint_base, entry_depth };\
+        return VM::Type{ .u64 = 0 };\
+    }\
+    left--;\
+} } while (0)
+
+#define VM_PANIC() do { in_panic = true; return VM::Type{ .u64 = 0 }; } while (0)
+
+// the first value popped is the left hand side
+#define BINARY_OP(NAME, POP, N, RESULT, OP) VM_CASE(NAME):\
+{\
+    auto lhs = stack.POP<N>();\
+    auto rhs = stack.POP<N>();\
+    stack.push(static_cast<RESULT>(lhs OP rhs)); ip++; DISPATCH();\
+}
+#define INT_OP(NAME, POP, OP)\
+    BINARY_OP(NAME##8, POP, 8, decltype(lhs), OP)\
+    BINARY_OP(NAME##16, POP, 16, decltype(lhs), OP)\
+    BINARY_OP(NAME##32, POP, 32, decltype(lhs), OP)\
+    BINARY_OP(NAME##64, POP, 64, decltype(lhs), OP)
+#define INT_CMP(NAME, POP, OP)\
+    BINARY_OP(NAME##8, POP, 8, uint8_t, OP)\
+    BINARY_OP(NAME##16, POP, 16, uint8_t, OP)\
+    BINARY_OP(NAME##32, POP, 32, uint8_t, OP)\
+    BINARY_OP(NAME##64, POP, 64, uint8_t, OP)
+#define FP_OP(NAME, OP)\
+    BINARY_OP(NAME##32, popf, 32, decltype(lhs), OP)\
+    BINARY_OP(NAME##64, popf, 64, decltype(lhs), OP)
+#define FP_CMP(NAME, OP)\
+    BINARY_OP(NAME##32, popf, 32, uint8_t, OP)\
+    BINARY_OP(NAME##64, popf, 64, uint8_t, OP)
+
+#define LOAD_OP(SUFFIX, TYPE) VM_CASE(Load##SUFFIX): stack.push(*stack.pop_ptr<TYPE>()); ip++; DISPATCH();
+#define STORE_OP(SUFFIX, TYPE, POP) VM_CASE(Store##SUFFIX):\
 {\
-case 32: stack.push<PUSH_TY>(stack.popf<32>() OP stack.popf<32>()); break;\
-case 64: stack.push<PUSH_TY>(stack.popf<64>() OP stack.popf<64>()); break;\
-default: break;\
-}\
-ip++; break;
-#define UNSIGNED_OP(PUSH_TY1, PUSH_TY2, PUSH_TY3, PUSH_TY4, OP) switch (static_cast<uint8_t>(*++ip))\
-                    {\
-                        case  8: stack.push<PUSH_TY1>(stack.pop<8>() OP stack.pop<8>()); break;\
-                        case 16: stack.push<PUSH_TY2>(stack.pop<16>() OP stack.pop<16>()); break;\
-                        case 32: stack.push<PUSH_TY3>(stack.pop<32>() OP stack.pop<32>()); break;\
-                        case 64: stack.push<PUSH_TY4>(stack.pop<64>() OP stack.pop<64>()); break;\
-                        default: break;\
-                    }\
-ip++; break;
-//unsigned op same type
-#define UNSIGNED_OP_ST(PUSH_TY, OP) UNSIGNED_OP(PUSH_TY, PUSH_TY, PUSH_TY, PUSH_TY, OP)
-//unsigned op corresponding type
-#define UNSIGNED_OP_CT(OP) UNSIGNED_OP(uint8_t, uint16_t, uint32_t, uint32_t, OP)
-#define SIGNED_OP(PUSH_TY1, PUSH_TY2, PUSH_TY3, PUSH_TY4, OP) switch (static_cast<uint8_t>(*++ip))\
+    auto ptr = stack.pop_ptr<TYPE>();\
+    *ptr = stack.POP; ip++; DISPATCH();\
+}
+
+#define LOAD_LOCAL_OP(SUFFIX, TYPE) VM_CASE(LoadLocal##SUFFIX):\
+    stack.push(*static_cast<TYPE*>(stack.stack[ip->arg].ptr)); ip++; DISPATCH();
+#define STORE_LOCAL_OP(SUFFIX, TYPE, POP) VM_CASE(StoreLocal##SUFFIX):\
+    *static_cast<TYPE*>(stack.stack[ip->arg].ptr) = stack.POP; ip++; DISPATCH();
+#define ADD_IMM(N) VM_CASE(AddImm##N):\
+    stack.push(static_cast<in_t<N>>(stack.pop<N>() + ip->imm)); ip++; DISPATCH();
+#define CMP_JUMP(NAME, POP, N, OP) VM_CASE(JumpIfNot##NAME##N):\
 {\
-case  8: stack.push<PUSH_TY1>(stack.pops<8>() OP stack.pops<8>()); break;\
-case 16: stack.push<PUSH_TY2>(stack.pops<16>() OP stack.pops<16>()); break;\
-case 32: stack.push<PUSH_TY3>(stack.pops<32>() OP stack.pops<32>()); break;\
-case 64: stack.push<PUSH_TY4>(stack.pops<64>() OP stack.pops<64>()); break;\
-default: break;\
-}\
-ip++; break;
-#define SIGNED_OP_ST(PUSH_TY, OP) SIGNED_OP(PUSH_TY, PUSH_TY, PUSH_TY, PUSH_TY, OP)
-#define SIGNED_OP_CT(OP) SIGNED_OP(int8_t, int16_t, int32_t, int32_t, OP)
+    auto lhs = stack.POP<N>();\
+    auto rhs = stack.POP<N>();\
+    ip = lhs OP rhs ? ip + 1 : code + ip->target; DISPATCH();\
+}
+#define INT_CMP_JUMP(NAME, POP, OP)\
+    CMP_JUMP(NAME, POP, 8, OP) CMP_JUMP(NAME, POP, 16, OP) CMP_JUMP(NAME, POP, 32, OP) CMP_JUMP(NAME, POP, 64, OP)
+#define FP_CMP_JUMP(NAME, OP) CMP_JUMP(NAME, popf, 32, OP) CMP_JUMP(NAME, popf, 64, OP)
+
+// enter CALLEE with its ARG_SIZE arguments at the stack top, coming back at RESUME
+#define CALL_FUNCTION(CALLEE, ARG_SIZE, RESUME)\
+{\
+    auto callee_fn = CALLEE;\
+    auto arg_size_new = static_cast<size_t>(ARG_SIZE);\
+    stack.top -= arg_size_new;\
+    auto callee_base = stack.stack + stack.top;\
+    /* compiled frames further up count towards the limit too */\
+    if (frames.size() + jit_state.depth >= max_frames || arg_size_new < callee_fn->min_args) VM_PANIC();\
+    auto needed = callee_base - stack_data() + arg_size_new + callee_fn->max_stack;\
+    if (!stack_region.ensure(needed * sizeof(VM::Type))) VM_PANIC();\
+    /* compiled code can't be suspended */\
+    if (auto entry = budgeted ? nullptr : jit_entry(*callee_fn)) {\
+        VM::Type result;\
+        if (!run_jit(entry, callee_base, arg_size_new, result)) VM_PANIC();\
+        stack.push(result); ip = RESUME; DISPATCH();\
+    }\
+    push_frame(Frame{ fn, RESUME, stack.stack, stack.top, alloca_top, checkpoint_base });\
+    checkpoint_base = checkpoint_top;\
+    reserve_checkpoints(callee_fn->checkpoint_count);\
+    fn = callee_fn;\
+    running = fn;\
+    code = ip = fn->code.data();\
+    stack = Stack{ callee_base, arg_size_new };\
+    DISPATCH();\
+}
+
+#define INT_TO_INT(CONV) CONV(8, 8) CONV(8, 16) CONV(8, 32) CONV(8, 64)\
+    CONV(16, 8) CONV(16, 16) CONV(16, 32) CONV(16, 64)\
+    CONV(32, 8) CONV(32, 16) CONV(32, 32) CONV(32, 64)\
+    CONV(64, 8) CONV(64, 16) CONV(64, 32) CONV(64, 64)
+#define FP_TO_INT(CONV) CONV(32, 8) CONV(32, 16) CONV(32, 32) CONV(32, 64)\
+    CONV(64, 8) CONV(64, 16) CONV(64, 32) CONV(64, 64)
+#define INT_TO_FP(CONV) CONV(8, 32) CONV(8, 64) CONV(16, 32) CONV(16, 64)\
+    CONV(32, 32) CONV(32, 64) CONV(64, 32) CONV(64, 64)
+#define CONV_OP(NAME, FROM, TO, TO_TYPE, POP) VM_CASE(NAME##FROM##To##TO):\
+    stack.push(static_cast<TO_TYPE<TO>>(stack.POP<FROM>())); ip++; DISPATCH();
+#define UCONV(FROM, TO) CONV_OP(UConv, FROM, TO, in_t, pop)
+#define SCONV(FROM, TO) CONV_OP(SConv, FROM, TO, sin_t, pops)
+#define FP_TO_SI(FROM, TO) CONV_OP(FpToSi, FROM, TO, sin_t, popf)
+#define FP_TO_UI(FROM, TO) CONV_OP(FpToUi, FROM, TO, in_t, popf)
+#define UI_TO_FP(FROM, TO) CONV_OP(UiToFp, FROM, TO, fp_t, pop)
+#define SI_TO_FP(FROM, TO) CONV_OP(SiToFp, FROM, TO, fp_t, pops)
 
-#ifndef alloca
-#define alloca(x) stackalloc(x)
-#endif
 namespace Yvm
 {
-    void VM::add_module(Module* module)
+    namespace
+    {
+        /// Take what the last slice used off @p budget and start the next slice, slices end to look at the clock
+        /// @return false if the budget ran out
+        bool refill_budget(Budget& budget, uint64_t& slice, uint64_t& left)
+        {
+            budget.instructions -= slice;
+            if (budget.instructions == 0) return false;
+            if (budget.deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= budget.deadline)
+                return false;
+            slice = left = std::min(budget.instructions, VMRunner::deadline_interval);
+            return true;
+        }
+    }
+#if YVM_PROFILE
+    namespace
     {
+        uint64_t timestamp()
+        {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+#else
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+        }
+        /// Charges each instruction of a run_code call with the time until the next one starts
+        class ProfileCursor
+        {
+            Profile& profile;
+            Profile::FunctionProfile* function = nullptr;
+            const DecodedFunction* fn = nullptr;
+            const DecodedInst* ip = nullptr;
+            uint64_t start = 0;
+
+            void finish(uint64_t now)
+            {
+                if (!ip) return;
+                auto add = [&](Profile::Counter& counter) { counter.count++; counter.cycles += now - start; };
+                add(profile.operations[static_cast<size_t>(ip->op)]);
+                add(function->instructions[ip - fn->code.data()]);
+                add(function->total);
+            }
+        public:
+            explicit ProfileCursor(Profile& profile) : profile(profile)
+            {
+                profile.operations.resize(decoded_op_count);
+                profile.pairs.resize(decoded_op_count * decoded_op_count);
+            }
+            ~ProfileCursor() { finish(timestamp()); }
+            void step(const DecodedFunction* next_fn, const DecodedInst* next_ip)
+            {
+                finish(timestamp());
+                if (ip) profile.pairs[static_cast<size_t>(ip->op) * decoded_op_count + static_cast<size_t>(next_ip->op)]++;
+                if (next_fn != fn) {
+                    fn = next_fn;
+                    function = &profile.functions[fn->source];
+                    function->fn = fn;
+                    function->instructions.resize(std::max(function->instructions.size(), fn->code.size()));
+                }
+                ip = next_ip;
+                // the bookkeeping above isn't charged to the instruction
+                start = timestamp();
+            }
+        };
+    }
+#endif
+    std::vector<std::pair<std::string, VerifyError>> VM::add_module(Module* module)
+    {
+        // a bad module is turned away as a whole here, linking verifies again as the code may change until then
+        std::vector<std::pair<std::string, VerifyError>> failed;
+        for (auto& [name, code] : module->code) {
+            auto info = module->function_info.find(name);
+            auto fn = decode(code, info == module->function_info.end() ? nullptr : &info->second);
+            if (auto error = verify(fn, intrinsic_effects)) failed.emplace_back(name, std::move(*error));
+        }
+        if (!failed.empty()) {
+            std::ranges::sort(failed, {}, [](auto& function) { return std::string_view(function.first); });
+            return failed;
+        }
         registered_modules.push_back(module);
+        index_module(module);
+        return failed;
     }
-    std::vector<std::string> VM::link()
+    void VM::index_module(Module* module)
+    {
+        for (auto& [name, code] : module->code) {
+            symbols.try_emplace(name, code.data());
+            symbol_names[code.data()] = name;
+        }
+        indexed_sizes.push_back(module->code.size());
+    }
+    uint64_t* VM::find_symbol(std::string_view name) const
+    {
+        auto it = symbols.find(name);
+        return it == symbols.end() ? nullptr : it->second;
+    }
+    const NativeProto* VM::native_proto(std::span<const Yvm::Type> args, std::optional<Yvm::Type> result)
+    {
+        return jit.native_proto(args, result);
+    }
+    void* VM::find_external(std::string_view name) const
+    {
+        if (auto sym = find_symbol(name)) return sym;
+        auto it = natives.find(std::string(name));
+        return it == natives.end() ? nullptr : it->second.entry;
+    }
+    void VM::bind_native(std::string name, void* entry, size_t arity)
+    {
+        std::unique_lock lock(slots_mutex);
+        auto it = natives.insert_or_assign(std::move(name), NativeBinding{ entry, arity }).first;
+        native_arities[entry] = arity;
+        symbol_names.try_emplace(entry, it->first);
+    }
+    void VM::resolve_external(Module* module, void** addr, const std::string& name)
+    {
+        if (auto sym = find_external(name)) {
+            *addr = sym;
+            pending_externals.erase(addr);
+        }
+        else pending_externals[addr] = PendingExternal{ module, name };
+    }
+    std::vector<std::pair<Module*, const std::string*>> VM::resolve_pending()
+    {
+        std::vector<std::pair<Module*, const std::string*>> users;
+        for (auto it = pending_externals.begin(); it != pending_externals.end();) {
+            auto sym = find_external(it->second.name);
+            if (!sym) { ++it; continue; }
+            *it->first = sym;
+            auto module = it->second.module;
+            auto addr = reinterpret_cast<const uint64_t*>(it->first);
+            for (auto& [name, code] : module->code) {
+                if (addr < code.data() || addr >= code.data() + code.size()) continue;
+                if (std::ranges::find(users, std::pair{ module, &name }) == users.end()) users.emplace_back(module, &name);
+                break;
+            }
+            it = pending_externals.erase(it);
+        }
+        return users;
+    }
+    void VM::decode_functions(const std::vector<std::pair<Module*, const std::string*>>& functions)
+    {
+        std::vector<std::pair<FunctionSlot*, DecodedFunction*>> decoded;
+        for (auto [module, name] : functions) {
+            auto& code = module->code.at(*name);
+            auto info = module->function_info.find(*name);
+            auto decoded_fn = decode(code, info == module->function_info.end() ? nullptr : &info->second);
+            // what doesn't verify never runs, a reloaded function keeps its previous version
+            if (auto error = verify(decoded_fn, intrinsic_effects)) {
+                rejected_functions.emplace_back(*name, std::move(*error));
+                continue;
+            }
+            auto& fn = decoded_functions.emplace_back(std::move(decoded_fn));
+            auto& slot = function_slots[code.data()];
+            if (!slot) slot = &slots.emplace_back();
+            decoded.emplace_back(slot, &fn);
+        }
+        // the slots of every function in the batch exist before calls are bound to them
+        for (auto [slot, fn] : decoded) bind_calls(*fn);
+        for (auto [slot, fn] : decoded) slot->current.store(fn, std::memory_order_release);
+    }
+    void VM::bind_calls(DecodedFunction& fn) const
+    {
+        // the call a constant is fused with is skipped
+        for (size_t i = 0; i + 1 < fn.code.size(); i++) {
+            auto& inst = fn.code[i];
+            auto& call = fn.code[i + 1];
+            if (inst.op != DecodedOp::Const) continue;
+            if (call.op == DecodedOp::Call) {
+                auto it = function_slots.find(reinterpret_cast<const uint64_t*>(inst.imm));
+                if (it == function_slots.end()) continue;
+                inst.op = DecodedOp::CallDirect;
+                inst.arg = call.arg;
+                inst.imm = reinterpret_cast<uint64_t>(it->second);
+            }
+            else if (call.op == DecodedOp::NativeCall) {
+                auto it = native_arities.find(reinterpret_cast<const void*>(inst.imm));
+                if (it == native_arities.end()) continue;
+                // the trampoline reads exactly its parameters
+                inst.op = it->second == call.arg ? DecodedOp::NativeCallDirect : DecodedOp::Panic;
+                inst.arg = call.arg;
+            }
+        }
+    }
+    std::vector<std::string> VM::unresolved_symbols() const
     {
         std::vector<std::string> result;
-        auto find_symbol = [this](const std::string& name) -> uint64_t* {
-            for (auto mod : registered_modules) {
-                if (mod->code.contains(name)) {
-                    return mod->code.at(name).data();
-                    }
-                }
-            return nullptr;
-            };
-        for (auto module : registered_modules) {
+        for (auto& [addr, pending] : pending_externals) result.push_back(pending.name);
+        return result;
+    }
+    std::vector<std::string> VM::link()
+    {
+        std::unique_lock lock(slots_mutex);
+        rejected_functions.clear();
+        // the index is only rebuilt if a module got new functions after it was added
+        bool stale = false;
+        std::vector<Module*> grown;
+        for (size_t i = 0; i < registered_modules.size(); i++) {
+            if (registered_modules[i]->code.size() == indexed_sizes[i]) continue;
+            stale = true;
+            if (i < linked_modules) grown.push_back(registered_modules[i]);
+        }
+        if (stale) {
+            symbols.clear();
+            indexed_sizes.clear();
+            for (auto module : registered_modules) index_module(module);
+        }
+        std::vector<std::pair<Module*, const std::string*>> functions;
+        for (auto module : grown) {
+            // only the new functions, the rest is already linked
+            auto first = functions.size();
+            for (auto& [name, code] : module->code) {
+                if (!function_slots.contains(code.data())) functions.emplace_back(module, &name);
+            }
             for (auto& [addr, name] : module->unresolved_externals) {
-
-                if (auto sym = find_symbol(name)) {
-                    *addr = sym;
-                }
-                else {
-                    result.push_back(name);
+                auto at = reinterpret_cast<const uint64_t*>(addr);
+                for (auto i = first; i < functions.size(); i++) {
+                    auto& code = module->code.at(*functions[i].second);
+                    if (at < code.data() || at >= code.data() + code.size()) continue;
+                    resolve_external(module, addr, name);
+                    break;
                 }
-
             }
         }
+        for (auto i = linked_modules; i < registered_modules.size(); i++) {
+            auto module = registered_modules[i];
+            for (auto& [addr, name] : module->unresolved_externals) resolve_external(module, addr, name);
+            for (auto& [name, code] : module->code) functions.emplace_back(module, &name);
+        }
+        linked_modules = registered_modules.size();
+        for (auto& user : resolve_pending()) {
+            if (std::ranges::find(functions, user) == functions.end()) functions.push_back(user);
+        }
+        // decoding happens after the function addresses are patched in, as they become constants
+        decode_functions(functions);
+        return unresolved_symbols();
+    }
+    std::vector<std::string> VM::reload(Module* module, Module update)
+    {
+        std::unique_lock lock(slots_mutex);
+        rejected_functions.clear();
+        auto index = std::ranges::find(registered_modules, module) - registered_modules.begin();
+        std::vector<std::pair<Module*, const std::string*>> functions;
+        for (auto& [name, code] : update.code) {
+            auto it = module->code.find(name);
+            if (it != module->code.end()) {
+                auto old = it->second.data();
+                auto old_end = old + it->second.size();
+                auto in_old = [&](void** addr) {
+                    auto at = reinterpret_cast<const uint64_t*>(addr);
+                    return at >= old && at < old_end;
+                    };
+                // the relocations of the old code go away with it
+                std::erase_if(module->unresolved_externals, [&](auto& external) { return in_old(external.first); });
+                std::erase_if(pending_externals, [&](auto& external) { return in_old(external.first); });
+                // moving the code keeps its buffer, so pointers to the old version stay valid
+                retired_code.push_back(std::move(it->second));
+                it->second = std::move(code);
+                if (auto slot = function_slots.find(old); slot != function_slots.end())
+                    function_slots[it->second.data()] = slot->second;
+                if (auto symbol = symbols.find(name); symbol != symbols.end() && symbol->second == old)
+                    symbol->second = it->second.data();
+            }
+            else {
+                it = module->code.emplace(name, std::move(code)).first;
+                symbols.try_emplace(it->first, it->second.data());
+            }
+            symbol_names[it->second.data()] = it->first;
+            if (auto info = update.function_info.find(name); info != update.function_info.end())
+                module->function_info[name] = info->second;
+            else module->function_info.erase(name);
+            functions.emplace_back(module, &it->first);
+        }
+        if (static_cast<size_t>(index) < indexed_sizes.size()) indexed_sizes[index] = module->code.size();
+        // views in the new code point into it
+        std::ranges::move(update.storage, std::back_inserter(module->storage));
+        for (auto& [addr, name] : update.unresolved_externals) {
+            module->unresolved_externals[addr] = name;
+            resolve_external(module, addr, name);
+        }
+        for (auto& user : resolve_pending()) {
+            if (std::ranges::find(functions, user) == functions.end()) functions.push_back(user);
+        }
+        decode_functions(functions);
+        return unresolved_symbols();
+    }
+    const VM::SlotEntry* VM::find_entry(const void* code) const
+    {
+        std::shared_lock lock(slots_mutex);
+        auto it = function_slots.find(static_cast<const uint64_t*>(code));
+        if (it == function_slots.end()) return nullptr;
+        return &*it;
+    }
+    const DecodedFunction* VM::find_function(const void* code) const
+    {
+        auto entry = find_entry(code);
+        return entry ? entry->second->current.load(std::memory_order_acquire) : nullptr;
+    }
+    FunctionCode::FunctionCode(const FunctionCode& other) : owned(other.owned), ptr(other.ptr), count(other.count)
+    {
+        if (!owned.empty()) ptr = owned.data();
+    }
+    FunctionCode::FunctionCode(FunctionCode&& other) noexcept
+        : owned(std::move(other.owned)), ptr(std::exchange(other.ptr, nullptr)), count(std::exchange(other.count, 0)) {}
+    FunctionCode& FunctionCode::operator=(FunctionCode other) noexcept
+    {
+        owned.swap(other.owned);
+        std::swap(ptr, other.ptr);
+        std::swap(count, other.count);
+        return *this;
+    }
+    FunctionCode FunctionCode::view(std::span<uint64_t> code)
+    {
+        FunctionCode result;
+        result.ptr = code.data();
+        result.count = code.size();
         return result;
     }
     std::string VM::name_of(void* ptr) const
     {
-        for (auto mod : registered_modules) {
-            auto it = std::ranges::find_if(mod->code, [ptr](std::pair<const std::string, std::vector<uint64_t>>& data) -> bool {
-                return data.second.data() == ptr;
-                });
-            if (it == mod->code.end()) continue;
-            return it->first;
-        }
-        return "";
+        auto it = symbol_names.find(ptr);
+        if (it == symbol_names.end()) return "";
+        return std::string(it->second);
     }
     const char* VM::add_string(std::string str)
     {
+        std::lock_guard lock(strings_mutex);
         return strings.emplace_back(std::move(str)).data();
     }
+    void VM::add_strings(std::span<const char> pool)
+    {
+        std::lock_guard lock(strings_mutex);
+        string_pools.push_back(pool);
+    }
     bool VM::is_registered_string(const char* text) const
     {
+        std::lock_guard lock(strings_mutex);
+        for (auto pool : string_pools) {
+            if (text >= pool.data() && text < pool.data() + pool.size() && (text == pool.data() || text[-1] == '\0'))
+                return true;
+        }
         return std::ranges::find_if(strings, [text](const auto& str) { return text == str.data(); }) != strings.end();
     }
-    
-    VMRunner VM::new_runner()
+
+    VMRunner VM::new_runner(const RunnerConfig& config)
+    {
+        return VMRunner(*this, config);
+    }
+    VMRunner::VMRunner(const VM& vm, const RunnerConfig& config)
+        : vm(vm),
+          stack_region(config.stack_slots * sizeof(VM::Type)),
+          alloca_region(config.alloca_bytes),
+          reset_heap(config.reset_heap),
+          max_frames(config.max_frames)
+    {
+        if (config.heap_bytes) heap = std::make_unique<Arena>(config.heap_bytes);
+    }
+
+    void VMRunner::grow_frames()
+    {
+        frames_moving = true;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        frames.reserve(std::max<size_t>(16, frames.capacity() * 2));
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        frames_moving = false;
+    }
+    VMRunner*& VMRunner::thread_runner()
+    {
+        thread_local VMRunner* runner = nullptr;
+        return runner;
+    }
+    void VMRunner::reserve_checkpoints(size_t count)
+    {
+        checkpoint_top += count;
+        if (checkpoint_top > checkpoint_slots.size()) checkpoint_slots.resize(checkpoint_top);
+    }
+    void* VMRunner::stackalloc(uint64_t size)
+    {
+        // keep every allocation aligned for any type the vm can load
+        constexpr uint64_t align = alignof(std::max_align_t);
+        auto begin = alloca_top;
+        auto end = begin + (size + align - 1) / align * align;
+        if (end < begin || !alloca_region.ensure(end)) return nullptr;
+        alloca_top = end;
+        return alloca_region.data() + begin;
+    }
+    void* VMRunner::heap_alloc(uint64_t size)
+    {
+        return heap ? heap->allocate(size) : malloc(size);
+    }
+    bool VMRunner::heap_free(void* ptr)
     {
-        return VMRunner(*this);
+        if (!ptr) return true;
+        if (heap && heap->owns(ptr)) {
+            heap->deallocate(ptr);
+            return true;
+        }
+        // what's left of this heap was dropped by a reset
+        if (heap && heap->reserves(ptr)) return false;
+        if (Arena::deallocate_shared(ptr)) return true;
+        // with a heap nothing comes from the system allocator, that memory isn't the runner's to free
+        if (heap) return false;
+        free(ptr);
+        return true;
+    }
+    JitEntry VMRunner::jit_entry(const DecodedFunction& fn)
+    {
+#if YVM_JIT
+        std::atomic_ref entry(fn.jit_entry);
+        if (auto code = entry.load(std::memory_order_acquire)) return reinterpret_cast<JitEntry>(code);
+        if (vm.jit_threshold == 0) return nullptr;
+        // a lost update between threads only delays compilation, so no read-modify-write
+        std::atomic_ref count(fn.call_count);
+        auto calls = count.load(std::memory_order_relaxed) + 1;
+        count.store(calls, std::memory_order_relaxed);
+        if (calls != vm.jit_threshold || !vm.jit.compile(vm, fn)) return nullptr;
+        return reinterpret_cast<JitEntry>(entry.load(std::memory_order_acquire));
+#else
+        return nullptr;
+#endif
+    }
+    bool VMRunner::run_jit(JitEntry entry, VM::Type* base, size_t arg_size, VM::Type& result)
+    {
+        // compiled code can be entered again from a native call, the outer entry's state comes back on the way out
+        const auto saved = jit_state;
+        const auto saved_alloca_top = alloca_top;
+        std::jmp_buf env;
+        jit_state.runner = this;
+        jit_state.stack_limit = stack_region.data() + stack_region.committed_size();
+        jit_state.max_depth = max_frames > frames.size() ? max_frames - frames.size() : 0;
+        jit_state.panic_env = &env;
+        jit_state.alloca_top = &alloca_top;
+        if (setjmp(env)) {
+            jit_state = saved;
+            alloca_top = saved_alloca_top;
+            return false;
+        }
+        result.u64 = entry(base, base + arg_size, &jit_state);
+        jit_state = saved;
+        return true;
     }
     VM::Type VMRunner::run_code(uint64_t* base, const VM::Type* arg_begin, const size_t arg_size, size_t stack_off)
     {
-        Stack stack{ stack_data.data() + stack_off, 0 };
-        stack.top = arg_size;
-        auto ip = reinterpret_cast<OpCode*>(base);
-        std::unordered_map<uint32_t, uint32_t> checkpoints;
-        while (true)
+        auto fn = vm.find_function(base);
+        if (!fn || arg_size < fn->min_args || !stack_region.ensure((stack_off + arg_size + fn->max_stack) * sizeof(VM::Type))) VM_PANIC();
+        // the arguments may already be in place
+        Stack stack{ stack_data() + stack_off, arg_size };
+        if (arg_begin != stack.stack) memcpy(stack.stack, arg_begin, arg_size * sizeof(VM::Type));
+
+        // run_code can be re-entered (from a native call for example), the frames below belong to the outer call.
+        // Everything this call pushed is dropped on every way out of it, panics included
+        struct EntryScope
         {
-            switch (*ip)
-            {
-            using enum OpCode;
-            case Add8: stack.push<uint8_t>(stack.pop<8>() + stack.pop<8>()); ip++; break;
-            case Add16: stack.push<uint16_t>(stack.pop<16>() + stack.pop<16>()); ip++; break;
-            case Add32: stack.push<uint32_t>(stack.pop<32>() + stack.pop<32>()); ip++; break;
-            case Add64: stack.push<uint64_t>(stack.pop<64>() + stack.pop<64>()); ip++; break;
-            case Sub8: stack.push(stack.pop<8>() - stack.pop<8>()); ip++; break;
-            case Sub16: stack.push(stack.pop<16>() - stack.pop<16>()); ip++; break;
-            case Sub32: stack.push(stack.pop<32>() - stack.pop<32>()); ip++; break;
-            case Sub64: stack.push(stack.pop<64>() - stack.pop<64>()); ip++; break;
-            case Mul8: stack.push(stack.pop<8>() * stack.pop<8>()); ip++; break;
-            case Mul16: stack.push(stack.pop<16>() * stack.pop<16>()); ip++; break;
-            case Mul32: stack.push(stack.pop<32>() * stack.pop<32>()); ip++; break;
-            case Mul64: stack.push(stack.pop<64>() * stack.pop<64>()); ip++; break;
-            case IDiv8: stack.push(stack.pops<8>() / stack.pops<8>()); ip++; break;
-            case IDiv16: stack.push(stack.pops<16>() / stack.pops<16>()); ip++; break;
-            case IDiv32: stack.push(stack.pops<32>() / stack.pops<32>()); ip++; break;
-            case IDiv64: stack.push(stack.pops<64>() / stack.pops<64>()); ip++; break;
-            case UDiv8: stack.push(stack.pop<8>() / stack.pop<8>()); ip++; break;
-            case UDiv16: stack.push(stack.pop<16>() / stack.pop<16>()); ip++; break;
-            case UDiv32: stack.push(stack.pop<32>() / stack.pop<32>()); ip++; break;
-            case UDiv64: stack.push(stack.pop<64>() / stack.pop<64>()); ip++; break;
-            case IRem8: stack.push(stack.pops<8>() % stack.pops<8>()); ip++; break;
-            case IRem16: stack.push(stack.pops<16>() % stack.pops<16>()); ip++; break;
-            case IRem32: stack.push(stack.pops<32>() % stack.pops<32>()); ip++; break;
-            case IRem64: stack.push(stack.pops<64>() % stack.pops<64>()); ip++; break;
-            case URem8: stack.push(stack.pop<8>() % stack.pop<8>()); ip++; break;
-            case URem16: stack.push(stack.pop<16>() % stack.pop<16>()); ip++; break;
-            case URem32: stack.push(stack.pop<32>() % stack.pop<32>()); ip++; break;
-            case URem64: stack.push(stack.pop<64>() % stack.pop<64>()); ip++; break;
-            case FAdd32: stack.push(stack.popf<32>() + stack.popf<32>()); ip++; break;
-            case FAdd64: stack.push(stack.popf<64>() + stack.popf<64>()); ip++; break;
-            case FSub32: stack.push(stack.popf<32>() - stack.popf<32>()); ip++; break;
-            case FSub64: stack.push(stack.popf<64>() - stack.popf<64>()); ip++; break;
-            case FMul32: stack.push(stack.popf<32>() * stack.popf<32>()); ip++; break;
-            case FMul64: stack.push(stack.popf<64>() * stack.popf<64>()); ip++; break;
-            case FDiv32: stack.push(stack.popf<32>() / stack.popf<32>()); ip++; break;
-            case FDiv64: stack.push(stack.popf<64>() / stack.popf<64>()); ip++; break;
-            case Ret: return stack.pop_raw();
-            case RetVoid: return VM::Type{ .u64 = 0 };
-            case Or: stack.push<uint8_t>(stack.pop<8>() || stack.pop<8>()); break;
-            case And: stack.push<uint8_t>(stack.pop<8>() && stack.pop<8>()); break;
-            case Not: stack.push<uint8_t>(!stack.pop<8>()); break;
-            case Constant8: stack.push(static_cast<uint8_t>(*++ip)); ip++; break;
-            case Constant16:
-                {
-                    // there may be padding bytes because it must be 2 byte aligned
-                    auto offset =
-                        reinterpret_cast<uint8_t*>(++ip) -
-                        reinterpret_cast<uint8_t*>(base);
-                    ip += (2 - offset % 2) % 2;
-                    stack.push(*reinterpret_cast<uint16_t*>(ip));
-                    ip += 2; break;
-                }
-            case Constant32:
-                {
-                    // there may be padding bytes because it must be 4 byte aligned
-                    auto offset =
-                        reinterpret_cast<uint8_t*>(++ip) -
-                        reinterpret_cast<uint8_t*>(base);
-                    ip += (4 - offset % 4) % 4;
-                    stack.push(*reinterpret_cast<uint32_t*>(ip));
-                    ip += 4; break;
-                }
-            case Nop: ip++; break;
-            case Constant64:
-                {
-                    auto offset =
-                        reinterpret_cast<uint8_t*>(++ip) -
-                        reinterpret_cast<uint8_t*>(base);
-                    ip += (8 - offset % 8) % 8;
-                    stack.push(*reinterpret_cast<uint64_t*>(ip));
-                    ip += 8; break;
-                }
-            case Constant64FromU8: stack.push<uint64_t>(static_cast<uint8_t>(*++ip)); ip++; break;
-            case Constant64FromI8: stack.push<int64_t>(*reinterpret_cast<int8_t*>(++ip)); ip++; break;
-            case Constant64FromI16:
-            {
-                auto offset =
-                    reinterpret_cast<uint8_t*>(++ip) -
-                    reinterpret_cast<uint8_t*>(base);
-                ip += (2 - offset % 2) % 2;
-                stack.push<uint64_t>(*reinterpret_cast<uint16_t*>(ip));
-                ip += 2; break;
-            }
-            case Constant64FromU16:
-            {
-                auto offset =
-                    reinterpret_cast<uint8_t*>(++ip) -
-                    reinterpret_cast<uint8_t*>(base);
-                ip += (2 - offset % 2) % 2;
-                stack.push<int64_t>(*reinterpret_cast<int16_t*>(ip));
-                ip += 2; break;
-            }
-            case Constant64FromU32:
-            {
-                // there may be padding bytes because it must be 4 byte aligned
-                auto offset =
-                    reinterpret_cast<uint8_t*>(++ip) -
-                    reinterpret_cast<uint8_t*>(base);
-                ip += (4 - offset % 4) % 4;
-                stack.push<uint64_t>(*reinterpret_cast<uint32_t*>(ip));
-                ip += 4; break;
-            }
-            case Constant64FromI32:
+            VMRunner& runner;
+            size_t alloca_top, checkpoint_top;
+            VMRunner* thread_runner;
+            EntryLink link;
+            ~EntryScope()
             {
-                // there may be padding bytes because it must be 4 byte aligned
-                auto offset =
-                    reinterpret_cast<uint8_t*>(++ip) -
-                    reinterpret_cast<uint8_t*>(base);
-                ip += (4 - offset % 4) % 4;
-                stack.push<int64_t>(*reinterpret_cast<int32_t*>(ip));
-                ip += 4; break;
+                // the sampler stops looking at the frames before they're dropped
+                runner.innermost_entry = link.outer;
+                runner.running = link.caller;
+                VMRunner::thread_runner() = thread_runner;
+                runner.frames.resize(link.frame_count);
+                runner.alloca_top = alloca_top;
+                runner.checkpoint_top = checkpoint_top;
+                if (!link.outer && runner.reset_heap && runner.heap) runner.heap->reset();
             }
-            case ConstantPtr:
+        } entry{ *this, alloca_top, checkpoint_top, thread_runner(), { innermost_entry, frames.size(), running, jit_state.depth } };
+        running = fn;
+        innermost_entry = &entry.link;
+        thread_runner() = this;
+        const auto entry_depth = frames.size();
+        if (auto jit = jit_entry(*fn)) {
+            VM::Type result;
+            if (!run_jit(jit, stack.stack, arg_size, result)) VM_PANIC();
+            return result;
+        }
+
+        auto checkpoint_base = checkpoint_top;
+        reserve_checkpoints(fn->checkpoint_count);
+        return interpret<false>(Cursor{ fn, fn->code.data(), stack, checkpoint_base, entry_depth }, {});
+    }
+    RunStatus VMRunner::start(uint64_t* base, const VM::Type* arg_begin, size_t arg_size, const Budget& budget)
+    {
+        end_call();
+        // a panic of an earlier call doesn't carry over to this one
+        in_panic = false;
+        registered_objects.clear();
+        auto fn = vm.find_function(base);
+        if (!fn || arg_size < fn->min_args || !stack_region.ensure((arg_size + fn->max_stack) * sizeof(VM::Type))) {
+            in_panic = true;
+            return RunStatus::Panicked;
+        }
+        Stack stack{ stack_data(), arg_size };
+        if (arg_begin != stack.stack) memcpy(stack.stack, arg_begin, arg_size * sizeof(VM::Type));
+        auto checkpoint_base = checkpoint_top;
+        reserve_checkpoints(fn->checkpoint_count);
+        suspended_call = Cursor{ fn, fn->code.data(), stack, checkpoint_base, 0 };
+        return resume(budget);
+    }
+    RunStatus VMRunner::resume(const Budget& budget)
+    {
+        if (!suspended_call) return RunStatus::Finished;
+        if (awaited) {
+            auto value = awaited->value();
+            if (!value) return RunStatus::Waiting;
+            // the deferred native call returns now
+            suspended_call->stack.push(*value);
+            awaited.reset();
+        }
+        if (budget.instructions == 0) return RunStatus::Suspended;
+        auto cursor = *suspended_call;
+        suspended_call.reset();
+        // what the sampler sees, the frames of the call stay for the next resume
+        struct EntryScope
+        {
+            VMRunner& runner;
+            VMRunner* thread_runner;
+            EntryLink link;
+            ~EntryScope()
             {
-                constexpr auto ptr_size = sizeof(void*);
-                auto offset =
-                    reinterpret_cast<uint8_t*>(++ip) -
-                    reinterpret_cast<uint8_t*>(base);
-                ip += (ptr_size - offset % ptr_size) % ptr_size;
-                stack.push(*reinterpret_cast<void**>(ip));
-                ip += ptr_size; break;
+                runner.innermost_entry = link.outer;
+                runner.running = link.caller;
+                VMRunner::thread_runner() = thread_runner;
             }
-            case ConstantF32:
-            {
-                auto offset =
-                    reinterpret_cast<uint8_t*>(++ip) -
-                    reinterpret_cast<uint8_t*>(base);
-                ip += (4 - offset % 4) % 4;
-                stack.push(*reinterpret_cast<float*>(ip));
-                ip += 4; break;
+        } entry{ *this, thread_runner(), { innermost_entry, 0, running, jit_state.depth } };
+        running = cursor.fn;
+        innermost_entry = &entry.link;
+        thread_runner() = this;
+
+        auto value = interpret<true>(cursor, budget);
+        if (suspended_call) return awaited ? RunStatus::Waiting : RunStatus::Suspended;
+        end_call();
+        if (in_panic) return RunStatus::Panicked;
+        result = value;
+        return RunStatus::Finished;
+    }
+    void VMRunner::end_call()
+    {
+        suspended_call.reset();
+        awaited.reset();
+        frames.clear();
+        alloca_top = 0;
+        checkpoint_top = 0;
+        if (reset_heap && heap) heap->reset();
+    }
+    std::optional<Completion> VMRunner::defer_native_call()
+    {
+        auto runner = thread_runner();
+        if (!runner || !runner->deferrable_entry || runner->deferrable_entry != runner->innermost_entry || runner->awaited)
+            return std::nullopt;
+        return runner->awaited.emplace();
+    }
+
+    bool Completion::complete(VM::Type value)
+    {
+        std::function<void()> callback;
+        {
+            std::lock_guard lock(state->mutex);
+            if (state->done) return false;
+            state->done = true;
+            state->value = value;
+            callback = std::move(state->callback);
+        }
+        if (callback) callback();
+        return true;
+    }
+    bool Completion::completed() const
+    {
+        std::lock_guard lock(state->mutex);
+        return state->done;
+    }
+    std::optional<VM::Type> Completion::value() const
+    {
+        std::lock_guard lock(state->mutex);
+        if (!state->done) return std::nullopt;
+        return state->value;
+    }
+    void Completion::on_complete(std::function<void()> callback)
+    {
+        {
+            std::lock_guard lock(state->mutex);
+            if (!state->done) {
+                state->callback = std::move(callback);
+                return;
             }
-            case ConstantF64:
+        }
+        callback();
+    }
+
+#if YVM_COMPUTED_GOTO
+    // labels as values are a GNU extension, the dispatch below is the only place they're used
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+    template<bool budgeted>
+    VM::Type VMRunner::interpret(const Cursor& cursor, [[maybe_unused]] Budget budget)
+    {
+        auto fn = cursor.fn;
+        auto code = fn->code.data();
+        auto ip = cursor.ip;
+        auto stack = cursor.stack;
+        auto checkpoint_base = cursor.checkpoint_base;
+        const auto entry_depth = cursor.entry_depth;
+        // instructions left until the budget is looked at again, and how many the current slice had
+        [[maybe_unused]] uint64_t slice = 0, left = 0;
+        if constexpr (budgeted) slice = left = std::min(budget.instructions, deadline_interval);
+#if YVM_PROFILE
+        ProfileCursor profile_cursor(profile);
+#endif
+#if YVM_COMPUTED_GOTO
+        static void* const dispatch_table[] = { YVM_DECODED_OPS(VM_LABEL) };
+        DISPATCH();
+        {
+#else
+        while (true)
+        {
+            PROFILE_STEP();
+            BUDGET_STEP();
+            switch (ip->op)
             {
-                auto offset =
-                    reinterpret_cast<uint8_t*>(++ip) -
-                    reinterpret_cast<uint8_t*>(base);
-                ip += (8 - offset % 8) % 8;
-                stack.push(*reinterpret_cast<double*>(ip));
-                ip += 8; break;
-            }
-            case StackAddr: stack.push(stack.stack[static_cast<uint8_t>(*++ip)]); ip++; break;
-            case RevStackAddr: stack.push(stack.stack[stack.top - 1 - static_cast<uint8_t>(*++ip)]); ip++; break;
-            case StackCheckpoint: stack.push(stack.stack[checkpoints[static_cast<uint8_t>(*++ip)]]); ip++; break;
-            case TopConsume: stack.stack[stack.top - 2] = stack.stack[stack.top - 1]; stack.top--; ip++; break;
-            case Call:
+#endif
+            INT_OP(Add, pop, +)
+            INT_OP(Sub, pop, -)
+            INT_OP(Mul, pop, *)
+            INT_OP(IDiv, pops, /)
+            INT_OP(UDiv, pop, /)
+            INT_OP(IRem, pops, %)
+            INT_OP(URem, pop, %)
+            FP_OP(FAdd, +)
+            FP_OP(FSub, -)
+            FP_OP(FMul, *)
+            FP_OP(FDiv, /)
+            VM_CASE(Ret):
+            VM_CASE(RetVoid):
                 {
-                    auto code = stack.pop_ptr<uint64_t>();
-                    auto arg_size_new = static_cast<size_t>(*++ip);
-                    auto arg_begin_new = stack.stack + stack.top - arg_size_new;
-                    auto new_top = stack.top - arg_size_new;
-                    auto val = run_code(code, arg_begin_new, arg_size_new, stack_off + stack.top - arg_size_new);
-                    if (in_panic) return VM::Type{ .u64 = 0 };
-                    stack.top = new_top;
+                    auto val = ip->op == DecodedOp::Ret ? stack.pop_raw() : VM::Type{ .u64 = 0 };
+                    if (frames.size() == entry_depth) return val;
+                    auto& caller = frames.back();
+                    fn = caller.fn;
+                    running = fn;
+                    code = fn->code.data();
+                    ip = caller.ip;
+                    stack = Stack{ caller.base, caller.top };
+                    alloca_top = caller.alloca_top;
+                    checkpoint_top = checkpoint_base;
+                    checkpoint_base = caller.checkpoint_base;
+                    frames.pop_back();
                     stack.push(val);
-                    ip++;
-                    break;
+                    DISPATCH();
                 }
-            case Jump:  ip = reinterpret_cast<OpCode*>(base) + stack.pop<64>(); break;
-            case CmpEq: { UNSIGNED_OP_ST(uint8_t, ==) }
-            case CmpNe: { UNSIGNED_OP_ST(uint8_t, !=) }
-            case UCmpGt: { UNSIGNED_OP_ST(uint8_t, >) }
-            case UCmpGe: { UNSIGNED_OP_ST(uint8_t, >=) }
-            case UCmpLt: { UNSIGNED_OP_ST(uint8_t, <) }
-            case UCmpLe: { UNSIGNED_OP_ST(uint8_t, <=) }
-            case ICmpGt: { SIGNED_OP_ST(uint8_t, >) }
-            case ICmpGe: { SIGNED_OP_ST(uint8_t, >=) }
-            case ICmpLt: { SIGNED_OP_ST(uint8_t, <) }
-            case ICmpLe: { SIGNED_OP_ST(uint8_t, <=) }
-            case Shl: { UNSIGNED_OP_CT(<<) }
-            case Shr: { UNSIGNED_OP_CT(>>) }
-            case BitAnd: { UNSIGNED_OP_CT(&) }
-            case BitOr: { UNSIGNED_OP_CT(|) }
-            case BitXor: { UNSIGNED_OP_CT(^) }
-            case Alloca: stack.push(alloca(stack.pop<32>())); ip++; break;
-            case AllocaConst: stack.push(alloca(static_cast<uint8_t>(*++ip))); ip++; break;
-            case Load:
+            BINARY_OP(Or, pop, 8, uint8_t, ||)
+            BINARY_OP(And, pop, 8, uint8_t, &&)
+            VM_CASE(Not): stack.push<uint8_t>(!stack.pop<8>()); ip++; DISPATCH();
+            VM_CASE(Const): stack.stack[stack.top++].u64 = ip->imm; ip++; DISPATCH();
+            VM_CASE(Nop): ip++; DISPATCH();
+            VM_CASE(StackAddr): stack.push(stack.stack[ip->arg]); ip++; DISPATCH();
+            VM_CASE(RevStackAddr): stack.push(stack.stack[stack.top - 1 - ip->arg]); ip++; DISPATCH();
+            VM_CASE(StackCheckpoint): stack.push(stack.stack[checkpoint_slots[checkpoint_base + ip->arg]]); ip++; DISPATCH();
+            VM_CASE(TopConsume): stack.stack[stack.top - 2] = stack.stack[stack.top - 1]; stack.top--; ip++; DISPATCH();
+            VM_CASE(Call):
                 {
-                    auto ptr = stack.pop_ptr<void>();
-                    switch (static_cast<uint8_t>(*++ip))
-                    {
-                    case 0: stack.push(*static_cast<int8_t*>(ptr)); break;
-                    case 1: stack.push(*static_cast<int16_t*>(ptr)); break;
-                    case 2: stack.push(*static_cast<int32_t*>(ptr)); break;
-                    case 3: stack.push(*static_cast<int64_t*>(ptr)); break;
-                    case 4: stack.push(*static_cast<uint8_t*>(ptr)); break;
-                    case 5: stack.push(*static_cast<uint16_t*>(ptr)); break;
-                    case 6: stack.push(*static_cast<uint32_t*>(ptr)); break;
-                    case 7: stack.push(*static_cast<uint64_t*>(ptr)); break;
-                    case 8: stack.push(*static_cast<float*>(ptr)); break;
-                    case 9: stack.push(*static_cast<double*>(ptr)); break;
-                    case 10: stack.push(*static_cast<void**>(ptr)); break;
+                    auto target = stack.pop_ptr<const uint64_t>();
+                    // inline cache, call sites mostly see the same function every time
+                    std::atomic_ref cached(fn->call_cache[ip->target]);
+                    auto entry = static_cast<const VM::SlotEntry*>(cached.load(std::memory_order_relaxed));
+                    if (!entry || entry->first != target) {
+                        entry = vm.find_entry(target);
+                        if (!entry) VM_PANIC();
+                        cached.store(entry, std::memory_order_relaxed);
                     }
-                    ip++; break;
+                    CALL_FUNCTION(entry->second->current.load(std::memory_order_acquire), ip->arg, ip + 1);
                 }
-            case Store:
+            VM_CASE(CallDirect):
+                CALL_FUNCTION(reinterpret_cast<const FunctionSlot*>(ip->imm)->current.load(std::memory_order_acquire), ip->arg, ip + 2);
+            VM_CASE(Jump): ip = code + fn->index_of(stack.pop<64>()); DISPATCH();
+            VM_CASE(JumpDirect): ip = code + ip->target; DISPATCH();
+            INT_CMP(CmpEq, pop, ==)
+            INT_CMP(CmpNe, pop, !=)
+            INT_CMP(UCmpGt, pop, >)
+            INT_CMP(UCmpGe, pop, >=)
+            INT_CMP(UCmpLt, pop, <)
+            INT_CMP(UCmpLe, pop, <=)
+            INT_CMP(ICmpGt, pops, >)
+            INT_CMP(ICmpGe, pops, >=)
+            INT_CMP(ICmpLt, pops, <)
+            INT_CMP(ICmpLe, pops, <=)
+            INT_OP(Shl, pop, <<)
+            INT_OP(Shr, pop, >>)
+            INT_OP(BitAnd, pop, &)
+            INT_OP(BitOr, pop, |)
+            INT_OP(BitXor, pop, ^)
+            VM_CASE(Alloca):
                 {
-                    auto ptr = stack.pop_ptr<void>();
-                    switch (static_cast<uint8_t>(*++ip))
-                    {
-                    case 0: *static_cast<int8_t*>(ptr) = stack.pops<8>(); break;
-                    case 1: *static_cast<int16_t*>(ptr) = stack.pops<16>(); break;
-                    case 2: *static_cast<int32_t*>(ptr) = stack.pops<32>(); break;
-                    case 3: *static_cast<int64_t*>(ptr) = stack.pops<64>(); break;
-                    case 4: *static_cast<uint8_t*>(ptr) = stack.pop<8>(); break;
-                    case 5: *static_cast<uint16_t*>(ptr) = stack.pop<16>(); break;
-                    case 6: *static_cast<uint32_t*>(ptr) = stack.pop<32>(); break;
-                    case 7: *static_cast<uint64_t*>(ptr) = stack.pop<64>(); break;
-                    case 8: *static_cast<float*>(ptr) = stack.popf<32>(); break;
-                    case 9: *static_cast<double*>(ptr) = stack.popf<64>(); break;
-                    case 10: *static_cast<void**>(ptr) = stack.pop_ptr<void>(); break;
-                    }
-                    ip++; break;
+                    auto mem = stackalloc(stack.pop<32>());
+                    if (!mem) VM_PANIC();
+                    stack.push(mem); ip++; DISPATCH();
                 }
-            case PtrOff: stack.push(stack.pop_ptr<uint8_t>() + stack.pop<64>()); ip++; break;
-            case FNeg32: stack.push(-stack.popf<32>()); ip++; break;
-            case FNeg64: stack.push(-stack.popf<64>()); ip++; break;
-            case Panic: {
+            VM_CASE(AllocaConst):
+                {
+                    auto mem = stackalloc(ip->arg);
+                    if (!mem) VM_PANIC();
+                    stack.push(mem); ip++; DISPATCH();
+                }
+            LOAD_OP(I8, int8_t)
+            LOAD_OP(I16, int16_t)
+            LOAD_OP(I32, int32_t)
+            LOAD_OP(I64, int64_t)
+            LOAD_OP(U8, uint8_t)
+            LOAD_OP(U16, uint16_t)
+            LOAD_OP(U32, uint32_t)
+            LOAD_OP(U64, uint64_t)
+            LOAD_OP(F32, float)
+            LOAD_OP(F64, double)
+            LOAD_OP(Ptr, void*)
+            STORE_OP(I8, int8_t, pops<8>())
+            STORE_OP(I16, int16_t, pops<16>())
+            STORE_OP(I32, int32_t, pops<32>())
+            STORE_OP(I64, int64_t, pops<64>())
+            STORE_OP(U8, uint8_t, pop<8>())
+            STORE_OP(U16, uint16_t, pop<16>())
+            STORE_OP(U32, uint32_t, pop<32>())
+            STORE_OP(U64, uint64_t, pop<64>())
+            STORE_OP(F32, float, popf<32>())
+            STORE_OP(F64, double, popf<64>())
+            STORE_OP(Ptr, void*, pop_ptr<void>())
+            VM_CASE(PtrOff): stack.push(stack.pop_ptr<uint8_t>() + stack.pop<64>()); ip++; DISPATCH();
+            VM_CASE(FNeg32): stack.push(-stack.popf<32>()); ip++; DISPATCH();
+            VM_CASE(FNeg64): stack.push(-stack.popf<64>()); ip++; DISPATCH();
+            VM_CASE(Panic): {
                 if (in_panic) return VM::Type{ .u64 = 0 };
                 in_panic = true;
                 for (auto& [obj, destructor] : registered_objects) {
                     //run_code(destructor)
                 }
                 return VM::Type{ .u64 = 0 };
-                break;
             }
-            case PtrOffConst: stack.push(stack.pop_ptr<uint8_t>() + static_cast<uint8_t>(*++ip)); ip++; break;
-            case UConv:
-                {
-#define UNSIGNED_FROM_SWITCH(CODE)\
-    switch (from) {\
-        case 8: CODE (stack.pop<8>()); break;\
-        case 16: CODE (stack.pop<16>()); break;\
-        case 32: CODE (stack.pop<32>()); break;\
-        case 64: CODE (stack.pop<64>()); break;\
-    }
-                    auto from = static_cast<uint8_t>(*++ip);
-                    auto to = static_cast<uint8_t>(*++ip);
-                    switch (to)
-                    {
-                    case 8: UNSIGNED_FROM_SWITCH(stack.push<uint8_t>); break;
-                    case 16: UNSIGNED_FROM_SWITCH(stack.push<uint16_t>) break;
-                    case 32: UNSIGNED_FROM_SWITCH(stack.push<uint32_t>) break;
-                    case 64: UNSIGNED_FROM_SWITCH(stack.push<uint64_t>) break;
-                    }
-                    ip++; break;
-                }
-            case SConv:
-                {
-#define SIGNED_FROM_SWITCH(CODE)\
-    switch (from) {\
-    case 8: CODE (stack.pops<8>()); break;\
-    case 16: CODE (stack.pops<16>()); break;\
-    case 32: CODE (stack.pops<32>()); break;\
-    case 64: CODE (stack.pops<64>()); break;\
-    }
-                    auto from = static_cast<uint8_t>(*++ip);
-                    auto to = static_cast<uint8_t>(*++ip);
-                    switch (to)
-                    {
-                    case 8: UNSIGNED_FROM_SWITCH(stack.push<int8_t>); break;
-                    case 16: UNSIGNED_FROM_SWITCH(stack.push<int16_t>) break;
-                    case 32: UNSIGNED_FROM_SWITCH(stack.push<int32_t>) break;
-                    case 64: UNSIGNED_FROM_SWITCH(stack.push<int64_t>) break;
-                    }
-                    ip++; break;
-                }
-            case FpConv:
-                {
-#define FP_FROM_SWITCH(CODE)\
-    switch (from) {\
-    case 32: CODE (stack.popf<32>()); break;\
-    case 64: CODE (stack.popf<64>()); break;\
-    }
-                    auto from = static_cast<uint8_t>(*++ip);
-                    auto to = static_cast<uint8_t>(*++ip);
-                    switch (to)
-                    {
-                    case 32: FP_FROM_SWITCH(stack.push<float>) break;
-                    case 64: FP_FROM_SWITCH(stack.push<double>) break;
-                    }
-                    ip++; break;
-                }
-            case FpToSi:
-                break;
-            case FpToUi:
-                break;
-            case UiToFp:
-                break;
-            case SiToFp:
-                break;
-            case JumpIfFalse:
+            VM_CASE(Invalid): VM_PANIC();
+            VM_CASE(PtrOffConst): stack.push(stack.pop_ptr<uint8_t>() + ip->arg); ip++; DISPATCH();
+            INT_TO_INT(UCONV)
+            INT_TO_INT(SCONV)
+            VM_CASE(FpConv32To32): ip++; DISPATCH();
+            VM_CASE(FpConv32To64): stack.push(static_cast<double>(stack.popf<32>())); ip++; DISPATCH();
+            VM_CASE(FpConv64To32): stack.push(static_cast<float>(stack.popf<64>())); ip++; DISPATCH();
+            VM_CASE(FpConv64To64): ip++; DISPATCH();
+            FP_TO_INT(FP_TO_SI)
+            FP_TO_INT(FP_TO_UI)
+            INT_TO_FP(UI_TO_FP)
+            INT_TO_FP(SI_TO_FP)
+            VM_CASE(JumpIfFalse):
                 {
                     auto off = stack.pop<64>();
-                    if (stack.pop<8>() == 0) ip = reinterpret_cast<OpCode*>(base) + off;
+                    if (stack.pop<8>() == 0) ip = code + fn->index_of(off);
                     else ip++;
-                    break;
+                    DISPATCH();
+                }
+            VM_CASE(JumpIfFalseDirect):
+                {
+                    // the next instruction is the jump this was fused with
+                    if (stack.pop<8>() == 0) ip = code + ip->target;
+                    else ip += 2;
+                    DISPATCH();
                 }
-            case NativeCall:
+            VM_CASE(NativeCall):
                 {
-                    auto code = stack.pop_ptr<void>();
+                    auto function = stack.pop_ptr<void>();
                     auto proto = stack.pop_ptr<void>();
-                    auto arg_size_new = static_cast<size_t>(*++ip);
+                    auto arg_size_new = static_cast<size_t>(ip->arg);
                     auto arg_begin_new = stack.stack + stack.top - arg_size_new;
                     stack.top -= arg_size_new;
-                    auto val = vm.do_native_call(code, arg_begin_new, arg_size_new, proto);
+                    if constexpr (budgeted) deferrable_entry = innermost_entry;
+                    auto val = vm.native_thunks
+                        ? VM::Type{ .u64 = static_cast<const NativeProto*>(proto)->thunk(function, arg_begin_new) }
+                        : vm.do_native_call(function, arg_begin_new, arg_size_new, proto);
+                    if constexpr (budgeted) {
+                        deferrable_entry = nullptr;
+                        // parked after the call, resume pushes its value
+                        if (awaited) {
+                            suspended_call = Cursor{ fn, ip + 1, stack, checkpoint_base, entry_depth };
+                            return VM::Type{ .u64 = 0 };
+                        }
+                    }
                     stack.push(val);
                     ip++;
-                    break;
+                    DISPATCH();
+                }
+            VM_CASE(NativeCallDirect):
+                {
+                    // the proto under the arguments goes too, the native call this was fused with is skipped
+                    stack.top -= ip->arg + 1;
+                    auto entry = reinterpret_cast<VM::Type(*)(VM::Type*)>(ip->imm);
+                    if constexpr (budgeted) deferrable_entry = innermost_entry;
+                    auto val = entry(stack.stack + stack.top);
+                    if constexpr (budgeted) {
+                        deferrable_entry = nullptr;
+                        if (awaited) {
+                            suspended_call = Cursor{ fn, ip + 2, stack, checkpoint_base, entry_depth };
+                            return VM::Type{ .u64 = 0 };
+                        }
+                    }
+                    stack.push(val);
+                    ip += 2;
+                    DISPATCH();
                 }
-            case RegObj:
+            VM_CASE(RegObj):
                 {
                     auto destructor = stack.pop_ptr<uint64_t>();
                     auto obj = stack.peek_ptr<void>();
                     registered_objects[obj] = destructor;
-                    ip++; break;
+                    ip++; DISPATCH();
                 }
-            case CheckReg:
+            VM_CASE(CheckReg):
                 {
                     auto obj = stack.peek_ptr<void>();
                     stack.push<uint8_t>(registered_objects.contains(obj));
-                    break;
+                    ip++; DISPATCH();
                 }
-            case MemCpy: 
+            VM_CASE(MemCpy):
                 {
                     auto dest = stack.pop_ptr<void>();
                     auto src = stack.pop_ptr<const void>();
                     auto size = stack.pop<64>();
-                    memcpy(dest, src, size); ip++; break;
+                    memcpy(dest, src, size); ip++; DISPATCH();
                 }
-            case Malloc: stack.push(malloc(stack.pop<64>())); ip++; break;
-            case Free: free(stack.pop_ptr<void>()); ip++; break;
-            case PopReg:
+            VM_CASE(Malloc): stack.push(heap_alloc(stack.pop<64>())); ip++; DISPATCH();
+            VM_CASE(Free): if (!heap_free(stack.pop_ptr<void>())) VM_PANIC(); ip++; DISPATCH();
+            VM_CASE(PopReg):
                 {
                     auto obj = stack.peek_ptr<void>();
                     if (auto reg_it = registered_objects.find(obj); reg_it != registered_objects.end())
@@ -445,22 +991,73 @@ namespace Yvm
                         registered_objects.erase(reg_it);
                         stack.push<uint8_t>(1);
                     } else stack.push<uint8_t>(0);
-                    ip++; break;
+                    ip++; DISPATCH();
                 }
-            case Pop: stack.top--; ip++; break;
-            case Checkpoint: checkpoints[static_cast<uint8_t>(*++ip)] = static_cast<uint32_t>(stack.top - 1); ip++; break;
-            case FCmpEq: { FP_OP(uint8_t, ==) }
-            case FCmpNe: { FP_OP(uint8_t, !=) }
-            case FCmpGt: { FP_OP(uint8_t, >) }
-            case FCmpGe: { FP_OP(uint8_t, >=) }
-            case FCmpLt: { FP_OP(uint8_t, <) }
-            case FCmpLe: { FP_OP(uint8_t, <=) }
-            case Dup: stack.push(stack.stack[stack.top - 1]); ip++; break;
-            case Switch: std::swap(stack.stack[stack.top - 1], stack.stack[stack.top - 2]); ip++; break;
-            case ExternalIntrinsic: vm.intrinsic_handler(stack, static_cast<uint8_t>(*++ip), vm.ex_data); ip++; break;
+            VM_CASE(Pop): stack.top--; ip++; DISPATCH();
+            VM_CASE(Checkpoint): checkpoint_slots[checkpoint_base + ip->arg] = static_cast<uint32_t>(stack.top - 1); ip++; DISPATCH();
+            FP_CMP(FCmpEq, ==)
+            FP_CMP(FCmpNe, !=)
+            FP_CMP(FCmpGt, >)
+            FP_CMP(FCmpGe, >=)
+            FP_CMP(FCmpLt, <)
+            FP_CMP(FCmpLe, <=)
+            VM_CASE(Dup): stack.push(stack.stack[stack.top - 1]); ip++; DISPATCH();
+            VM_CASE(Switch): std::swap(stack.stack[stack.top - 1], stack.stack[stack.top - 2]); ip++; DISPATCH();
+            VM_CASE(ExternalIntrinsic): vm.intrinsic_handler(stack, ip->arg, vm.ex_data); ip++; DISPATCH();
+            LOAD_LOCAL_OP(I8, int8_t)
+            LOAD_LOCAL_OP(I16, int16_t)
+            LOAD_LOCAL_OP(I32, int32_t)
+            LOAD_LOCAL_OP(I64, int64_t)
+            LOAD_LOCAL_OP(U8, uint8_t)
+            LOAD_LOCAL_OP(U16, uint16_t)
+            LOAD_LOCAL_OP(U32, uint32_t)
+            LOAD_LOCAL_OP(U64, uint64_t)
+            LOAD_LOCAL_OP(F32, float)
+            LOAD_LOCAL_OP(F64, double)
+            LOAD_LOCAL_OP(Ptr, void*)
+            STORE_LOCAL_OP(I8, int8_t, pops<8>())
+            STORE_LOCAL_OP(I16, int16_t, pops<16>())
+            STORE_LOCAL_OP(I32, int32_t, pops<32>())
+            STORE_LOCAL_OP(I64, int64_t, pops<64>())
+            STORE_LOCAL_OP(U8, uint8_t, pop<8>())
+            STORE_LOCAL_OP(U16, uint16_t, pop<16>())
+            STORE_LOCAL_OP(U32, uint32_t, pop<32>())
+            STORE_LOCAL_OP(U64, uint64_t, pop<64>())
+            STORE_LOCAL_OP(F32, float, popf<32>())
+            STORE_LOCAL_OP(F64, double, popf<64>())
+            STORE_LOCAL_OP(Ptr, void*, pop_ptr<void>())
+            ADD_IMM(8)
+            ADD_IMM(16)
+            ADD_IMM(32)
+            ADD_IMM(64)
+            VM_CASE(BrIfFalse): ip = stack.pop<8>() ? ip + 1 : code + ip->target; DISPATCH();
+            VM_CASE(BrIfTrue): ip = stack.pop<8>() ? code + ip->target : ip + 1; DISPATCH();
+            INT_CMP_JUMP(CmpEq, pop, ==)
+            INT_CMP_JUMP(CmpNe, pop, !=)
+            INT_CMP_JUMP(UCmpGt, pop, >)
+            INT_CMP_JUMP(UCmpGe, pop, >=)
+            INT_CMP_JUMP(UCmpLt, pop, <)
+            INT_CMP_JUMP(UCmpLe, pop, <=)
+            INT_CMP_JUMP(ICmpGt, pops, >)
+            INT_CMP_JUMP(ICmpGe, pops, >=)
+            INT_CMP_JUMP(ICmpLt, pops, <)
+            INT_CMP_JUMP(ICmpLe, pops, <=)
+            FP_CMP_JUMP(FCmpEq, ==)
+            FP_CMP_JUMP(FCmpNe, !=)
+            FP_CMP_JUMP(FCmpGt, >)
+            FP_CMP_JUMP(FCmpGe, >=)
+            FP_CMP_JUMP(FCmpLt, <)
+            FP_CMP_JUMP(FCmpLe, <=)
+#if YVM_COMPUTED_GOTO
+        }
+#else
             }
 
         }
+#endif
     }
+#if YVM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
 
 }
@@ -0,0 +1,481 @@
+// Differential test of the JIT against the interpreter, run it with `meson test`.
+// Every case is run interpreted (jit_threshold = 0) then compiled (jit_threshold = 1), both have to return the same
+// value and agree on whether it panicked. Each case is emitted plainly and fused into superinstructions,
+// and together the cases have to compile every operation the JIT translates.
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "yoyo_vm/vm.h"
+#include "yoyo_vm/assembler.h"
+#include "yoyo_vm/decoder.h"
+#include "yoyo_vm/emitter.h"
+#include "yoyo_vm/instructions.h"
+
+using namespace Yvm;
+
+namespace
+{
+    struct Case
+    {
+        std::string name;
+        /// writes the function, unless it's given as a @c listing
+        std::function<void(Emitter&)> emit;
+        /// assembled instead of emitted, see @c assemble_with_offsets
+        std::string listing;
+        std::vector<uint64_t> args;
+        /// the bits of the result that are compared, narrow results leave the rest of the slot undefined
+        uint64_t mask = ~uint64_t{ 0 };
+        /// whether the JIT has to compile it
+        bool compiles = true;
+    };
+
+    uint64_t bits(int width)
+    {
+        return width == 64 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << width) - 1;
+    }
+
+    /// operations the JIT leaves to the interpreter, every other one has to be compiled by some case
+    bool interpreted_only(DecodedOp op)
+    {
+        using enum DecodedOp;
+        switch (op) {
+        case ExternalIntrinsic: case Jump: case JumpIfFalse: case RegObj: case CheckReg: case PopReg:
+        case Checkpoint: case StackCheckpoint:
+        case FpToUi32To64: case FpToUi64To64: case UiToFp64To32: case UiToFp64To64:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    /// Assemble @p listing, an @c @N operand is replaced by the byte offset of the listing's N-th instruction.
+    /// Jumps fused with a constant are only written this way, the emitter turns them into branches
+    std::vector<uint64_t> assemble_with_offsets(std::string_view listing)
+    {
+        auto substitute = [&](const DecodedFunction* fn) {
+            std::string result;
+            for (size_t i = 0; i < listing.size(); i++) {
+                if (listing[i] != '@') {
+                    result += listing[i];
+                    continue;
+                }
+                size_t index = 0;
+                while (i + 1 < listing.size() && listing[i + 1] >= '0' && listing[i + 1] <= '9')
+                    index = index * 10 + static_cast<size_t>(listing[++i] - '0');
+                result += std::to_string(fn ? fn->offsets[index] : 0);
+            }
+            return result;
+        };
+        Assembler assembler;
+        auto first = assembler.assemble(substitute(nullptr));
+        // the constants holding offsets keep their size, so the offsets don't move
+        auto decoded = decode(first);
+        return assembler.assemble(substitute(&decoded));
+    }
+
+    VM::Type native_call(void* function, VM::Type* args, size_t count, void* proto)
+    {
+        auto result = reinterpret_cast<uint64_t>(proto);
+        for (size_t i = 0; i < count; i++) result = result * 31 + args[i].u64;
+        return VM::Type{ .u64 = result + reinterpret_cast<uint64_t>(function) };
+    }
+    uint64_t mix(uint64_t a, int32_t b)
+    {
+        return a * 31 + static_cast<uint64_t>(b);
+    }
+
+    std::vector<Case> make_cases()
+    {
+        using enum OpCode;
+        std::vector<Case> cases;
+        auto add = [&](std::string name, std::function<void(Emitter&)> emit, std::vector<uint64_t> args = {},
+            uint64_t mask = ~uint64_t{ 0 }, bool compiles = true) {
+            cases.push_back({ name + "_" + std::to_string(cases.size()), std::move(emit), {}, std::move(args), mask, compiles });
+        };
+        constexpr int widths[] = { 8, 16, 32, 64 };
+        // pairs of operands, the right hand sides are never 0 or -1 so every division is defined
+        constexpr std::pair<uint64_t, uint64_t> int_operands[] = {
+            { 0, 3 }, { 5, 7 }, { uint64_t(-100), 7 }, { 0x7f, uint64_t(-5) },
+            { 0x8000000000000000, 3 }, { 0xfedcba9876543210, 0x0123456789abcdef },
+        };
+
+        for (int family = 0; family < 7; family++) for (int w = 0; w < 4; w++) for (auto operands : int_operands) {
+            auto lhs = operands.first, rhs = operands.second;
+            auto op = static_cast<OpCode>(static_cast<int>(Add8) + family * 4 + w);
+            // a small left hand side is fused with an addition into add_imm
+            add("int", [=](Emitter& e) { e.write_const(rhs); e.write_const(lhs); e.write_1b_inst(op); e.write_1b_inst(Ret); },
+                {}, bits(widths[w]));
+        }
+        for (auto op : { Shl, Shr, BitAnd, BitOr, BitXor }) for (int width : widths) for (auto operands : int_operands) {
+            auto lhs = operands.first;
+            auto amount = op == Shl || op == Shr ? operands.second % width : operands.second;
+            add("bits", [=](Emitter& e) { e.write_const(amount); e.write_const(lhs); e.write_2b_inst(op, width); e.write_1b_inst(Ret); },
+                {}, bits(width));
+        }
+        // compared as values, and in the fused form as the condition of a branch
+        for (auto op : { CmpEq, CmpNe, UCmpGt, UCmpGe, UCmpLt, UCmpLe, ICmpGt, ICmpGe, ICmpLt, ICmpLe })
+            for (int width : widths) for (auto operands : { int_operands[1], int_operands[2], int_operands[5], std::pair{ uint64_t(9), uint64_t(9) } }) {
+                auto lhs = operands.first, rhs = operands.second;
+                add("cmp", [=](Emitter& e) { e.write_const(rhs); e.write_const(lhs); e.write_2b_inst(op, width); e.write_1b_inst(Ret); },
+                    {}, 0xff);
+                add("cmp_branch", [=](Emitter& e) {
+                    auto other = e.unq_label_name("other");
+                    e.write_const(rhs); e.write_const(lhs); e.write_2b_inst(op, width);
+                    e.create_jump(JumpIfFalse, other);
+                    e.write_const(uint64_t{ 1 }); e.write_1b_inst(Ret);
+                    e.create_label(other);
+                    e.write_const(uint64_t{ 2 }); e.write_1b_inst(Ret);
+                    });
+            }
+        for (auto op : { FCmpEq, FCmpNe, FCmpGt, FCmpGe, FCmpLt, FCmpLe })
+            for (double lhs : { 1.5, -7.0, std::numeric_limits<double>::quiet_NaN() }) for (double rhs : { 1.5, 0.0, std::numeric_limits<double>::quiet_NaN() }) {
+                for (int width : { 32, 64 }) {
+                    auto push = [=](Emitter& e, double value) {
+                        if (width == 32) e.write_const(static_cast<float>(value));
+                        else e.write_const(value);
+                    };
+                    add("fcmp", [=](Emitter& e) { push(e, rhs); push(e, lhs); e.write_2b_inst(op, width); e.write_1b_inst(Ret); }, {}, 0xff);
+                    add("fcmp_branch", [=](Emitter& e) {
+                        auto other = e.unq_label_name("other");
+                        push(e, rhs); push(e, lhs); e.write_2b_inst(op, width);
+                        e.create_jump(JumpIfFalse, other);
+                        e.write_const(uint64_t{ 1 }); e.write_1b_inst(Ret);
+                        e.create_label(other);
+                        e.write_const(uint64_t{ 2 }); e.write_1b_inst(Ret);
+                        });
+                }
+            }
+        for (int k = 0; k < 4; k++) for (double lhs : { 1.5, -3.0, 1e3 }) {
+            add("float64", [=](Emitter& e) {
+                e.write_const(0.75); e.write_const(lhs);
+                e.write_1b_inst(static_cast<OpCode>(static_cast<int>(FAdd64) + 2 * k)); e.write_1b_inst(FNeg64); e.write_1b_inst(Ret);
+                });
+            add("float32", [=](Emitter& e) {
+                e.write_const(0.75f); e.write_const(static_cast<float>(lhs));
+                e.write_1b_inst(static_cast<OpCode>(static_cast<int>(FAdd32) + 2 * k)); e.write_1b_inst(FNeg32); e.write_1b_inst(Ret);
+                }, {}, bits(32));
+        }
+
+        for (auto op : { UConv, SConv }) for (int from : widths) for (int to : widths) for (uint64_t value : { uint64_t{ 0x80 }, uint64_t{ 0xfedcba9876543210 }, uint64_t{ 5 } })
+            add("conv", [=](Emitter& e) { e.write_const(value); e.write_3b_inst(op, from, to); e.write_1b_inst(Ret); }, {}, bits(to));
+        for (int from : { 32, 64 }) for (int to : { 32, 64 })
+            add("fpconv", [=](Emitter& e) {
+                if (from == 32) e.write_const(2.75f);
+                else e.write_const(-1.25);
+                e.write_3b_inst(FpConv, from, to); e.write_1b_inst(Ret);
+                }, {}, bits(to));
+        for (int from : { 32, 64 }) for (int to : widths) for (double value : { 3.7, -3.7, 100.2 }) {
+            auto push = [=](Emitter& e) {
+                if (from == 32) e.write_const(static_cast<float>(value));
+                else e.write_const(value);
+            };
+            add("fptosi", [=](Emitter& e) { push(e); e.write_3b_inst(FpToSi, from, to); e.write_1b_inst(Ret); }, {}, bits(to));
+            if (value > 0 && to != 64)
+                add("fptoui", [=](Emitter& e) { push(e); e.write_3b_inst(FpToUi, from, to); e.write_1b_inst(Ret); }, {}, bits(to));
+        }
+        for (int from : widths) for (int to : { 32, 64 }) for (uint64_t value : { uint64_t{ 5 }, uint64_t{ 0xffffffffffffff85 } }) {
+            add("sitofp", [=](Emitter& e) { e.write_const(value); e.write_3b_inst(SiToFp, from, to); e.write_1b_inst(Ret); }, {}, bits(to));
+            if (from != 64)
+                add("uitofp", [=](Emitter& e) { e.write_const(value); e.write_3b_inst(UiToFp, from, to); e.write_1b_inst(Ret); }, {}, bits(to));
+        }
+
+        // stores then loads every type through a local, in the fused form as load_local and store_local
+        for (uint8_t type = 0; type < 11; type++) {
+            constexpr int type_widths[] = { 8, 16, 32, 64, 8, 16, 32, 64, 32, 64, 64 };
+            add("load_store", [=](Emitter& e) {
+                e.add_function_params(1);
+                e.write_alloca(8);
+                e.write_const(uint64_t{ 0x1111111111111111 }); e.write_2b_inst(StackAddr, 1); e.write_2b_inst(Store, Type::u64);
+                e.write_2b_inst(StackAddr, 0); e.write_2b_inst(StackAddr, 1); e.write_2b_inst(Store, type);
+                e.write_2b_inst(StackAddr, 1); e.write_2b_inst(Load, Type::u64);
+                e.write_2b_inst(StackAddr, 1); e.write_2b_inst(Load, type);
+                if (type_widths[type] < 64) e.write_3b_inst(UConv, type_widths[type], 64);
+                e.write_1b_inst(Add64); e.write_1b_inst(Ret);
+                }, { 0x8899aabbccddeeff });
+        }
+        add("stack", [](Emitter& e) {
+            e.add_function_params(2);
+            e.write_2b_inst(StackAddr, 0); e.write_1b_inst(Dup); e.write_2b_inst(StackAddr, 1); e.write_1b_inst(Switch);
+            e.write_1b_inst(Sub64); e.write_1b_inst(Add64);
+            e.write_const(uint64_t{ 9 }); e.write_1b_inst(Switch); e.write_1b_inst(TopConsume);
+            e.write_2b_inst(RevStackAddr, 0); e.write_1b_inst(Pop); e.write_1b_inst(Nop); e.write_1b_inst(Ret);
+            }, { 0x123456789abcdef0, 0xfedcba9876543 });
+        add("bool", [](Emitter& e) {
+            e.add_function_params(2);
+            e.write_2b_inst(StackAddr, 0); e.write_2b_inst(StackAddr, 1); e.write_1b_inst(And);
+            e.write_2b_inst(StackAddr, 0); e.write_1b_inst(Not); e.write_1b_inst(Or); e.write_1b_inst(Not); e.write_1b_inst(Ret);
+            }, { 1, 0 }, 0xff);
+        add("ptr_off", [](Emitter& e) {
+            e.add_function_params(1);
+            e.write_const(uint64_t{ 16 }); e.write_2b_inst(StackAddr, 0); e.write_1b_inst(PtrOff); e.write_2b_inst(PtrOffConst, 200);
+            e.write_1b_inst(Ret);
+            }, { 1000 });
+        // the memory is only compared through what's read back from it
+        add("heap", [](Emitter& e) {
+            e.write_const(uint64_t{ 16 }); e.write_1b_inst(Malloc);
+            e.write_const(uint64_t{ 42 }); e.write_2b_inst(RevStackAddr, 1); e.write_2b_inst(Store, Type::u64);
+            e.write_const(uint64_t{ 8 }); e.write_2b_inst(RevStackAddr, 1); e.write_2b_inst(RevStackAddr, 2); e.write_2b_inst(PtrOffConst, 8);
+            e.write_1b_inst(MemCpy);
+            e.write_2b_inst(RevStackAddr, 0); e.write_2b_inst(PtrOffConst, 8); e.write_2b_inst(Load, Type::u64);
+            e.write_1b_inst(Switch); e.write_1b_inst(Free); e.write_1b_inst(Ret);
+            });
+        add("alloca", [](Emitter& e) {
+            e.add_function_params(1);
+            e.write_alloca(300);
+            e.write_2b_inst(StackAddr, 0); e.write_2b_inst(StackAddr, 1); e.write_2b_inst(PtrOffConst, 200); e.write_2b_inst(Store, Type::u64);
+            e.write_2b_inst(StackAddr, 1); e.write_2b_inst(PtrOffConst, 200); e.write_2b_inst(Load, Type::u64); e.write_1b_inst(Ret);
+            }, { 77 });
+
+        add("fib", [](Emitter& e) {
+            e.add_function_params(1);
+            auto recurse = e.unq_label_name("recurse");
+            e.write_const(uint64_t{ 2 }); e.write_2b_inst(StackAddr, 0); e.write_2b_inst(UCmpLt, 64); e.write_1b_inst(Not);
+            e.create_jump(JumpIfFalse, recurse);
+            e.write_const(uint64_t{ 1 }); e.write_2b_inst(StackAddr, 0); e.write_1b_inst(Sub64); e.write_fn_addr("fib"); e.write_2b_inst(Call, 1);
+            e.write_const(uint64_t{ 2 }); e.write_2b_inst(StackAddr, 0); e.write_1b_inst(Sub64); e.write_fn_addr("fib"); e.write_2b_inst(Call, 1);
+            e.write_1b_inst(Add64); e.write_1b_inst(Ret);
+            e.create_label(recurse);
+            e.write_2b_inst(StackAddr, 0); e.write_1b_inst(Ret);
+            }, { 20 });
+        // a callee the JIT can't compile is run by the interpreter
+        add("call_interpreted", [](Emitter& e) {
+            e.write_const(uint64_t{ 4 }); e.write_const(uint64_t{ 10 }); e.write_fn_addr("interpreted"); e.write_2b_inst(Call, 2);
+            e.write_const(uint64_t{ 1 }); e.write_1b_inst(Add64); e.write_1b_inst(Ret);
+            });
+        // the nop keeps the address from being bound to the call
+        add("call_dynamic", [](Emitter& e) {
+            e.write_const(uint64_t{ 6 }); e.write_fn_addr("increment"); e.write_1b_inst(Nop); e.write_2b_inst(Call, 1);
+            e.write_1b_inst(Ret);
+            });
+        // the call bound to increment is also reached from a branch with another callee
+        for (uint64_t arg : { 0, 1 })
+            add("call_fused_branch", [](Emitter& e) {
+                e.add_function_params(1);
+                auto other = e.unq_label_name("other");
+                auto call = e.unq_label_name("call");
+                e.write_2b_inst(StackAddr, 0); e.create_jump(JumpIfFalse, other);
+                e.write_const(uint64_t{ 5 }); e.write_fn_addr("increment");
+                e.create_label(call);
+                e.write_2b_inst(Call, 1); e.write_1b_inst(Ret);
+                e.create_label(other);
+                e.write_const(uint64_t{ 100 }); e.write_fn_addr("double"); e.create_jump(Jump, call);
+                }, { arg });
+        add("native", [](Emitter& e) {
+            e.write_const(uint64_t{ 3 }); e.write_const(uint64_t{ 4 });
+            e.write_const(uint64_t{ 100 }); e.write_const(uint64_t{ 7 }); e.write_2b_inst(NativeCall, 2);
+            e.write_1b_inst(Ret);
+            });
+        add("native_bound", [](Emitter& e) {
+            e.write_const(uint64_t{ 3 }); e.write_const(int32_t{ -4 }); e.write_native_call("mix", 2); e.write_1b_inst(Ret);
+            });
+
+        // the native call bound to mix is also reached from a branch with a function that isn't bound
+        for (uint64_t arg : { 0, 1 })
+            add("native_fused_branch", [](Emitter& e) {
+                e.add_function_params(1);
+                auto other = e.unq_label_name("other");
+                auto call = e.unq_label_name("call");
+                e.write_2b_inst(StackAddr, 0); e.create_jump(JumpIfFalse, other);
+                e.write_const(uint64_t{ 3 }); e.write_const(int32_t{ -4 });
+                e.write_const<void*>(nullptr); e.write_fn_addr("mix");
+                e.create_label(call);
+                e.write_2b_inst(NativeCall, 2); e.write_1b_inst(Ret);
+                e.create_label(other);
+                e.write_const(uint64_t{ 3 }); e.write_const(int32_t{ -4 });
+                e.write_const(uint64_t{ 100 }); e.write_const(uint64_t{ 7 }); e.create_jump(Jump, call);
+                }, { arg });
+
+        // branches of each offset size, back and forth
+        for (int distance : { 10, 200, 40000 }) for (uint64_t arg : { 0, 1 })
+            add("branch", [=](Emitter& e) {
+                e.add_function_params(1);
+                auto skip = e.unq_label_name("skip");
+                auto back = e.unq_label_name("back");
+                e.write_2b_inst(StackAddr, 0); e.create_jump(JumpIfFalse, skip);
+                for (int k = 0; k < distance; k++) e.write_1b_inst(Nop);
+                e.create_label(back);
+                e.write_const(uint64_t{ 5 }); e.write_1b_inst(Ret);
+                e.create_label(skip);
+                for (int k = 0; k < distance; k++) e.write_1b_inst(Nop);
+                e.write_const(uint64_t{ 1 }); e.write_2b_inst(StackAddr, 0); e.write_1b_inst(Add64);
+                e.write_const(uint64_t{ 3 }); e.write_2b_inst(UCmpLt, 64); e.write_1b_inst(Not);
+                e.create_jump(JumpIfFalse, back);
+                e.write_const(uint64_t{ 7 }); e.write_1b_inst(Ret);
+                }, { arg });
+        for (uint64_t arg : { 0, 1 })
+            add("loop", [](Emitter& e) {
+                e.add_function_params(1);
+                e.write_alloca(8);
+                e.write_const(uint64_t{ 0 }); e.write_2b_inst(StackAddr, 1); e.write_2b_inst(Store, Type::u64);
+                auto condition = e.create_label("condition");
+                auto end = e.unq_label_name("end");
+                e.write_2b_inst(StackAddr, 0); e.write_2b_inst(StackAddr, 1); e.write_2b_inst(Load, Type::u64); e.write_2b_inst(UCmpLt, 64);
+                e.create_jump(JumpIfFalse, end);
+                e.write_2b_inst(StackAddr, 1); e.write_2b_inst(Load, Type::u64); e.write_const(uint64_t{ 1 }); e.write_1b_inst(Add64);
+                e.write_2b_inst(StackAddr, 1); e.write_2b_inst(Store, Type::u64);
+                e.create_jump(Jump, condition);
+                e.create_label(end);
+                e.write_2b_inst(StackAddr, 1); e.write_2b_inst(Load, Type::u64); e.write_1b_inst(Ret);
+                }, { arg * 100000 });
+        for (uint64_t arg : { 0, 1 }) {
+            cases.push_back({ "jump_fused_" + std::to_string(cases.size()), {}, R"(
+    s_addr 0
+    const64_u16 @5
+    jump_if_f_dyn
+    const64_u8 1
+    ret
+    const64_u8 2
+    ret
+)", { arg } });
+        }
+        add("ret_void", [](Emitter& e) { e.write_const(uint64_t{ 1 }); e.write_1b_inst(Pop); e.write_1b_inst(RetVoid); }, {}, 0);
+        add("panic", [](Emitter& e) { e.write_const(uint64_t{ 4 }); e.write_1b_inst(Panic); });
+        // runs out of frames
+        add("recurse_forever", [](Emitter& e) {
+            e.add_function_params(1);
+            e.write_2b_inst(StackAddr, 0); e.write_fn_addr("recurse_forever"); e.write_2b_inst(Call, 1); e.write_1b_inst(Ret);
+            }, { 1 });
+        add("checkpoint", [](Emitter& e) {
+            e.write_const(uint64_t{ 11 }); e.checkpoint(); e.write_const(uint64_t{ 5 }); e.write_2b_inst(StackCheckpoint, 0);
+            e.write_1b_inst(Add64); e.write_1b_inst(Ret);
+            }, {}, ~uint64_t{ 0 }, false);
+        return cases;
+    }
+
+    /// whether functions get compiled at all, builds without the JIT or on other targets never do
+    bool jit_available()
+    {
+        VM vm;
+        vm.jit_threshold = 1;
+        Module module;
+        Emitter e(false);
+        e.write_const(uint64_t{ 1 }); e.write_1b_inst(OpCode::Ret);
+        e.close_function(&module, "one");
+        vm.add_module(&module);
+        vm.link();
+        auto code = module.code["one"].data();
+        vm.new_runner().run_code(code, nullptr, 0);
+        return vm.find_function(code)->jit_entry != nullptr;
+    }
+
+    /// functions the cases call that aren't cases themselves
+    void emit_callees(Module& module)
+    {
+        using enum OpCode;
+        {
+            // checkpoints keep it interpreted
+            Emitter e(false);
+            e.add_function_params(2);
+            e.write_const(uint64_t{ 0 }); e.checkpoint(); e.write_1b_inst(Pop);
+            e.write_2b_inst(StackAddr, 1); e.write_2b_inst(StackAddr, 0); e.write_1b_inst(Sub64); e.write_1b_inst(Ret);
+            e.close_function(&module, "interpreted");
+        }
+        {
+            Emitter e(false);
+            e.add_function_params(1);
+            e.write_const(uint64_t{ 1 }); e.write_2b_inst(StackAddr, 0); e.write_1b_inst(Add64); e.write_1b_inst(Ret);
+            e.close_function(&module, "increment");
+        }
+        {
+            Emitter e(false);
+            e.add_function_params(1);
+            e.write_2b_inst(StackAddr, 0); e.write_2b_inst(StackAddr, 0); e.write_1b_inst(Add64); e.write_1b_inst(Ret);
+            e.close_function(&module, "double");
+        }
+    }
+}
+
+int main()
+{
+    // meson counts 77 as skipped
+    if (!jit_available()) {
+        std::cout << "the JIT isn't available\n";
+        return 77;
+    }
+    auto cases = make_cases();
+    int failures = 0;
+    std::vector<bool> covered(decoded_op_count);
+    for (bool superinstructions : { false, true }) {
+        VM vm;
+        vm.do_native_call = native_call;
+        vm.bind<&mix>("mix");
+        Module module;
+        emit_callees(module);
+        for (auto& test : cases) {
+            // a case calling itself does it by the name it's emitted under
+            if (!test.listing.empty()) {
+                module.code[test.name] = assemble_with_offsets(test.listing);
+                continue;
+            }
+            Emitter e(false);
+            e.superinstructions = superinstructions;
+            test.emit(e);
+            auto name = test.name.starts_with("fib_") ? "fib" : test.name.starts_with("recurse_forever_") ? "recurse_forever" : test.name;
+            e.close_function(&module, name);
+        }
+        for (auto& [name, error] : vm.add_module(&module)) {
+            std::cout << "rejected " << name << " at " << error.offset << ": " << error.message << "\n";
+            failures++;
+        }
+        for (auto& name : vm.link()) {
+            std::cout << "unresolved " << name << "\n";
+            failures++;
+        }
+        auto code_of = [&](const Case& test) -> uint64_t* {
+            if (test.name.starts_with("fib_")) return module.code["fib"].data();
+            if (test.name.starts_with("recurse_forever_")) return module.code["recurse_forever"].data();
+            return module.code[test.name].data();
+        };
+        auto run = [&](const Case& test, bool& panicked) {
+            auto runner = vm.new_runner(RunnerConfig{ .stack_slots = 1 << 18, .alloca_bytes = 1 << 16 });
+            std::vector<VM::Type> args;
+            for (auto arg : test.args) args.push_back(VM::Type{ .u64 = arg });
+            auto result = runner.run_code(code_of(test), args.data(), args.size());
+            panicked = runner.in_panic;
+            return result.u64 & test.mask;
+        };
+
+        // everything is interpreted before anything is compiled, a compiled callee would be entered by the interpreter too
+        vm.jit_threshold = 0;
+        std::vector<std::pair<uint64_t, bool>> expected;
+        for (auto& test : cases) {
+            bool panicked;
+            auto result = run(test, panicked);
+            expected.emplace_back(result, panicked);
+        }
+        vm.jit_threshold = 1;
+        for (size_t i = 0; i < cases.size(); i++) {
+            auto& test = cases[i];
+            bool panicked;
+            auto result = run(test, panicked);
+            auto fn = vm.find_function(code_of(test));
+            auto is_compiled = fn->jit_entry != nullptr;
+            if (is_compiled) {
+                for (auto& inst : fn->code) covered[static_cast<size_t>(inst.op)] = true;
+            }
+            auto form = superinstructions ? " (superinstructions)" : "";
+            if (is_compiled != test.compiles) {
+                std::cout << test.name << form << (is_compiled ? " was compiled\n" : " wasn't compiled\n");
+                failures++;
+            }
+            if (panicked != expected[i].second || (!panicked && result != expected[i].first)) {
+                std::cout << test.name << form << ": interpreted " << std::hex << expected[i].first << " panicked " << expected[i].second
+                    << ", compiled " << result << " panicked " << panicked << std::dec << "\n";
+                failures++;
+            }
+        }
+    }
+    for (size_t op = 0; op < decoded_op_count; op++) {
+        if (covered[op] || interpreted_only(static_cast<DecodedOp>(op))) continue;
+        std::cout << "no case compiles " << operation_name(static_cast<DecodedOp>(op)) << "\n";
+        failures++;
+    }
+    std::cout << cases.size() << " cases, " << failures << " failures\n";
+    return failures == 0 ? 0 : 1;
+}